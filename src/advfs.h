@@ -24,10 +24,9 @@
 #ifndef _ADVFS_H
 #define _ADVFS_H
 
-#define FUSE_USE_VERSION  28
-
 #include "config.h"
 #include <stdint.h>
+#include <time.h>
 
 /* OpenSSL */
 #include <openssl/crypto.h>
@@ -42,6 +41,91 @@
 #define ADVFS_BLOCK_NUM         10240
 #define ADVFS_INODE_NUM         128
 #define ADVFS_INODE_BLOCKPTR    16
+#define ADVFS_MAX_WRITE         (1024 * 1024)
+#define ADVFS_DIGEST_BUCKETS    64
+
+/* Data block size classes: 4 KiB, 64 KiB and 1 MiB.  A block of a larger
+   class is a run of contiguous physical blocks. */
+#define ADVFS_BCLASS_NUM        3
+#define ADVFS_BCLASS_SHIFT(c)   (4 * (c))
+#define ADVFS_BCLASS_BLOCKS(c)  (1ULL << ADVFS_BCLASS_SHIFT(c))
+#define ADVFS_BCLASS_SIZE(c)    (ADVFS_BLOCK_SIZE * ADVFS_BCLASS_BLOCKS(c))
+/* The size heuristic picks the largest class of which the file has at
+   least this number of blocks */
+#define ADVFS_BCLASS_MIN_BLOCKS 16
+/* Root directory policy chosen by the size heuristic */
+#define ADVFS_BCLASS_AUTO       (-1)
+
+/* Snapshots; the inodes in the copy of the inode table of the snapshot s are
+   numbered from ADVFS_INODE_NUM * (s + 1) */
+#define ADVFS_SNAPSHOT_NUM      16
+#define ADVFS_SNAPSHOT_NAME_MAX 63
+#define ADVFS_INODE_BASE(nr)    ((nr) - (nr) % ADVFS_INODE_NUM)
+/* Inodes of the snapshots and the virtual directories are read-only */
+#define ADVFS_INODE_READONLY(nr)    ((nr) >= ADVFS_INODE_NUM)
+
+/* Virtual directories of the control namespace (not listed in the root) */
+#define ADVFS_CTL_DIR           "/.advfs"
+#define ADVFS_SNAPSHOT_DIR      ADVFS_CTL_DIR "/snapshots"
+#define ADVFS_VINODE_CTL        (ADVFS_INODE_NUM * (ADVFS_SNAPSHOT_NUM + 1))
+#define ADVFS_VINODE_SNAPSHOTS  (ADVFS_VINODE_CTL + 1)
+#define ADVFS_BYHASH_DIR        ADVFS_CTL_DIR "/by-hash"
+#define ADVFS_VINODE_BYHASH     (ADVFS_VINODE_CTL + 2)
+/* Read-only aliases under ADVFS_BYHASH_DIR: a live file by its digest and a
+   stored block by its hash value (for root and the owner of the mount only),
+   numbered by the inode and the block */
+#define ADVFS_VINODE_FILE       (ADVFS_VINODE_CTL + ADVFS_INODE_NUM)
+#define ADVFS_VINODE_BLOCK      (ADVFS_VINODE_FILE + ADVFS_INODE_NUM)
+
+/* Backing image: the signature in the superblock, and the metadata journal
+   next to the image (the path of the image with the suffix) */
+#define ADVFS_IMAGE_MAGIC       "ADVFSIMG"
+#define ADVFS_JOURNAL_MAGIC     "ADVFSJNL"
+#define ADVFS_JOURNAL_SUFFIX    ".journal"
+/* Default interval of the group commit in seconds, the # of dirty blocks
+   that forces a commit, and the journal size that forces a checkpoint */
+#define ADVFS_COMMIT_INTERVAL   5
+#define ADVFS_COMMIT_BLOCKS     2048
+#define ADVFS_JOURNAL_MAX       (64ULL << 20)
+/* Log-structured layout of the image: the segments follow the header
+   block, and the log has twice the capacity of the device */
+#define ADVFS_LOG_MAGIC         "ADVFSLOG"
+#define ADVFS_SEGMENT_BLOCKS    256
+#define ADVFS_SEGMENT_NUM       (2 * ADVFS_BLOCK_NUM / ADVFS_SEGMENT_BLOCKS)
+/* Segment cleaner: it runs when the # of free segments falls below the low
+   watermark, relocating up to the budget of blocks per commit (the default),
+   and up to the budget times the urgent factor below the minimum */
+#define ADVFS_CLEAN_LOW         16
+#define ADVFS_CLEAN_MIN         4
+#define ADVFS_CLEAN_BUDGET      512
+#define ADVFS_CLEAN_URGENT      4
+/* Maximum # of threads rebuilding the reference counters at mount */
+#define ADVFS_REBUILD_THREADS_MAX   16
+
+/* Compressed blocks: their ids follow the physical blocks, and the content
+   is packed in the slots of a pack block */
+#define ADVFS_ZBLOCK_BASE       ADVFS_BLOCK_NUM
+#define ADVFS_ZBLOCK_NUM        ADVFS_BLOCK_NUM
+#define ADVFS_ZSLOT_SIZE        512
+#define ADVFS_ZSLOT_NUM         (ADVFS_BLOCK_SIZE / ADVFS_ZSLOT_SIZE)
+#define ADVFS_ZCACHE_NUM        64
+/* Blocks with the higher byte entropy (in 1/256 bits per byte) are stored
+   without trying to compress */
+#define ADVFS_ZENTROPY_MAX      (7 * 256 + 128)
+/* Consecutive failures before a file stops compressing, and the maximum
+   number of blocks skipped before it tries again */
+#define ADVFS_ZBACKOFF_FAILS    8
+#define ADVFS_ZBACKOFF_MAX      1024
+
+/* Content-defined chunk sizes */
+#define ADVFS_CDC_MIN           2048
+#define ADVFS_CDC_AVG           8192
+#define ADVFS_CDC_MAX           16384
+/* Longest extent of the zeros appended to a chunked file (a hole) */
+#define ADVFS_EXTENT_LEN_MAX    (1U << 30)
+
+/* A removed directory slot (inode 0 is the root, never a child) */
+#define ADVFS_DIR_TOMBSTONE     0
 
 /*
  * type
@@ -52,6 +136,37 @@ typedef enum {
     ADVFS_DIR,
 } advfs_entry_type_t;
 
+/*
+ * compression algorithm
+ */
+typedef enum {
+    ADVFS_COMPRESS_NONE,
+    ADVFS_COMPRESS_LZ4,
+    ADVFS_COMPRESS_ZSTD,
+} advfs_compress_t;
+
+/*
+ * chunking of the files
+ */
+typedef enum {
+    /* Fixed blocks at the offsets of the multiples of the block size */
+    ADVFS_CHUNK_FIXED,
+    /* Content-defined chunks mapped by the extents (sealed at release) */
+    ADVFS_CHUNK_CDC,
+} advfs_chunking_t;
+
+/*
+ * block type
+ */
+typedef enum {
+    /* Content-addressed data block (in the dedup index) */
+    ADVFS_BLOCK_DATA,
+    /* Metadata block updated in place (directory, chain) */
+    ADVFS_BLOCK_META,
+    /* Block holding compressed blocks in the slots */
+    ADVFS_BLOCK_PACK,
+} advfs_block_type_t;
+
 /*
  * free list
  */
@@ -71,8 +186,37 @@ typedef struct {
     uint64_t left;
     /* Right */
     uint64_t right;
+    /* Block type */
+    uint64_t type;
+    /* Compressed block: the pack block, the first slot, the algorithm and
+       the compressed length */
+    uint64_t zblock;
+    uint16_t zslot;
+    uint16_t zalg;
+    uint32_t zlen;
+    /* Pack block: the bitmap of the used slots (ref counts the blocks) */
+    uint64_t zmask;
+    /* Block size class of a data block (the first block of the run) */
+    uint64_t bclass;
 } __attribute__ ((packed, aligned(128))) advfs_block_mgt_t;
 
+/*
+ * inode flags
+ */
+/* The digest in the attributes is up to date */
+#define ADVFS_INODE_DIGEST      (1 << 0)
+/* Being ingested as a duplicate of a known file (until released) */
+#define ADVFS_INODE_INGEST      (1 << 1)
+/* Block size class of the file, or of the files created in the directory */
+#define ADVFS_INODE_BCLASS_SHIFT    2
+#define ADVFS_INODE_BCLASS_MASK     (3 << ADVFS_INODE_BCLASS_SHIFT)
+/* The block size class is chosen by a hint or a directory policy */
+#define ADVFS_INODE_BCLASS_SET      (1 << 4)
+
+#define ADVFS_INODE_BCLASS(e)   \
+    (((e)->attr.flags & ADVFS_INODE_BCLASS_MASK) >> ADVFS_INODE_BCLASS_SHIFT)
+#define ADVFS_INODE_BSIZE(e)    ADVFS_BCLASS_SIZE(ADVFS_INODE_BCLASS(e))
+
 /*
  * inode attribute
  */
@@ -84,6 +228,15 @@ typedef struct {
     uint64_t ctime;
     uint64_t size;
     uint64_t n_blocks;
+    /* # of tombstones in the slots (directory) */
+    uint64_t n_dead;
+    /* Flags (ADVFS_INODE_*) */
+    uint64_t flags;
+    /* Whole-file digest (valid with ADVFS_INODE_DIGEST) */
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    /* First block of the extent table of a sealed file (0 for the fixed
+       block layout) */
+    uint64_t extents;
 } __attribute__ ((packed, aligned(128))) advfs_inode_attr_t;
 
 /*
@@ -98,10 +251,46 @@ typedef struct {
     uint64_t blocks[ADVFS_INODE_BLOCKPTR];
 } __attribute__ ((packed, aligned(512))) advfs_inode_t;
 
+#define ADVFS_INODE_TABLE_BLOCKS    \
+    (ADVFS_INODE_NUM * sizeof(advfs_inode_t) / ADVFS_BLOCK_SIZE)
+
+/*
+ * Snapshot
+ */
+typedef struct {
+    char name[ADVFS_SNAPSHOT_NAME_MAX + 1];
+    uint64_t ctime;
+    /* Blocks of the copy of the inode table (0 for an unused entry) */
+    uint64_t table[ADVFS_INODE_TABLE_BLOCKS];
+} advfs_snapshot_t;
+
+/*
+ * extent; a chunk of a sealed file stored from the logical block pos
+ */
+typedef struct {
+    uint64_t offset;
+    uint32_t pos;
+    uint32_t len;
+} __attribute__ ((packed)) advfs_extent_t;
+
+#define ADVFS_EXTENT_PER_BLOCK  \
+    ((ADVFS_BLOCK_SIZE - 2 * sizeof(uint64_t)) / sizeof(advfs_extent_t))
+
+/*
+ * extent table block
+ */
+typedef struct {
+    uint64_t n;
+    uint64_t next;
+    advfs_extent_t e[ADVFS_EXTENT_PER_BLOCK];
+} __attribute__ ((packed, aligned(ADVFS_BLOCK_SIZE))) advfs_extent_block_t;
+
 /*
  * advfs superblock
  */
 typedef struct {
+    /* Signature of the backing image (ADVFS_IMAGE_MAGIC) */
+    char magic[8];
     /* pointers (in block) */
     uint64_t ptr_inode;
     uint64_t ptr_block_mgt;
@@ -117,13 +306,209 @@ typedef struct {
     uint64_t freelist;
     /* Root inode */
     uint64_t root;
+    /* # of compressed block ids and the free list of them */
+    uint64_t n_zblocks;
+    uint64_t zfreelist;
+    /* First block never allocated */
+    uint64_t brk;
+    /* Dedup tree roots and free lists of the larger block size classes
+       (the 4 KiB class uses block_mgt_root and freelist) */
+    uint64_t class_root[ADVFS_BCLASS_NUM];
+    uint64_t class_freelist[ADVFS_BCLASS_NUM];
+    /* Snapshots */
+    advfs_snapshot_t snapshots[ADVFS_SNAPSHOT_NUM];
 } __attribute__ ((packed, aligned(ADVFS_BLOCK_SIZE))) advfs_superblock_t;
 
+/*
+ * Compression statistics
+ */
+typedef struct {
+    /* # of the compressed blocks and the slots they occupy */
+    uint64_t live_blocks;
+    uint64_t live_slots;
+    /* # of blocks stored uncompressed as they did not shrink */
+    uint64_t uncompressible;
+    /* # of blocks packed without the trailing zeros */
+    uint64_t tail_packed;
+    /* # of blocks not tried by the entropy estimate and by the backoff */
+    uint64_t entropy_bypassed;
+    uint64_t backoff_bypassed;
+    /* Throughput */
+    uint64_t compress_bytes;
+    uint64_t compress_ns;
+    uint64_t decompress_bytes;
+    uint64_t decompress_ns;
+    /* Decompressed block cache */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+} advfs_zstats_t;
+
+/*
+ * Per-file compression backoff
+ */
+typedef struct {
+    /* # of blocks to be stored without trying to compress */
+    uint32_t skip;
+    /* # of the next skip */
+    uint32_t backoff;
+    /* # of consecutive failures */
+    uint32_t fails;
+} advfs_zbackoff_t;
+
+/*
+ * Journal transaction; the header is followed by the block numbers (padded
+ * to the block size) and the images of the blocks, and all are written at
+ * once.  A transaction is valid only if the hash matches.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t seq;
+    /* # of blocks, and the # of blocks of the whole transaction, which is
+       split into the segments in the log-structured layout */
+    uint64_t n;
+    uint64_t total;
+    /* SHA-384 of the block numbers and the images */
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+} __attribute__ ((packed, aligned(ADVFS_BLOCK_SIZE))) advfs_journal_header_t;
+
+/*
+ * Header block of the log-structured image
+ */
+typedef struct {
+    char magic[8];
+    uint64_t segment_blocks;
+    uint64_t n_segments;
+} __attribute__ ((packed, aligned(ADVFS_BLOCK_SIZE))) advfs_log_header_t;
+
+/*
+ * Journal statistics
+ */
+typedef struct {
+    uint64_t commits;
+    /* # of blocks written to the journal, and written in place ahead of the
+       transaction */
+    uint64_t journaled;
+    uint64_t ordered;
+    uint64_t bytes;
+    uint64_t checkpoints;
+    /* # of transactions replayed at mount */
+    uint64_t replayed;
+    /* # of fsync calls, and the ones with nothing to commit */
+    uint64_t syncs;
+    uint64_t syncs_clean;
+    /* # of commits failed (retried with the next ones) */
+    uint64_t failures;
+} advfs_jstats_t;
+
+/*
+ * Log statistics
+ */
+typedef struct {
+    /* # of blocks appended to the log including the record headers and
+       the block numbers, and # of the blocks of the device among them */
+    uint64_t written;
+    uint64_t appended;
+    /* # of cleaner runs, segments cleaned, blocks relocated from them, and
+       the rest of the blocks of them reclaimed */
+    uint64_t passes;
+    uint64_t cleaned;
+    uint64_t relocated;
+    uint64_t reclaimed;
+    /* Time spent on choosing the segments and the blocks to relocate */
+    uint64_t clean_ns;
+} advfs_lstats_t;
+
+/*
+ * Statistics of the rebuild at mount
+ */
+typedef struct {
+    uint64_t threads;
+    /* # of inodes scanned (of the live tree and of the snapshots) */
+    uint64_t inodes;
+    /* # of data blocks in the dedup trees */
+    uint64_t nodes;
+    /* # of reference counters corrected, and of the blocks and the
+       compressed block ids released as no longer referenced */
+    uint64_t fixed;
+    uint64_t leaked;
+    uint64_t ns;
+} advfs_rstats_t;
+
+/*
+ * Decompressed block cache entry
+ */
+typedef struct {
+    /* Compressed block id (0 for an empty entry) */
+    uint64_t b;
+    uint8_t data[ADVFS_BLOCK_SIZE];
+} advfs_zcache_entry_t;
+
 /*
  * advfs data structure
  */
 typedef struct {
     advfs_superblock_t *superblock;
+    /* Kernel writeback cache enabled */
+    int writeback;
+    /* # of open handles of each directory */
+    uint32_t dir_open[ADVFS_INODE_NUM];
+    /* Whole-file digest index: the heads of the buckets and the links
+       (inode number + 1, 0 for the end) */
+    uint64_t digest_bucket[ADVFS_DIGEST_BUCKETS];
+    uint64_t digest_next[ADVFS_INODE_NUM];
+    /* Whether each inode is in the digest index */
+    uint8_t digest_indexed[ADVFS_INODE_NUM];
+    /* Chunking (advfs_chunking_t) */
+    int chunking;
+    /* Block size class policy of the root directory (or ADVFS_BCLASS_AUTO) */
+    int bclass;
+    /* Compression (advfs_compress_t) and its level */
+    int compress;
+    int compress_level;
+    /* Pack block receiving the next compressed blocks */
+    uint64_t zpack;
+    advfs_zcache_entry_t *zcache;
+    void *zstd_cctx;
+    void *zstd_dctx;
+    advfs_zstats_t zstats;
+    advfs_zbackoff_t zbackoff[ADVFS_INODE_NUM];
+    /* Backing image and its journal (-1 if in memory only) */
+    const char *image;
+    int image_fd;
+    int journal_fd;
+    /* Blocks modified since the last commit */
+    uint8_t dirty[ADVFS_BLOCK_NUM / 8];
+    uint64_t n_dirty;
+    /* Superblock and the break as of the last commit */
+    void *jsuper;
+    uint64_t jbrk;
+    /* Sequence number of the next transaction and the end of the journal */
+    uint64_t jseq;
+    uint64_t joff;
+    /* The last committed transaction (the running one is the next), and
+       the transaction that last changed each inode */
+    uint64_t jcommitted;
+    uint64_t jtid[ADVFS_INODE_NUM];
+    /* Group commit interval and the time of the last commit */
+    int commit_interval;
+    time_t jtime;
+    advfs_jstats_t jstats;
+    /* Log-structured layout: the location of each block (the block in the
+       log + 1, or 0 if never written), the # of blocks located in each
+       segment and the sequence number of the last commit written to it,
+       and the next block in the log to write (the end of the log when the
+       segment is full).  The blocks on the free lists are not written to the
+       log (a bitmap); their locations are dropped once freed durably. */
+    int log;
+    uint64_t lmap[ADVFS_BLOCK_NUM];
+    uint8_t lfree[ADVFS_BLOCK_NUM / 8];
+    uint32_t lseg_live[ADVFS_SEGMENT_NUM];
+    uint64_t lseg_seq[ADVFS_SEGMENT_NUM];
+    uint64_t lhead;
+    /* # of blocks the cleaner may relocate per commit */
+    int clean_budget;
+    advfs_lstats_t lstats;
+    advfs_rstats_t rstats;
 } advfs_t;
 
 #ifdef __cplusplus
@@ -139,15 +524,80 @@ extern "C" {
     int advfs_read_raw_block(advfs_t *, void *, uint64_t);
     int advfs_write_raw_block(advfs_t *, void *, uint64_t);
     int advfs_read_block(advfs_t *, uint64_t, void *, uint64_t);
-    int advfs_write_block(advfs_t *, uint64_t, void *, uint64_t);
+    int advfs_load_block(advfs_t *, uint64_t, void *);
+    void advfs_block_build(advfs_t *, int, const uint64_t *, uint64_t);
+    int advfs_write_block(advfs_t *, uint64_t, void *, uint64_t, int);
+    int advfs_write_meta_block(advfs_t *, uint64_t, void *, uint64_t);
+    int advfs_map_block(advfs_t *, uint64_t, const unsigned char *, uint64_t);
+    uint64_t advfs_block_lookup(advfs_t *, const unsigned char *);
     int advfs_unref_block(advfs_t *, uint64_t, uint64_t);
+    void advfs_release_block(advfs_t *, uint64_t);
+    void advfs_free_extents(advfs_t *, uint64_t);
+    uint64_t advfs_chain_count(uint64_t);
+    int advfs_share_block_map(advfs_t *, advfs_inode_t *);
+    void advfs_release_block_map(advfs_t *, const advfs_inode_t *);
+    int advfs_clone_block(advfs_t *, uint64_t, uint64_t, uint64_t, uint64_t);
+    int advfs_punch_block(advfs_t *, uint64_t, uint64_t);
+    uint64_t advfs_resolve_block(advfs_t *, uint64_t, uint64_t);
     uint64_t advfs_alloc_block(advfs_t *);
+    uint64_t advfs_alloc_meta_block(advfs_t *);
     void advfs_free_block(advfs_t *, uint64_t);
     int advfs_read_inode(advfs_t *, advfs_inode_t *, uint64_t);
     int advfs_write_inode(advfs_t *, const advfs_inode_t *, uint64_t);
     int advfs_read_block_mgt(advfs_t *, advfs_block_mgt_t *, uint64_t);
+    int advfs_file_digest(advfs_t *, uint64_t, unsigned char *);
+    void advfs_digest_index_add(advfs_t *, uint64_t);
+    void advfs_digest_index_remove(advfs_t *, uint64_t);
+    int advfs_digest_index_lookup(advfs_t *, const unsigned char *,
+                                  uint64_t *);
     int advfs_write_block_mgt(advfs_t *, const advfs_block_mgt_t *, uint64_t);
 
+    /* compress.c */
+    int advfs_compress_lookup(const char *);
+    const char *advfs_compress_name(int);
+    int advfs_compress_init(advfs_t *);
+    int advfs_compress_try(advfs_t *, uint64_t, const void *);
+    void advfs_compress_feedback(advfs_t *, uint64_t, int);
+    void advfs_compress_reset(advfs_t *, uint64_t);
+    size_t advfs_compress(advfs_t *, const void *, void *, size_t);
+    int advfs_decompress(advfs_t *, int, const void *, size_t, void *);
+    int advfs_compress_stats(advfs_t *, char *, size_t);
+
+    /* chunk.c */
+    void advfs_cdc_init(void);
+    size_t advfs_cdc_cut(const uint8_t *, size_t);
+
+    /* snapshot.c */
+    int advfs_snapshot_lookup(advfs_t *, const char *, size_t);
+    int advfs_snapshot_create(advfs_t *, const char *);
+    int advfs_snapshot_delete(advfs_t *, const char *);
+
+    /* journal.c */
+    int advfs_journal_open(advfs_t *);
+    int advfs_journal_commit(advfs_t *);
+    void advfs_journal_tick(advfs_t *);
+    void advfs_journal_dirty(advfs_t *, uint64_t);
+    void advfs_journal_touch(advfs_t *, uint64_t);
+    int advfs_journal_sync(advfs_t *, uint64_t);
+    void advfs_journal_close(advfs_t *);
+    int advfs_journal_stats(advfs_t *, char *, size_t);
+    int advfs_pread_all(int, void *, size_t, off_t);
+    int advfs_pwrite_all(int, const void *, size_t, off_t);
+
+    /* log.c */
+    int advfs_log_format(advfs_t *);
+    int advfs_log_detect(advfs_t *);
+    int advfs_log_load(advfs_t *);
+    int advfs_log_write(advfs_t *, const uint64_t *, uint64_t);
+    void advfs_log_clean(advfs_t *);
+    void advfs_log_mark_free(advfs_t *, uint64_t, uint64_t, int);
+    void advfs_log_drop_free(advfs_t *);
+    int advfs_log_stats(advfs_t *, char *, size_t);
+
+    /* rebuild.c */
+    int advfs_rebuild(advfs_t *);
+    int advfs_rebuild_stats(advfs_t *, char *, size_t);
+
     /* main.c */
 
 #ifdef __cplusplus
@@ -0,0 +1,228 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _ADVFS_IOCTL_H
+#define _ADVFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * The kernel resolves FICLONE and FIDEDUPERANGE in the VFS and does not pass
+ * them to FUSE, so advfs has its own ioctls.  FUSE cannot resolve a file
+ * descriptor of the caller either; the other file is specified by the path
+ * from the root of the advfs mount point (e.g., "/dir/file").
+ */
+#define ADVFS_IOC_PATH_MAX      1024
+
+/*
+ * Clone a range of the source file into the file the ioctl is issued on.
+ * Zero length clones up to the end of the source; zero length with both
+ * offsets zero makes the file an exact clone of the source.
+ */
+struct advfs_ioc_clone_range {
+    char src[ADVFS_IOC_PATH_MAX];
+    uint64_t src_offset;
+    uint64_t src_length;
+    uint64_t dest_offset;
+};
+
+#define ADVFS_IOC_CLONE_RANGE   _IOW('a', 1, struct advfs_ioc_clone_range)
+
+/*
+ * Deduplicate a range of the file the ioctl is issued on against the same
+ * sized range of the source file (FIDEDUPERANGE with a single destination).
+ * The offsets must be aligned to the block size.  The length is rounded down
+ * to the block size unless the range ends at the end of both files.  Nothing
+ * is changed unless the whole range is identical.  The source must not be
+ * split into content-defined chunks (EINVAL).
+ */
+#define ADVFS_DEDUPE_RANGE_SAME         0
+#define ADVFS_DEDUPE_RANGE_DIFFERS      1
+
+struct advfs_ioc_dedupe_range {
+    char src[ADVFS_IOC_PATH_MAX];
+    uint64_t src_offset;
+    uint64_t src_length;
+    uint64_t dest_offset;
+    /* Output */
+    uint64_t bytes_deduped;
+    int32_t status;
+    uint32_t reserved;
+};
+
+#define ADVFS_IOC_DEDUPE_RANGE  _IOWR('a', 2, struct advfs_ioc_dedupe_range)
+
+/*
+ * Announce the whole-file digest (binary form of ADVFS_XATTR_DIGEST) of the
+ * content about to be written to the file.  If a file with the digest exists,
+ * found is set and the file becomes its clone at once; the client does not
+ * need to write the content, and the content written anyway is compared with
+ * the blocks in place instead of being hashed and looked up.  As the digest
+ * is no proof that the client has the content, only root and the owner of
+ * the mount may issue it (EPERM).
+ */
+struct advfs_ioc_ingest {
+    unsigned char digest[48];
+    /* Output */
+    int32_t found;
+    uint32_t reserved;
+};
+
+#define ADVFS_IOC_INGEST        _IOWR('a', 3, struct advfs_ioc_ingest)
+
+/*
+ * Clone the directory tree of the source into the empty directory the ioctl
+ * is issued on.  The files share the blocks with the source; only the
+ * inodes, the directory entries and the block maps are copied.  The source
+ * may be a directory in a snapshot.
+ */
+struct advfs_ioc_clone_tree {
+    char src[ADVFS_IOC_PATH_MAX];
+};
+
+#define ADVFS_IOC_CLONE_TREE    _IOW('a', 4, struct advfs_ioc_clone_tree)
+
+/*
+ * Map the blocks of the file by their fingerprints (the SHA-384 of the
+ * ADVFS_BLOCK_SIZE bytes at the offset, the last block padded with zeros)
+ * where the content is already stored.  The file must be of 4 KiB blocks and
+ * sized to the final size beforehand (e.g., by ftruncate); the offsets must
+ * be aligned and within the file.  On return, the first n_missing entries
+ * are the blocks not stored, which the client writes as usual.  As a
+ * fingerprint is no proof that the client has the content, only root and
+ * the owner of the mount may issue it (EPERM).
+ */
+#define ADVFS_INGEST_BLOCKS_MAX 256
+
+struct advfs_ioc_ingest_blocks {
+    uint32_t n;
+    /* Output */
+    uint32_t n_missing;
+    struct {
+        uint64_t offset;
+        unsigned char hash[48];
+    } blocks[ADVFS_INGEST_BLOCKS_MAX];
+};
+
+#define ADVFS_IOC_INGEST_BLOCKS \
+    _IOWR('a', 7, struct advfs_ioc_ingest_blocks)
+
+/*
+ * Replication.  ADVFS_IOC_SEND issued on a directory (e.g., the root of a
+ * snapshot) writes the tree to the stream; ADVFS_IOC_RECEIVE issued on an
+ * empty directory of another advfs instance rebuilds the tree from the
+ * stream.  The stream and the reply are paths of the host (a FIFO or a
+ * file), not in the mount.  With the reply, the receiver returns the
+ * fingerprints it does not have and the sender ships only those blocks;
+ * without the reply, all the distinct blocks are shipped.  As the paths are
+ * opened by the file system process, only root and the owner of the mount
+ * may issue them (EPERM).
+ */
+struct advfs_ioc_stream {
+    char stream[ADVFS_IOC_PATH_MAX];
+    char reply[ADVFS_IOC_PATH_MAX];
+};
+
+#define ADVFS_IOC_SEND          _IOW('a', 5, struct advfs_ioc_stream)
+#define ADVFS_IOC_RECEIVE       _IOW('a', 6, struct advfs_ioc_stream)
+
+/*
+ * Stream format; the integers are in the byte order of the sender, and a
+ * receiver of the other byte order rejects the version.
+ *
+ *   header
+ *   entries in pre-order, each file entry followed by n_leaves fingerprints
+ *   an entry of ADVFS_SEND_END
+ *   blocks (fingerprint and ADVFS_SEND_BLOCK_SIZE bytes of content)
+ *   a zero fingerprint
+ *
+ * The fingerprint of a block is the SHA-384 of its content (the last block
+ * padded with zeros); a hole is a zero fingerprint.  The parent of an entry
+ * is the index of the directory entry counted from 1 (0 is the directory the
+ * ioctl is issued on).  The reply is a list of fingerprints ended with a
+ * zero fingerprint.
+ */
+#define ADVFS_SEND_MAGIC        "ADVFSSND"
+#define ADVFS_SEND_VERSION      1
+#define ADVFS_SEND_BLOCK_SIZE   4096
+
+#define ADVFS_SEND_END          0
+#define ADVFS_SEND_DIR          1
+#define ADVFS_SEND_FILE         2
+
+struct advfs_send_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct advfs_send_entry {
+    uint32_t type;
+    uint32_t mode;
+    uint64_t parent;
+    uint64_t size;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint64_t n_leaves;
+    char name[256];
+};
+
+/*
+ * Extended attributes
+ */
+#define ADVFS_XATTR_PREFIX      "user.advfs."
+
+/*
+ * Whole-file digest of a regular file in 96 hex digits.  The leaves are the
+ * SHA-384 of the blocks (ADVFS_BLOCK_SIZE bytes, the last one padded with
+ * zeros; a hole is a zero block), combined into a Merkle tree of the same
+ * shape as RFC 6962: H(0x01 || left || right), where the left subtree is the
+ * largest power of two.  The digest is H(le64(size) || root); it is
+ * H(le64(0)) for an empty file.
+ */
+#define ADVFS_XATTR_DIGEST      "user.advfs.digest"
+
+/*
+ * File system statistics on the root directory as "key=value" lines
+ */
+#define ADVFS_XATTR_STATS       "user.advfs.stats"
+
+/*
+ * Block size class of a regular file ("4k", "64k" or "1m"); setting it
+ * converts the content.  On a directory, the policy inherited by the files
+ * and directories created in it.
+ */
+#define ADVFS_XATTR_BLOCKSIZE   "user.advfs.blocksize"
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
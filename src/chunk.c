@@ -0,0 +1,106 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "advfs.h"
+#include <stdint.h>
+
+/*
+ * Masks of the normalized chunking (FastCDC); the cut point is judged by more
+ * bits before the average size, and by fewer bits after
+ */
+#define ADVFS_CDC_MASK_S        0x0003590703530000ULL
+#define ADVFS_CDC_MASK_L        0x0000d90003530000ULL
+
+/*
+ * Gear table
+ */
+static uint64_t _gear[256];
+
+/*
+ * Initialize the gear table; the values must be the same on every mount so
+ * that the same content is cut at the same points
+ */
+void
+advfs_cdc_init(void)
+{
+    uint64_t x;
+    uint64_t z;
+    int i;
+
+    /* splitmix64 */
+    x = 0x6164766673636463ULL;
+    for ( i = 0; i < 256; i++ ) {
+        x += 0x9e3779b97f4a7c15ULL;
+        z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        _gear[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+ * Find the length of the first chunk in buf of len bytes.  The buffer must
+ * hold at least ADVFS_CDC_MAX bytes unless it is the end of the data.
+ */
+size_t
+advfs_cdc_cut(const uint8_t *buf, size_t len)
+{
+    uint64_t fp;
+    size_t normal;
+    size_t max;
+    size_t i;
+
+    if ( len <= ADVFS_CDC_MIN ) {
+        return len;
+    }
+    max = (len < ADVFS_CDC_MAX) ? len : ADVFS_CDC_MAX;
+    normal = (ADVFS_CDC_AVG < max) ? ADVFS_CDC_AVG : max;
+
+    /* The cut points below the minimum size are skipped */
+    fp = 0;
+    for ( i = ADVFS_CDC_MIN; i < normal; i++ ) {
+        fp = (fp << 1) + _gear[buf[i]];
+        if ( 0 == (fp & ADVFS_CDC_MASK_S) ) {
+            return i + 1;
+        }
+    }
+    for ( ; i < max; i++ ) {
+        fp = (fp << 1) + _gear[buf[i]];
+        if ( 0 == (fp & ADVFS_CDC_MASK_L) ) {
+            return i + 1;
+        }
+    }
+
+    return max;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,377 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "advfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Names of the compression algorithms
+ */
+static const char *_compress_names[] = {
+    [ADVFS_COMPRESS_NONE] = "none",
+    [ADVFS_COMPRESS_LZ4] = "lz4",
+    [ADVFS_COMPRESS_ZSTD] = "zstd",
+};
+
+/*
+ * c * log2(c) in 1/256 bits for the byte counts in a block
+ */
+static uint32_t _clog2c[ADVFS_BLOCK_SIZE + 1];
+
+/*
+ * Current time in nanoseconds
+ */
+static uint64_t
+_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Resolve the compression algorithm from the name; -1 if not supported by
+ * this build
+ */
+int
+advfs_compress_lookup(const char *name)
+{
+    if ( 0 == strcmp(name, "none") ) {
+        return ADVFS_COMPRESS_NONE;
+    }
+#ifdef HAVE_LZ4
+    if ( 0 == strcmp(name, "lz4") ) {
+        return ADVFS_COMPRESS_LZ4;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if ( 0 == strcmp(name, "zstd") ) {
+        return ADVFS_COMPRESS_ZSTD;
+    }
+#endif
+
+    return -1;
+}
+
+/*
+ * Name of the compression algorithm
+ */
+const char *
+advfs_compress_name(int alg)
+{
+    return _compress_names[alg];
+}
+
+/*
+ * Initialize the compression contexts and the decompressed block cache
+ */
+int
+advfs_compress_init(advfs_t *advfs)
+{
+    int i;
+
+    memset(&advfs->zstats, 0, sizeof(advfs->zstats));
+    memset(advfs->zbackoff, 0, sizeof(advfs->zbackoff));
+    advfs->zpack = 0;
+    advfs->zcache = NULL;
+    advfs->zstd_cctx = NULL;
+    advfs->zstd_dctx = NULL;
+
+    if ( 0 == advfs->superblock->n_zblocks ) {
+        return 0;
+    }
+
+    advfs->zcache = calloc(ADVFS_ZCACHE_NUM, sizeof(advfs_zcache_entry_t));
+    if ( NULL == advfs->zcache ) {
+        return -1;
+    }
+    _clog2c[0] = 0;
+    for ( i = 1; i <= ADVFS_BLOCK_SIZE; i++ ) {
+        _clog2c[i] = (uint32_t)(i * log2(i) * 256 + 0.5);
+    }
+#ifdef HAVE_ZSTD
+    advfs->zstd_cctx = ZSTD_createCCtx();
+    advfs->zstd_dctx = ZSTD_createDCtx();
+    if ( NULL == advfs->zstd_cctx || NULL == advfs->zstd_dctx ) {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Estimate the order-0 entropy of a block in 1/256 bits per byte from its
+ * byte histogram.  Four histograms are counted in turn so that a run of the
+ * same byte does not serialize the increments.
+ */
+static uint32_t
+_entropy(const uint8_t *buf)
+{
+    uint32_t hist[4][256];
+    uint64_t sum;
+    int i;
+
+    memset(hist, 0, sizeof(hist));
+    for ( i = 0; i < ADVFS_BLOCK_SIZE; i += 4 ) {
+        hist[0][buf[i]]++;
+        hist[1][buf[i + 1]]++;
+        hist[2][buf[i + 2]]++;
+        hist[3][buf[i + 3]]++;
+    }
+
+    /* H = log2(N) - sum(c log2 c) / N */
+    sum = 0;
+    for ( i = 0; i < 256; i++ ) {
+        sum += _clog2c[hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i]];
+    }
+
+    return _clog2c[ADVFS_BLOCK_SIZE] / ADVFS_BLOCK_SIZE
+        - sum / ADVFS_BLOCK_SIZE;
+}
+
+/*
+ * Decide whether to try to compress a block of the file inr
+ */
+int
+advfs_compress_try(advfs_t *advfs, uint64_t inr, const void *buf)
+{
+    advfs_zbackoff_t *zb;
+
+    /* The file has failed to compress repeatedly */
+    zb = &advfs->zbackoff[inr];
+    if ( zb->skip > 0 ) {
+        zb->skip--;
+        advfs->zstats.backoff_bypassed++;
+        return 0;
+    }
+
+    if ( _entropy(buf) > ADVFS_ZENTROPY_MAX ) {
+        advfs->zstats.entropy_bypassed++;
+        advfs_compress_feedback(advfs, inr, 0);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Record whether a block of the file inr has been compressed; the file backs
+ * off exponentially while it keeps failing
+ */
+void
+advfs_compress_feedback(advfs_t *advfs, uint64_t inr, int compressed)
+{
+    advfs_zbackoff_t *zb;
+
+    zb = &advfs->zbackoff[inr];
+    if ( compressed ) {
+        zb->fails = 0;
+        zb->backoff = 0;
+        return;
+    }
+
+    zb->fails++;
+    if ( zb->fails >= ADVFS_ZBACKOFF_FAILS ) {
+        zb->backoff = zb->backoff ? zb->backoff * 2 : ADVFS_ZBACKOFF_FAILS;
+        if ( zb->backoff > ADVFS_ZBACKOFF_MAX ) {
+            zb->backoff = ADVFS_ZBACKOFF_MAX;
+        }
+        zb->skip = zb->backoff;
+        zb->fails = 0;
+    }
+}
+
+/*
+ * Forget the backoff state of a released inode
+ */
+void
+advfs_compress_reset(advfs_t *advfs, uint64_t inr)
+{
+    memset(&advfs->zbackoff[inr], 0, sizeof(advfs_zbackoff_t));
+}
+
+/*
+ * Compress a block into dst of dstsize bytes with the algorithm of the file
+ * system; returns the compressed length, or 0 if it does not fit
+ */
+size_t
+advfs_compress(advfs_t *advfs, const void *src, void *dst, size_t dstsize)
+{
+    uint64_t t0;
+    size_t len;
+#ifdef HAVE_ZSTD
+    size_t ret;
+#endif
+
+    t0 = _now_ns();
+    len = 0;
+    switch ( advfs->compress ) {
+#ifdef HAVE_LZ4
+    case ADVFS_COMPRESS_LZ4:
+        /* The levels above the default use the high compression mode */
+        if ( advfs->compress_level > LZ4HC_CLEVEL_MIN ) {
+            len = LZ4_compress_HC(src, dst, ADVFS_BLOCK_SIZE, dstsize,
+                                  advfs->compress_level);
+        } else {
+            len = LZ4_compress_default(src, dst, ADVFS_BLOCK_SIZE, dstsize);
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case ADVFS_COMPRESS_ZSTD:
+        ret = ZSTD_compressCCtx(advfs->zstd_cctx, dst, dstsize, src,
+                                ADVFS_BLOCK_SIZE, advfs->compress_level);
+        if ( !ZSTD_isError(ret) ) {
+            len = ret;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    advfs->zstats.compress_ns += _now_ns() - t0;
+    advfs->zstats.compress_bytes += ADVFS_BLOCK_SIZE;
+
+    return len;
+}
+
+/*
+ * Decompress a block compressed with the algorithm alg
+ */
+int
+advfs_decompress(advfs_t *advfs, int alg, const void *src, size_t len,
+                 void *dst)
+{
+    uint64_t t0;
+    int ret;
+#ifdef HAVE_ZSTD
+    size_t zret;
+#endif
+
+    t0 = _now_ns();
+    ret = -1;
+    switch ( alg ) {
+    case ADVFS_COMPRESS_NONE:
+        /* Packed without the trailing zeros */
+        memcpy(dst, src, len);
+        memset((uint8_t *)dst + len, 0, ADVFS_BLOCK_SIZE - len);
+        ret = 0;
+        break;
+#ifdef HAVE_LZ4
+    case ADVFS_COMPRESS_LZ4:
+        if ( LZ4_decompress_safe(src, dst, len, ADVFS_BLOCK_SIZE)
+             == ADVFS_BLOCK_SIZE ) {
+            ret = 0;
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case ADVFS_COMPRESS_ZSTD:
+        zret = ZSTD_decompressDCtx(advfs->zstd_dctx, dst, ADVFS_BLOCK_SIZE,
+                                   src, len);
+        if ( !ZSTD_isError(zret) && ADVFS_BLOCK_SIZE == zret ) {
+            ret = 0;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    advfs->zstats.decompress_ns += _now_ns() - t0;
+    advfs->zstats.decompress_bytes += ADVFS_BLOCK_SIZE;
+
+    return ret;
+}
+
+/*
+ * Format the compression statistics as text
+ */
+int
+advfs_compress_stats(advfs_t *advfs, char *buf, size_t size)
+{
+    advfs_zstats_t *st;
+    uint64_t stored;
+    double ratio;
+    double cmbps;
+    double dmbps;
+
+    st = &advfs->zstats;
+    stored = st->live_slots * ADVFS_ZSLOT_SIZE;
+    ratio = stored ? (double)st->live_blocks * ADVFS_BLOCK_SIZE / stored : 1.0;
+    cmbps = st->compress_ns
+        ? st->compress_bytes * 1000.0 / st->compress_ns : 0.0;
+    dmbps = st->decompress_ns
+        ? st->decompress_bytes * 1000.0 / st->decompress_ns : 0.0;
+
+    return snprintf(buf, size,
+                    "compress=%s\n"
+                    "compress_level=%d\n"
+                    "compressed_blocks=%llu\n"
+                    "stored_bytes=%llu\n"
+                    "ratio=%.2f\n"
+                    "uncompressible_blocks=%llu\n"
+                    "tail_packed_blocks=%llu\n"
+                    "entropy_bypassed_blocks=%llu\n"
+                    "backoff_bypassed_blocks=%llu\n"
+                    "compress_mbps=%.1f\n"
+                    "decompress_mbps=%.1f\n"
+                    "cache_hits=%llu\n"
+                    "cache_misses=%llu\n",
+                    advfs_compress_name(advfs->compress),
+                    advfs->compress_level,
+                    (unsigned long long)st->live_blocks,
+                    (unsigned long long)stored, ratio,
+                    (unsigned long long)st->uncompressible,
+                    (unsigned long long)st->tail_packed,
+                    (unsigned long long)st->entropy_bypassed,
+                    (unsigned long long)st->backoff_bypassed,
+                    cmbps, dmbps,
+                    (unsigned long long)st->cache_hits,
+                    (unsigned long long)st->cache_misses);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
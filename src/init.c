@@ -23,44 +23,41 @@
 
 #include "advfs.h"
 #include <fuse.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <assert.h>
 
 /*
- * Initialize
+ * Format the block device
  */
-int
-advfs_init(advfs_t *advfs)
+static void
+_format(advfs_t *advfs)
 {
     ssize_t i;
     struct timeval tv;
-    void *blkdev;
     advfs_superblock_t *sblk;
     advfs_inode_t *inode;
     advfs_block_mgt_t *mgt;
-    void *block;
     int ratio;
     int nblk_inode;
     int nblk_mgt;
-    advfs_free_list_t *fl;
+    uint64_t n_zblocks;
 
-    /* Initialize the block device */
-    blkdev = malloc(ADVFS_BLOCK_SIZE * ADVFS_BLOCK_NUM);
-    if ( NULL == blkdev ) {
-        return -1;
-    }
-    sblk = blkdev;
+    sblk = advfs->superblock;
+    memset(sblk, 0, sizeof(advfs_superblock_t));
+    memcpy(sblk->magic, ADVFS_IMAGE_MAGIC, sizeof(sblk->magic));
 
-    /* Ensure that each data structure size must be aligned. */
-    assert( (ADVFS_BLOCK_SIZE % sizeof(advfs_inode_t)) == 0 );
     ratio = ADVFS_BLOCK_SIZE / sizeof(advfs_inode_t);
-    assert( (ADVFS_INODE_NUM % ratio) == 0 );
     nblk_inode = (ADVFS_INODE_NUM / ratio);
 
-    assert( (ADVFS_BLOCK_SIZE % sizeof(advfs_block_mgt_t)) == 0 );
+    /* The compressed blocks have the management entries after the ones of
+       the physical blocks */
+    n_zblocks = (ADVFS_COMPRESS_NONE != advfs->compress
+                 || ADVFS_CHUNK_CDC == advfs->chunking) ? ADVFS_ZBLOCK_NUM : 0;
     ratio = ADVFS_BLOCK_SIZE / sizeof(advfs_block_mgt_t);
-    nblk_mgt = (ADVFS_BLOCK_NUM / ratio);
+    nblk_mgt = ((ADVFS_BLOCK_NUM + n_zblocks) / ratio);
 
     sblk->ptr_inode = 1;
     sblk->n_inodes = ADVFS_INODE_NUM;
@@ -71,27 +68,40 @@ advfs_init(advfs_t *advfs)
     sblk->n_block_used = 0;
 
     /* Initialize all inodes */
-    inode = blkdev + ADVFS_BLOCK_SIZE * sblk->ptr_inode;
+    inode = (void *)sblk + ADVFS_BLOCK_SIZE * sblk->ptr_inode;
     for ( i = 0; i < (ssize_t)sblk->n_inodes; i++ ) {
         inode[i].attr.type = ADVFS_UNUSED;
     }
 
     /* Initialize the block management array */
-    mgt = blkdev + ADVFS_BLOCK_SIZE * sblk->ptr_block_mgt;
+    mgt = (void *)sblk + ADVFS_BLOCK_SIZE * sblk->ptr_block_mgt;
     for ( i = 0; i < (ssize_t)sblk->n_blocks; i++ ) {
         mgt[i].ref = 0;
+        mgt[i].type = ADVFS_BLOCK_DATA;
     }
 
-    /* Initialize all blocks */
-    block = blkdev + ADVFS_BLOCK_SIZE * sblk->ptr_block;
-    fl = block;
-    for ( i = 0; i < (ssize_t)sblk->n_blocks - 1; i++ ) {
-        fl->next = sblk->ptr_block + i + 1;
-        block += ADVFS_BLOCK_SIZE;
-        fl = block;
+    /* Link the free compressed block ids */
+    sblk->n_zblocks = n_zblocks;
+    for ( i = 0; i < (ssize_t)n_zblocks; i++ ) {
+        mgt[ADVFS_ZBLOCK_BASE + i].ref = 0;
+        mgt[ADVFS_ZBLOCK_BASE + i].type = ADVFS_BLOCK_DATA;
+        mgt[ADVFS_ZBLOCK_BASE + i].left
+            = (i + 1 < (ssize_t)n_zblocks) ? ADVFS_ZBLOCK_BASE + i + 1 : 0;
     }
-    fl->next = 0;
-    sblk->freelist = sblk->ptr_block;
+    sblk->zfreelist = n_zblocks ? ADVFS_ZBLOCK_BASE : 0;
+
+    /* The blocks are allocated from the break until freed to the free list
+       of each block size class, so that the larger classes can take runs of
+       contiguous blocks */
+    sblk->freelist = 0;
+    sblk->brk = sblk->ptr_block;
+    for ( i = 0; i < ADVFS_BCLASS_NUM; i++ ) {
+        sblk->class_root[i] = 0;
+        sblk->class_freelist[i] = 0;
+    }
+
+    /* No snapshot */
+    memset(sblk->snapshots, 0, sizeof(sblk->snapshots));
 
     /* Initialize the root inode */
     gettimeofday(&tv, NULL);
@@ -103,13 +113,117 @@ advfs_init(advfs_t *advfs)
     inode[sblk->root].attr.ctime = tv.tv_sec;
     inode[sblk->root].attr.size = 0;
     inode[sblk->root].attr.n_blocks = 0;
+    inode[sblk->root].attr.n_dead = 0;
+    inode[sblk->root].attr.flags = 0;
+    if ( ADVFS_BCLASS_AUTO != advfs->bclass ) {
+        inode[sblk->root].attr.flags
+            = ((uint64_t)advfs->bclass << ADVFS_INODE_BCLASS_SHIFT)
+            | ADVFS_INODE_BCLASS_SET;
+    }
+    inode[sblk->root].attr.extents = 0;
     inode[sblk->root].name[0] = '\0';
 
-    advfs->superblock = sblk;
+    /* The whole metadata region is written by the first commit */
+    for ( i = 0; i < (ssize_t)sblk->ptr_block; i++ ) {
+        advfs_journal_dirty(advfs, i);
+    }
+}
+
+/*
+ * Rebuild the state kept in memory, and the state derived from the block
+ * maps, from the loaded image
+ */
+static int
+_load(advfs_t *advfs)
+{
+    advfs_inode_t e;
+    advfs_block_mgt_t mgt;
+    uint64_t i;
+
+    /* Reference counters and dedup trees */
+    if ( advfs_rebuild(advfs) < 0 ) {
+        return -1;
+    }
+
+    /* Whole-file digest index */
+    for ( i = 0; i < ADVFS_INODE_NUM; i++ ) {
+        advfs_read_inode(advfs, &e, i);
+        if ( e.attr.type == ADVFS_REGULAR_FILE
+             && (e.attr.flags & ADVFS_INODE_DIGEST) ) {
+            advfs_digest_index_add(advfs, i);
+        }
+    }
+
+    /* Compressed blocks in use */
+    for ( i = 0; i < advfs->superblock->n_zblocks; i++ ) {
+        advfs_read_block_mgt(advfs, &mgt, ADVFS_ZBLOCK_BASE + i);
+        if ( mgt.ref > 0 ) {
+            advfs->zstats.live_blocks++;
+            advfs->zstats.live_slots
+                += (mgt.zlen + ADVFS_ZSLOT_SIZE - 1) / ADVFS_ZSLOT_SIZE;
+        }
+    }
 
     return 0;
 }
 
+/*
+ * Initialize; format the block device, or load the backing image
+ */
+int
+advfs_init(advfs_t *advfs)
+{
+    void *blkdev;
+    int loaded;
+    int ret;
+
+    /* Initialize the block device */
+    blkdev = malloc(ADVFS_BLOCK_SIZE * ADVFS_BLOCK_NUM);
+    if ( NULL == blkdev ) {
+        return -1;
+    }
+    advfs->superblock = blkdev;
+
+    /* Ensure that each data structure size must be aligned. */
+    assert( (ADVFS_BLOCK_SIZE % sizeof(advfs_inode_t)) == 0 );
+    assert( (ADVFS_INODE_NUM
+             % (ADVFS_BLOCK_SIZE / sizeof(advfs_inode_t))) == 0 );
+    assert( sizeof(advfs_superblock_t) == ADVFS_BLOCK_SIZE );
+    assert( (ADVFS_BLOCK_SIZE % sizeof(advfs_block_mgt_t)) == 0 );
+
+    loaded = advfs_journal_open(advfs);
+    if ( loaded < 0 ) {
+        return -1;
+    }
+    if ( !loaded ) {
+        _format(advfs);
+    } else if ( 0 == advfs->superblock->n_zblocks
+                && (ADVFS_COMPRESS_NONE != advfs->compress
+                    || ADVFS_CHUNK_CDC == advfs->chunking) ) {
+        /* The layout is fixed when the image is formatted */
+        fprintf(stderr, "advfs: the image has no compressed block ids\n");
+        return -1;
+    }
+
+    advfs->writeback = 0;
+    memset(advfs->dir_open, 0, sizeof(advfs->dir_open));
+    memset(advfs->digest_bucket, 0, sizeof(advfs->digest_bucket));
+    memset(advfs->digest_next, 0, sizeof(advfs->digest_next));
+    memset(advfs->digest_indexed, 0, sizeof(advfs->digest_indexed));
+    memset(&advfs->rstats, 0, sizeof(advfs->rstats));
+    advfs_cdc_init();
+
+    ret = advfs_compress_init(advfs);
+    if ( 0 != ret ) {
+        return ret;
+    }
+    if ( loaded && _load(advfs) < 0 ) {
+        return -1;
+    }
+
+    return advfs_journal_commit(advfs);
+}
+
 /*
  * Local variables:
  * tab-width: 4
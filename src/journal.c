@@ -0,0 +1,643 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "advfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ADVFS_DEVICE_SIZE       ((off_t)ADVFS_BLOCK_SIZE * ADVFS_BLOCK_NUM)
+
+/*
+ * Read the whole buffer at the offset
+ */
+int
+advfs_pread_all(int fd, void *buf, size_t size, off_t off)
+{
+    ssize_t n;
+
+    while ( size > 0 ) {
+        n = pread(fd, buf, size, off);
+        if ( n < 0 && EINTR == errno ) {
+            continue;
+        } else if ( n <= 0 ) {
+            return -1;
+        }
+        buf = (uint8_t *)buf + n;
+        size -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the whole buffer at the offset
+ */
+int
+advfs_pwrite_all(int fd, const void *buf, size_t size, off_t off)
+{
+    ssize_t n;
+
+    while ( size > 0 ) {
+        n = pwrite(fd, buf, size, off);
+        if ( n < 0 && EINTR == errno ) {
+            continue;
+        } else if ( n <= 0 ) {
+            return -1;
+        }
+        buf = (const uint8_t *)buf + n;
+        size -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Dirty block bitmap
+ */
+static int
+_is_dirty(advfs_t *advfs, uint64_t b)
+{
+    return advfs->dirty[b / 8] & (1 << (b % 8));
+}
+static void
+_clear_dirty(advfs_t *advfs, uint64_t b)
+{
+    if ( _is_dirty(advfs, b) ) {
+        advfs->dirty[b / 8] &= ~(1 << (b % 8));
+        advfs->n_dirty--;
+    }
+}
+
+/*
+ * Mark the block modified in the running transaction
+ */
+void
+advfs_journal_dirty(advfs_t *advfs, uint64_t b)
+{
+    if ( advfs->image_fd < 0 || b >= ADVFS_BLOCK_NUM || _is_dirty(advfs, b) ) {
+        return;
+    }
+    advfs->dirty[b / 8] |= 1 << (b % 8);
+    advfs->n_dirty++;
+}
+
+/*
+ * Record that the running transaction changes the inode
+ */
+void
+advfs_journal_touch(advfs_t *advfs, uint64_t inr)
+{
+    if ( advfs->image_fd < 0 || inr >= ADVFS_INODE_NUM ) {
+        return;
+    }
+    advfs->jtid[inr] = advfs->jcommitted + 1;
+}
+
+/*
+ * Write the runs of the dirty blocks in [from, to) to the image in place and
+ * clear them; returns the # of blocks written, or -1 on error
+ */
+static int64_t
+_write_runs(advfs_t *advfs, uint64_t from, uint64_t to)
+{
+    uint64_t b;
+    uint64_t e;
+    int64_t n;
+
+    n = 0;
+    for ( b = from; b < to; b = e ) {
+        if ( !_is_dirty(advfs, b) ) {
+            e = b + 1;
+            continue;
+        }
+        for ( e = b + 1; e < to && _is_dirty(advfs, e); e++ ) {
+            ;
+        }
+        if ( advfs_pwrite_all(advfs->image_fd,
+                              (uint8_t *)advfs->superblock
+                              + b * ADVFS_BLOCK_SIZE,
+                              (e - b) * ADVFS_BLOCK_SIZE,
+                              (off_t)b * ADVFS_BLOCK_SIZE) < 0 ) {
+            return -1;
+        }
+        n += e - b;
+    }
+    for ( b = from; b < to; b++ ) {
+        _clear_dirty(advfs, b);
+    }
+
+    return n;
+}
+
+/*
+ * Make the image durable and empty the journal
+ */
+static int
+_checkpoint(advfs_t *advfs)
+{
+    if ( fdatasync(advfs->image_fd) < 0 ) {
+        return -1;
+    }
+    if ( ftruncate(advfs->journal_fd, 0) < 0
+         || fsync(advfs->journal_fd) < 0 ) {
+        return -1;
+    }
+    advfs->joff = 0;
+    advfs->jstats.checkpoints++;
+
+    return 0;
+}
+
+/*
+ * Replay the valid transactions in the journal to the image in memory and
+ * on the file
+ */
+static int
+_replay(advfs_t *advfs)
+{
+    advfs_journal_header_t hdr;
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    uint8_t *buf;
+    uint64_t *nrs;
+    uint64_t seq;
+    uint64_t nidx;
+    uint64_t i;
+    size_t size;
+    off_t off;
+
+    off = 0;
+    seq = 0;
+    for ( ;; ) {
+        if ( advfs_pread_all(advfs->journal_fd, &hdr, sizeof(hdr),
+                             off) < 0 ) {
+            /* End of the journal */
+            break;
+        }
+        if ( 0 != memcmp(hdr.magic, ADVFS_JOURNAL_MAGIC, sizeof(hdr.magic))
+             || 0 == hdr.n || hdr.n > ADVFS_BLOCK_NUM
+             || (0 != seq && hdr.seq != seq) ) {
+            break;
+        }
+        nidx = (hdr.n * sizeof(uint64_t) + ADVFS_BLOCK_SIZE - 1)
+            / ADVFS_BLOCK_SIZE;
+        size = (nidx + hdr.n) * ADVFS_BLOCK_SIZE;
+        buf = malloc(size);
+        if ( NULL == buf ) {
+            return -1;
+        }
+        if ( advfs_pread_all(advfs->journal_fd, buf, size,
+                             off + sizeof(hdr)) < 0 ) {
+            /* Torn transaction */
+            free(buf);
+            break;
+        }
+        SHA384(buf, size, hash);
+        if ( 0 != memcmp(hash, hdr.hash, sizeof(hash)) ) {
+            free(buf);
+            break;
+        }
+        nrs = (uint64_t *)buf;
+        for ( i = 0; i < hdr.n; i++ ) {
+            if ( nrs[i] >= ADVFS_BLOCK_NUM ) {
+                break;
+            }
+        }
+        if ( i < hdr.n ) {
+            free(buf);
+            break;
+        }
+        for ( i = 0; i < hdr.n; i++ ) {
+            memcpy((uint8_t *)advfs->superblock + nrs[i] * ADVFS_BLOCK_SIZE,
+                   buf + (nidx + i) * ADVFS_BLOCK_SIZE, ADVFS_BLOCK_SIZE);
+            advfs_journal_dirty(advfs, nrs[i]);
+        }
+        free(buf);
+        off += sizeof(hdr) + size;
+        seq = hdr.seq + 1;
+        advfs->jstats.replayed++;
+    }
+    if ( 0 != seq ) {
+        advfs->jseq = seq;
+    }
+
+    /* Apply the replayed blocks, then discard the journal */
+    if ( _write_runs(advfs, 0, ADVFS_BLOCK_NUM) < 0 ) {
+        return -1;
+    }
+
+    return _checkpoint(advfs);
+}
+
+/*
+ * Open the journal next to the image in place, emptied if the image is new
+ */
+static int
+_open_journal(advfs_t *advfs, int new)
+{
+    char *path;
+
+    path = malloc(strlen(advfs->image) + strlen(ADVFS_JOURNAL_SUFFIX) + 1);
+    if ( NULL == path ) {
+        return -1;
+    }
+    sprintf(path, "%s%s", advfs->image, ADVFS_JOURNAL_SUFFIX);
+    advfs->journal_fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if ( advfs->journal_fd < 0 ) {
+        fprintf(stderr, "advfs: cannot open the journal: %s%s\n",
+                advfs->image, ADVFS_JOURNAL_SUFFIX);
+        return -1;
+    }
+    if ( new && ftruncate(advfs->journal_fd, 0) < 0 ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Open the backing image and its journal, and load the image replaying the
+ * journal; returns 1 if loaded, 0 if the image is new (to be formatted),
+ * and -1 on error
+ */
+int
+advfs_journal_open(advfs_t *advfs)
+{
+    struct stat st;
+
+    advfs->image_fd = -1;
+    advfs->journal_fd = -1;
+    memset(advfs->dirty, 0, sizeof(advfs->dirty));
+    advfs->n_dirty = 0;
+    advfs->jsuper = NULL;
+    advfs->jbrk = 0;
+    advfs->jseq = 1;
+    advfs->joff = 0;
+    advfs->jcommitted = 0;
+    memset(advfs->jtid, 0, sizeof(advfs->jtid));
+    advfs->jtime = time(NULL);
+    memset(&advfs->jstats, 0, sizeof(advfs->jstats));
+
+    if ( NULL == advfs->image ) {
+        return 0;
+    }
+
+    advfs->jsuper = malloc(sizeof(advfs_superblock_t));
+    if ( NULL == advfs->jsuper ) {
+        return -1;
+    }
+    advfs->image_fd = open(advfs->image, O_RDWR | O_CREAT, 0644);
+    if ( advfs->image_fd < 0 || fstat(advfs->image_fd, &st) < 0 ) {
+        fprintf(stderr, "advfs: cannot open the image: %s\n", advfs->image);
+        return -1;
+    }
+
+    if ( 0 == st.st_size ) {
+        /* New image; the blocks are written by the first commit */
+        if ( advfs->log ) {
+            return advfs_log_format(advfs);
+        }
+        if ( ftruncate(advfs->image_fd, ADVFS_DEVICE_SIZE) < 0 ) {
+            return -1;
+        }
+        return _open_journal(advfs, 1);
+    }
+
+    /* The layout of an existing image is detected from the file */
+    advfs->log = advfs_log_detect(advfs);
+    if ( advfs->log ) {
+        if ( advfs_log_load(advfs) < 0 ) {
+            fprintf(stderr, "advfs: cannot load the log: %s\n",
+                    advfs->image);
+            return -1;
+        }
+    } else if ( ADVFS_DEVICE_SIZE != st.st_size
+                || advfs_pread_all(advfs->image_fd, advfs->superblock,
+                                   ADVFS_DEVICE_SIZE, 0) < 0 ) {
+        fprintf(stderr, "advfs: not an advfs image: %s\n", advfs->image);
+        return -1;
+    } else if ( _open_journal(advfs, 0) < 0 || _replay(advfs) < 0 ) {
+        fprintf(stderr, "advfs: cannot replay the journal: %s\n",
+                advfs->image);
+        return -1;
+    }
+    if ( 0 != memcmp(advfs->superblock->magic, ADVFS_IMAGE_MAGIC,
+                     sizeof(advfs->superblock->magic)) ) {
+        fprintf(stderr, "advfs: not an advfs image: %s\n", advfs->image);
+        return -1;
+    }
+    memcpy(advfs->jsuper, advfs->superblock, sizeof(advfs_superblock_t));
+    advfs->jbrk = advfs->superblock->brk;
+
+    return 1;
+}
+
+/*
+ * Commit to the image in place; the blocks past the break of the last
+ * commit are written ahead, and the rest are written to the journal with a
+ * single write and then checkpointed
+ */
+static int
+_commit_inplace(advfs_t *advfs, uint64_t brk)
+{
+    advfs_journal_header_t *hdr;
+    uint8_t *buf;
+    uint64_t *nrs;
+    uint64_t nidx;
+    uint64_t n;
+    uint64_t b;
+    int64_t ret;
+    size_t size;
+
+    /* The blocks past the break of the last commit are not referenced by
+       the committed image, so their content is written in place ahead of
+       the transaction instead of being journaled */
+    if ( brk > advfs->jbrk ) {
+        ret = _write_runs(advfs, advfs->jbrk, brk);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        if ( ret > 0 && fdatasync(advfs->image_fd) < 0 ) {
+            return -1;
+        }
+        advfs->jstats.ordered += ret;
+    }
+
+    n = advfs->n_dirty;
+    if ( 0 == n ) {
+        return 0;
+    }
+    nidx = (n * sizeof(uint64_t) + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+    size = (1 + nidx + n) * ADVFS_BLOCK_SIZE;
+    buf = calloc(1, size);
+    if ( NULL == buf ) {
+        return -1;
+    }
+    hdr = (advfs_journal_header_t *)buf;
+    nrs = (uint64_t *)(buf + ADVFS_BLOCK_SIZE);
+    n = 0;
+    for ( b = 0; b < ADVFS_BLOCK_NUM; b++ ) {
+        if ( _is_dirty(advfs, b) ) {
+            nrs[n] = b;
+            memcpy(buf + (1 + nidx + n) * ADVFS_BLOCK_SIZE,
+                   (uint8_t *)advfs->superblock + b * ADVFS_BLOCK_SIZE,
+                   ADVFS_BLOCK_SIZE);
+            n++;
+        }
+    }
+    memcpy(hdr->magic, ADVFS_JOURNAL_MAGIC, sizeof(hdr->magic));
+    hdr->seq = advfs->jseq;
+    hdr->n = n;
+    hdr->total = n;
+    SHA384(buf + ADVFS_BLOCK_SIZE, size - ADVFS_BLOCK_SIZE, hdr->hash);
+    if ( advfs_pwrite_all(advfs->journal_fd, buf, size, advfs->joff) < 0
+         || fdatasync(advfs->journal_fd) < 0 ) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    advfs->jseq++;
+    advfs->joff += size;
+    advfs->jstats.journaled += n;
+    advfs->jstats.bytes += size;
+
+    /* Checkpoint the blocks in place; the journal keeps them until the
+       image is flushed */
+    if ( _write_runs(advfs, 0, ADVFS_BLOCK_NUM) < 0 ) {
+        return -1;
+    }
+    if ( advfs->joff >= ADVFS_JOURNAL_MAX ) {
+        return _checkpoint(advfs);
+    }
+
+    return 0;
+}
+
+/*
+ * Commit to the log-structured image; all the dirty blocks are appended
+ */
+static int
+_commit_log(advfs_t *advfs)
+{
+    uint64_t *nrs;
+    uint64_t n;
+    uint64_t b;
+
+    nrs = malloc(advfs->n_dirty * sizeof(uint64_t));
+    if ( NULL == nrs ) {
+        return -1;
+    }
+    n = 0;
+    for ( b = 0; b < ADVFS_BLOCK_NUM; b++ ) {
+        if ( _is_dirty(advfs, b) ) {
+            nrs[n++] = b;
+        }
+    }
+    if ( advfs_log_write(advfs, nrs, n) < 0 ) {
+        free(nrs);
+        return -1;
+    }
+    for ( b = 0; b < n; b++ ) {
+        _clear_dirty(advfs, nrs[b]);
+    }
+    free(nrs);
+
+    return 0;
+}
+
+/*
+ * Commit the running transaction; all the operations since the last commit
+ * share one write and one flush
+ */
+int
+advfs_journal_commit(advfs_t *advfs)
+{
+    uint64_t brk;
+    int ret;
+
+    if ( advfs->image_fd < 0 ) {
+        return 0;
+    }
+
+    /* The superblock is updated in place all over; compare it with the
+       committed one */
+    if ( 0 != memcmp(advfs->jsuper, advfs->superblock,
+                     sizeof(advfs_superblock_t)) ) {
+        advfs_journal_dirty(advfs, 0);
+    }
+    if ( advfs->log ) {
+        advfs_log_clean(advfs);
+    }
+    if ( 0 == advfs->n_dirty ) {
+        advfs->jcommitted++;
+        advfs->jtime = time(NULL);
+        return 0;
+    }
+
+    brk = advfs->superblock->brk;
+    if ( advfs->log ) {
+        ret = _commit_log(advfs);
+    } else {
+        ret = _commit_inplace(advfs, brk);
+    }
+    if ( ret < 0 ) {
+        advfs->jstats.failures++;
+        return -1;
+    }
+
+    memcpy(advfs->jsuper, advfs->superblock, sizeof(advfs_superblock_t));
+    advfs->jbrk = brk;
+    advfs->jcommitted++;
+    advfs->jtime = time(NULL);
+    advfs->jstats.commits++;
+
+    return 0;
+}
+
+/*
+ * Make the changes of the inode durable.  The metadata blocks are shared by
+ * the files (the dedup tree, the reference counters and the free lists), so
+ * they cannot be committed per file; the running transaction is committed
+ * as a whole only if it has changed the inode, and otherwise nothing is
+ * written.
+ */
+int
+advfs_journal_sync(advfs_t *advfs, uint64_t inr)
+{
+    if ( advfs->image_fd < 0 ) {
+        return 0;
+    }
+    advfs->jstats.syncs++;
+    if ( ADVFS_INODE_READONLY(inr) || advfs->jtid[inr] <= advfs->jcommitted ) {
+        advfs->jstats.syncs_clean++;
+        return 0;
+    }
+
+    return advfs_journal_commit(advfs);
+}
+
+/*
+ * Commit at the boundary of the operations when the commit interval has
+ * passed or the running transaction has grown large.  The operations are
+ * served one at a time with an image (see main), so no operation is halfway
+ * here.  A failed commit leaves the transaction running, and is retried by
+ * the next tick.
+ */
+void
+advfs_journal_tick(advfs_t *advfs)
+{
+    if ( advfs->image_fd < 0 ) {
+        return;
+    }
+    if ( advfs->n_dirty >= ADVFS_COMMIT_BLOCKS
+         || time(NULL) - advfs->jtime >= advfs->commit_interval ) {
+        if ( advfs_journal_commit(advfs) < 0 ) {
+            fprintf(stderr, "advfs: cannot commit the journal: %s\n",
+                    advfs->image);
+        }
+    }
+}
+
+/*
+ * Commit and checkpoint at unmount, so that the journal is left empty
+ */
+void
+advfs_journal_close(advfs_t *advfs)
+{
+    if ( advfs->image_fd < 0 ) {
+        return;
+    }
+    if ( 0 == advfs_journal_commit(advfs) && !advfs->log ) {
+        _checkpoint(advfs);
+    }
+    if ( advfs->journal_fd >= 0 ) {
+        close(advfs->journal_fd);
+    }
+    close(advfs->image_fd);
+    advfs->journal_fd = -1;
+    advfs->image_fd = -1;
+    free(advfs->jsuper);
+    advfs->jsuper = NULL;
+}
+
+/*
+ * Journal statistics as "key=value" lines
+ */
+int
+advfs_journal_stats(advfs_t *advfs, char *buf, size_t size)
+{
+    advfs_jstats_t *st;
+    int len;
+
+    if ( advfs->image_fd < 0 ) {
+        return 0;
+    }
+    st = &advfs->jstats;
+
+    len = snprintf(buf, size,
+                   "journal_commits=%llu\n"
+                   "journal_blocks=%llu\n"
+                   "ordered_blocks=%llu\n"
+                   "journal_bytes=%llu\n"
+                   "journal_checkpoints=%llu\n"
+                   "journal_replayed=%llu\n"
+                   "fsyncs=%llu\n"
+                   "fsyncs_clean=%llu\n"
+                   "journal_failures=%llu\n"
+                   "dirty_blocks=%llu\n",
+                   (unsigned long long)st->commits,
+                   (unsigned long long)st->journaled,
+                   (unsigned long long)st->ordered,
+                   (unsigned long long)st->bytes,
+                   (unsigned long long)st->checkpoints,
+                   (unsigned long long)st->replayed,
+                   (unsigned long long)st->syncs,
+                   (unsigned long long)st->syncs_clean,
+                   (unsigned long long)st->failures,
+                   (unsigned long long)advfs->n_dirty);
+    if ( advfs->log && len >= 0 && (size_t)len < size ) {
+        len += advfs_log_stats(advfs, buf + len, size - len);
+    }
+    if ( len >= 0 && (size_t)len < size ) {
+        len += advfs_rebuild_stats(advfs, buf + len, size - len);
+    }
+
+    return len;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
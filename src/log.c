@@ -0,0 +1,724 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "advfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The log-structured image is a header block followed by the segments.  A
+ * commit appends all the dirty blocks at the head of the log; the blocks
+ * are never updated in place, and the location of each block is kept in
+ * memory.  A commit is split into records when it crosses a segment, each
+ * of the format of a journal transaction.  The location index is rebuilt
+ * at mount by scanning the records of all the segments in the order of the
+ * sequence numbers.  Only the last commit can be torn, as each commit is
+ * flushed before the next; it is discarded, and its records are erased so
+ * that it is not taken for an older commit of which the cleaner has
+ * reclaimed some records.
+ *
+ * The cleaner reclaims the segments of which the blocks are partly dead.
+ * It relocates the live blocks by marking them dirty, so that the running
+ * commit appends them with the other dirty blocks; the block numbers do not
+ * change, and the dedup tree and the reference counters are not touched.
+ *
+ * The blocks on the free lists are not appended, and their locations are
+ * dropped once the commit freeing them is durable, so that they do not keep
+ * the segments busy.  The links of the free lists in them are not in the
+ * log; the free lists are rebuilt from the references at mount.
+ */
+
+#define ADVFS_LOG_BLOCKS        (ADVFS_SEGMENT_BLOCKS * ADVFS_SEGMENT_NUM)
+
+/* Record found at mount */
+struct _log_record {
+    uint64_t seq;
+    uint64_t total;
+    uint64_t n;
+    /* Block in the log of the header */
+    uint64_t lb;
+    uint64_t *nrs;
+};
+
+/*
+ * Monotonic clock in nanoseconds
+ */
+static uint64_t
+_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Offset of the block in the log
+ */
+static off_t
+_log_off(uint64_t lb)
+{
+    return (off_t)(1 + lb) * ADVFS_BLOCK_SIZE;
+}
+
+/*
+ * # of blocks of the block numbers of a record of n blocks
+ */
+static uint64_t
+_log_nidx(uint64_t n)
+{
+    return (n * sizeof(uint64_t) + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+}
+
+/*
+ * Move the location of the block, and count the blocks of the segments
+ */
+static void
+_log_locate(advfs_t *advfs, uint64_t b, uint64_t lb)
+{
+    if ( 0 != advfs->lmap[b] ) {
+        advfs->lseg_live[(advfs->lmap[b] - 1) / ADVFS_SEGMENT_BLOCKS]--;
+    }
+    advfs->lmap[b] = lb + 1;
+    advfs->lseg_live[lb / ADVFS_SEGMENT_BLOCKS]++;
+}
+
+/*
+ * Whether the block is on the free lists
+ */
+static int
+_log_is_free(advfs_t *advfs, uint64_t b)
+{
+    return advfs->lfree[b / 8] & (1 << (b % 8));
+}
+
+/*
+ * Mark the n blocks from b as put on the free lists (isfree) or taken from
+ * them
+ */
+void
+advfs_log_mark_free(advfs_t *advfs, uint64_t b, uint64_t n, int isfree)
+{
+    if ( !advfs->log ) {
+        return;
+    }
+    for ( ; n > 0; b++, n-- ) {
+        if ( isfree ) {
+            advfs->lfree[b / 8] |= 1 << (b % 8);
+        } else {
+            advfs->lfree[b / 8] &= ~(1 << (b % 8));
+        }
+    }
+}
+
+/*
+ * Drop the locations of the free blocks; called when the free lists are
+ * durable (after a commit, or rebuilt at mount)
+ */
+void
+advfs_log_drop_free(advfs_t *advfs)
+{
+    uint64_t b;
+
+    for ( b = 0; b < ADVFS_BLOCK_NUM; b++ ) {
+        if ( 0 != advfs->lmap[b] && _log_is_free(advfs, b) ) {
+            advfs->lseg_live[(advfs->lmap[b] - 1) / ADVFS_SEGMENT_BLOCKS]--;
+            advfs->lmap[b] = 0;
+        }
+    }
+}
+
+/*
+ * Clear the location index and the statistics
+ */
+static void
+_log_reset(advfs_t *advfs)
+{
+    memset(advfs->lmap, 0, sizeof(advfs->lmap));
+    memset(advfs->lfree, 0, sizeof(advfs->lfree));
+    memset(advfs->lseg_live, 0, sizeof(advfs->lseg_live));
+    memset(advfs->lseg_seq, 0, sizeof(advfs->lseg_seq));
+    memset(&advfs->lstats, 0, sizeof(advfs->lstats));
+    advfs->lhead = 0;
+}
+
+/*
+ * # of the segments without blocks
+ */
+static uint64_t
+_log_nfree(advfs_t *advfs)
+{
+    uint64_t s;
+    uint64_t n;
+
+    n = 0;
+    for ( s = 0; s < ADVFS_SEGMENT_NUM; s++ ) {
+        if ( 0 == advfs->lseg_live[s] ) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Find a segment without blocks for the head; the segments taken by the
+ * running commit are skipped
+ */
+static int64_t
+_log_free_segment(advfs_t *advfs, const uint8_t *taken)
+{
+    uint64_t s;
+
+    for ( s = 0; s < ADVFS_SEGMENT_NUM; s++ ) {
+        if ( 0 == advfs->lseg_live[s] && !taken[s]
+             && s != advfs->lhead / ADVFS_SEGMENT_BLOCKS ) {
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Write the header of a new log
+ */
+int
+advfs_log_format(advfs_t *advfs)
+{
+    advfs_log_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ADVFS_LOG_MAGIC, sizeof(hdr.magic));
+    hdr.segment_blocks = ADVFS_SEGMENT_BLOCKS;
+    hdr.n_segments = ADVFS_SEGMENT_NUM;
+    if ( advfs_pwrite_all(advfs->image_fd, &hdr, sizeof(hdr), 0) < 0
+         || ftruncate(advfs->image_fd, _log_off(ADVFS_LOG_BLOCKS)) < 0 ) {
+        return -1;
+    }
+    _log_reset(advfs);
+
+    return 0;
+}
+
+/*
+ * Whether the image is log-structured
+ */
+int
+advfs_log_detect(advfs_t *advfs)
+{
+    char magic[8];
+
+    if ( advfs_pread_all(advfs->image_fd, magic, sizeof(magic), 0) < 0 ) {
+        return 0;
+    }
+
+    return 0 == memcmp(magic, ADVFS_LOG_MAGIC, sizeof(magic));
+}
+
+/*
+ * Compare the records by the sequence number
+ */
+static int
+_log_record_cmp(const void *a, const void *b)
+{
+    const struct _log_record *x;
+    const struct _log_record *y;
+
+    x = a;
+    y = b;
+    if ( x->seq < y->seq ) {
+        return -1;
+    } else if ( x->seq > y->seq ) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Scan the valid records in a segment.  The records of a use of the segment
+ * are of increasing sequence numbers from its start, as a commit writes one
+ * record to a segment; a record not newer than the one before it is left
+ * from a previous use, and ends the scan.
+ */
+static int
+_log_scan_segment(advfs_t *advfs, uint64_t s, struct _log_record **recs,
+                  uint64_t *n, uint64_t *size)
+{
+    advfs_journal_header_t hdr;
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    struct _log_record *r;
+    uint8_t *buf;
+    uint64_t off;
+    uint64_t nidx;
+    uint64_t last;
+    uint64_t i;
+    size_t len;
+
+    off = 0;
+    last = 0;
+    while ( off + 2 < ADVFS_SEGMENT_BLOCKS ) {
+        if ( advfs_pread_all(advfs->image_fd, &hdr, sizeof(hdr),
+                             _log_off(s * ADVFS_SEGMENT_BLOCKS + off)) < 0 ) {
+            break;
+        }
+        if ( 0 != memcmp(hdr.magic, ADVFS_JOURNAL_MAGIC, sizeof(hdr.magic))
+             || 0 == hdr.n || hdr.n > hdr.total
+             || (off > 0 && hdr.seq <= last)
+             || off + 1 + _log_nidx(hdr.n) + hdr.n > ADVFS_SEGMENT_BLOCKS ) {
+            break;
+        }
+        nidx = _log_nidx(hdr.n);
+        len = (nidx + hdr.n) * ADVFS_BLOCK_SIZE;
+        buf = malloc(len);
+        if ( NULL == buf ) {
+            return -1;
+        }
+        if ( advfs_pread_all(advfs->image_fd, buf, len,
+                             _log_off(s * ADVFS_SEGMENT_BLOCKS + off + 1))
+             < 0 ) {
+            free(buf);
+            break;
+        }
+        SHA384(buf, len, hash);
+        for ( i = 0; i < hdr.n; i++ ) {
+            if ( ((uint64_t *)buf)[i] >= ADVFS_BLOCK_NUM ) {
+                break;
+            }
+        }
+        if ( 0 != memcmp(hash, hdr.hash, sizeof(hash)) || i < hdr.n ) {
+            free(buf);
+            break;
+        }
+
+        /* Keep the block numbers */
+        if ( *n == *size ) {
+            *size = *size ? *size * 2 : 64;
+            r = realloc(*recs, *size * sizeof(struct _log_record));
+            if ( NULL == r ) {
+                free(buf);
+                return -1;
+            }
+            *recs = r;
+        }
+        r = &(*recs)[(*n)++];
+        r->seq = hdr.seq;
+        r->total = hdr.total;
+        r->n = hdr.n;
+        r->lb = s * ADVFS_SEGMENT_BLOCKS + off;
+        r->nrs = (uint64_t *)buf;
+        advfs->lseg_seq[s] = hdr.seq;
+        last = hdr.seq;
+
+        off += 1 + nidx + hdr.n;
+    }
+
+    return 0;
+}
+
+/*
+ * Load the log-structured image; rebuild the location index from the
+ * records of the commits but a torn last one, then read the blocks
+ */
+int
+advfs_log_load(advfs_t *advfs)
+{
+    advfs_log_header_t hdr;
+    advfs_journal_header_t zero;
+    struct _log_record *recs;
+    uint64_t n;
+    uint64_t size;
+    uint64_t i;
+    uint64_t j;
+    uint64_t k;
+    uint64_t cnt;
+    uint64_t b;
+    uint64_t seq;
+    int64_t s;
+    int ret;
+
+    if ( advfs_pread_all(advfs->image_fd, &hdr, sizeof(hdr), 0) < 0
+         || ADVFS_SEGMENT_BLOCKS != hdr.segment_blocks
+         || ADVFS_SEGMENT_NUM != hdr.n_segments ) {
+        return -1;
+    }
+    _log_reset(advfs);
+
+    recs = NULL;
+    n = 0;
+    size = 0;
+    ret = 0;
+    for ( s = 0; s < ADVFS_SEGMENT_NUM && 0 == ret; s++ ) {
+        ret = _log_scan_segment(advfs, s, &recs, &n, &size);
+    }
+    if ( 0 == ret ) {
+        qsort(recs, n, sizeof(struct _log_record), _log_record_cmp);
+    }
+
+    /* Apply the commits; the sequence numbers continue from the largest
+       found, even of a torn commit, so that they are never reused */
+    memset(&zero, 0, sizeof(zero));
+    seq = 0;
+    for ( i = 0; i < n && 0 == ret; i = j ) {
+        cnt = 0;
+        for ( j = i; j < n && recs[j].seq == recs[i].seq; j++ ) {
+            cnt += recs[j].n;
+        }
+        seq = recs[i].seq;
+        if ( j == n && cnt != recs[i].total ) {
+            /* Torn */
+            for ( k = i; k < j && 0 == ret; k++ ) {
+                ret = advfs_pwrite_all(advfs->image_fd, &zero, sizeof(zero),
+                                       _log_off(recs[k].lb));
+            }
+            if ( 0 == ret ) {
+                ret = fdatasync(advfs->image_fd);
+            }
+            continue;
+        }
+        for ( k = i; k < j; k++ ) {
+            for ( b = 0; b < recs[k].n; b++ ) {
+                _log_locate(advfs, recs[k].nrs[b],
+                            recs[k].lb + 1 + _log_nidx(recs[k].n) + b);
+            }
+        }
+        advfs->jstats.replayed++;
+    }
+    for ( i = 0; i < n; i++ ) {
+        free(recs[i].nrs);
+    }
+    free(recs);
+    if ( 0 != ret ) {
+        return -1;
+    }
+    advfs->jseq = seq + 1;
+
+    /* Read the blocks */
+    for ( b = 0; b < ADVFS_BLOCK_NUM; b++ ) {
+        if ( 0 == advfs->lmap[b] ) {
+            memset((uint8_t *)advfs->superblock + b * ADVFS_BLOCK_SIZE, 0,
+                   ADVFS_BLOCK_SIZE);
+        } else if ( advfs_pread_all(advfs->image_fd,
+                                    (uint8_t *)advfs->superblock
+                                    + b * ADVFS_BLOCK_SIZE, ADVFS_BLOCK_SIZE,
+                                    _log_off(advfs->lmap[b] - 1)) < 0 ) {
+            return -1;
+        }
+    }
+
+    /* The first commit starts at an empty segment, past any torn record */
+    advfs->lhead = ADVFS_LOG_BLOCKS;
+
+    return 0;
+}
+
+/*
+ * Append the blocks as a commit, split into the records of the segments,
+ * and flush; the locations are moved once the commit is durable.  The free
+ * blocks are left out, and their locations are dropped.
+ */
+int
+advfs_log_write(advfs_t *advfs, const uint64_t *nrs, uint64_t n)
+{
+    advfs_journal_header_t *hdr;
+    uint8_t taken[ADVFS_SEGMENT_NUM];
+    uint64_t *blks;
+    uint64_t *locs;
+    uint8_t *buf;
+    uint64_t head;
+    uint64_t room;
+    uint64_t nidx;
+    uint64_t i;
+    uint64_t j;
+    uint64_t k;
+    uint64_t m;
+    int64_t s;
+    size_t size;
+
+    blks = malloc((n + 1) * sizeof(uint64_t));
+    locs = malloc((n + 1) * sizeof(uint64_t));
+    buf = malloc((1 + _log_nidx(ADVFS_SEGMENT_BLOCKS) + ADVFS_SEGMENT_BLOCKS)
+                 * ADVFS_BLOCK_SIZE);
+    if ( NULL == blks || NULL == locs || NULL == buf ) {
+        free(blks);
+        free(locs);
+        free(buf);
+        return -1;
+    }
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        if ( !_log_is_free(advfs, nrs[i]) ) {
+            blks[m++] = nrs[i];
+        }
+    }
+
+    memset(taken, 0, sizeof(taken));
+    head = advfs->lhead;
+    if ( head < ADVFS_LOG_BLOCKS ) {
+        taken[head / ADVFS_SEGMENT_BLOCKS] = 1;
+    }
+    for ( i = 0; i < m; i += k ) {
+        /* Fit as many blocks as possible in the rest of the segment */
+        room = (head < ADVFS_LOG_BLOCKS)
+            ? ADVFS_SEGMENT_BLOCKS - head % ADVFS_SEGMENT_BLOCKS : 0;
+        if ( room < 3 ) {
+            s = _log_free_segment(advfs, taken);
+            if ( s < 0 ) {
+                /* The log is full */
+                free(blks);
+                free(locs);
+                free(buf);
+                return -1;
+            }
+            taken[s] = 1;
+            head = s * ADVFS_SEGMENT_BLOCKS;
+            room = ADVFS_SEGMENT_BLOCKS;
+        }
+        k = room - 1;
+        while ( 1 + _log_nidx(k) + k > room ) {
+            k--;
+        }
+        if ( k > m - i ) {
+            k = m - i;
+        }
+        nidx = _log_nidx(k);
+        size = (1 + nidx + k) * ADVFS_BLOCK_SIZE;
+
+        /* Build the record */
+        memset(buf, 0, (1 + nidx) * ADVFS_BLOCK_SIZE);
+        hdr = (advfs_journal_header_t *)buf;
+        for ( j = 0; j < k; j++ ) {
+            ((uint64_t *)(buf + ADVFS_BLOCK_SIZE))[j] = blks[i + j];
+            memcpy(buf + (1 + nidx + j) * ADVFS_BLOCK_SIZE,
+                   (uint8_t *)advfs->superblock
+                   + blks[i + j] * ADVFS_BLOCK_SIZE, ADVFS_BLOCK_SIZE);
+            locs[i + j] = head + 1 + nidx + j;
+        }
+        memcpy(hdr->magic, ADVFS_JOURNAL_MAGIC, sizeof(hdr->magic));
+        hdr->seq = advfs->jseq;
+        hdr->n = k;
+        hdr->total = m;
+        SHA384(buf + ADVFS_BLOCK_SIZE, size - ADVFS_BLOCK_SIZE, hdr->hash);
+        if ( advfs_pwrite_all(advfs->image_fd, buf, size, _log_off(head))
+             < 0 ) {
+            free(blks);
+            free(locs);
+            free(buf);
+            return -1;
+        }
+        advfs->lseg_seq[head / ADVFS_SEGMENT_BLOCKS] = advfs->jseq;
+        head += 1 + nidx + k;
+        if ( 0 == head % ADVFS_SEGMENT_BLOCKS ) {
+            /* The segment is full; the next one is not necessarily free */
+            head = ADVFS_LOG_BLOCKS;
+        }
+        advfs->jstats.bytes += size;
+        advfs->lstats.written += 1 + nidx + k;
+    }
+    free(buf);
+    if ( fdatasync(advfs->image_fd) < 0 ) {
+        free(blks);
+        free(locs);
+        return -1;
+    }
+
+    /* Durable; move the locations */
+    for ( i = 0; i < m; i++ ) {
+        _log_locate(advfs, blks[i], locs[i]);
+    }
+    advfs_log_drop_free(advfs);
+    free(blks);
+    free(locs);
+    advfs->lhead = head;
+    advfs->jseq++;
+    advfs->jstats.journaled += m;
+    advfs->lstats.appended += m;
+
+    return 0;
+}
+
+/*
+ * Cost-benefit of cleaning the segment: the space reclaimed times its age
+ * (the older, the less likely the rest dies soon) for the cost of reading
+ * the segment and writing the live blocks
+ */
+static double
+_log_benefit(advfs_t *advfs, uint64_t s)
+{
+    double u;
+    double age;
+
+    u = (double)advfs->lseg_live[s] / ADVFS_SEGMENT_BLOCKS;
+    age = (double)(advfs->jseq - advfs->lseg_seq[s]);
+
+    return (1.0 - u) * age / (1.0 + u);
+}
+
+/*
+ * Clean the segments when few are free; the live blocks of the segments of
+ * the best cost-benefit are marked dirty up to the budget, and the segments
+ * are free once the running commit has appended them
+ */
+void
+advfs_log_clean(advfs_t *advfs)
+{
+    uint8_t victim[ADVFS_SEGMENT_NUM];
+    uint64_t nfree;
+    uint64_t budget;
+    uint64_t n;
+    uint64_t s;
+    uint64_t b;
+    int64_t best;
+    double x;
+    double bx;
+    uint64_t t0;
+
+    nfree = _log_nfree(advfs);
+    if ( nfree >= ADVFS_CLEAN_LOW ) {
+        return;
+    }
+    t0 = _now_ns();
+
+    /* Below the minimum, the log would be full before the cleaner catches
+       up within the budget; the budget is raised, but still bounds the
+       commit */
+    budget = (uint64_t)advfs->clean_budget;
+    if ( nfree < ADVFS_CLEAN_MIN ) {
+        budget *= ADVFS_CLEAN_URGENT;
+    }
+
+    memset(victim, 0, sizeof(victim));
+    n = 0;
+    while ( nfree < ADVFS_CLEAN_LOW ) {
+        best = -1;
+        bx = 0.0;
+        for ( s = 0; s < ADVFS_SEGMENT_NUM; s++ ) {
+            /* The segments of which little is dead are not worth the
+               records written for the live blocks */
+            if ( victim[s] || 0 == advfs->lseg_live[s]
+                 || s == advfs->lhead / ADVFS_SEGMENT_BLOCKS
+                 || advfs->lseg_live[s] + 8 > ADVFS_SEGMENT_BLOCKS ) {
+                continue;
+            }
+            x = _log_benefit(advfs, s);
+            if ( best < 0 || x > bx ) {
+                best = s;
+                bx = x;
+            }
+        }
+        if ( best < 0
+             || (n > 0 && n + advfs->lseg_live[best] > budget) ) {
+            break;
+        }
+        victim[best] = 1;
+        n += advfs->lseg_live[best];
+        nfree++;
+        advfs->lstats.cleaned++;
+        advfs->lstats.reclaimed
+            += ADVFS_SEGMENT_BLOCKS - advfs->lseg_live[best];
+    }
+    if ( 0 == n ) {
+        advfs->lstats.clean_ns += _now_ns() - t0;
+        return;
+    }
+
+    /* Relocate the live blocks; the ones already dirty are appended anyway
+       and are not counted, and the ones freed by the running commit are
+       dropped by it */
+    n = advfs->n_dirty;
+    for ( b = 0; b < ADVFS_BLOCK_NUM; b++ ) {
+        if ( 0 != advfs->lmap[b] && !_log_is_free(advfs, b)
+             && victim[(advfs->lmap[b] - 1) / ADVFS_SEGMENT_BLOCKS] ) {
+            advfs_journal_dirty(advfs, b);
+        }
+    }
+    advfs->lstats.relocated += advfs->n_dirty - n;
+    advfs->lstats.passes++;
+    advfs->lstats.clean_ns += _now_ns() - t0;
+}
+
+/*
+ * Log statistics as "key=value" lines
+ */
+int
+advfs_log_stats(advfs_t *advfs, char *buf, size_t size)
+{
+    advfs_lstats_t *st;
+    uint64_t s;
+    uint64_t live;
+    uint64_t foreground;
+    double efficiency;
+    double wamp;
+
+    live = 0;
+    for ( s = 0; s < ADVFS_SEGMENT_NUM; s++ ) {
+        live += advfs->lseg_live[s];
+    }
+
+    /* The cleaning efficiency is the share of the cleaned segments
+       reclaimed, and the write amplification is the blocks written to the
+       log per block written by the file system */
+    st = &advfs->lstats;
+    efficiency = st->cleaned
+        ? (double)st->reclaimed / (st->cleaned * ADVFS_SEGMENT_BLOCKS) : 0.0;
+    foreground = st->appended - st->relocated;
+    wamp = foreground ? (double)st->written / foreground : 0.0;
+
+    return snprintf(buf, size,
+                    "log_segments=%llu\n"
+                    "log_free_segments=%llu\n"
+                    "log_live_blocks=%llu\n"
+                    "log_written_blocks=%llu\n"
+                    "clean_budget=%d\n"
+                    "clean_passes=%llu\n"
+                    "clean_segments=%llu\n"
+                    "clean_relocated_blocks=%llu\n"
+                    "clean_reclaimed_blocks=%llu\n"
+                    "clean_efficiency=%.3f\n"
+                    "clean_ms=%.1f\n"
+                    "write_amplification=%.2f\n",
+                    (unsigned long long)ADVFS_SEGMENT_NUM,
+                    (unsigned long long)_log_nfree(advfs),
+                    (unsigned long long)live,
+                    (unsigned long long)st->written,
+                    advfs->clean_budget,
+                    (unsigned long long)st->passes,
+                    (unsigned long long)st->cleaned,
+                    (unsigned long long)st->relocated,
+                    (unsigned long long)st->reclaimed,
+                    efficiency, st->clean_ns / 1000000.0, wamp);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -23,7 +23,9 @@
 
 #include "config.h"
 #include "advfs.h"
+#include "advfs_ioctl.h"
 #include <fuse.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +37,77 @@
 #include <sys/time.h>
 #include <assert.h>
 
+/* libfuse 2 has no flags argument in the filler function */
+#ifdef HAVE_FUSE3
+#define FILLER(filler, buf, name, st, off)              \
+    filler(buf, name, st, off, (NULL != (st)) ? FUSE_FILL_DIR_PLUS : 0)
+#else
+#define FILLER(filler, buf, name, st, off)  filler(buf, name, st, off)
+#endif
+
+/* rename flags (libfuse 3) */
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE    (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE     (1 << 1)
+#endif
+
+/* fallocate modes */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE     0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE    0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE    0x10
+#endif
+
+/* lseek whence for sparse files */
+#ifndef SEEK_DATA
+#define SEEK_DATA   3
+#endif
+#ifndef SEEK_HOLE
+#define SEEK_HOLE   4
+#endif
+
+/* No such attribute */
+#ifndef ENODATA
+#define ENODATA     ENOATTR
+#endif
+
+/*
+ * Mount options; the level is any the algorithm accepts (negative ones
+ * included for zstd), so whether it is given is a flag of its own
+ */
+struct advfs_options {
+    char *compress;
+    int compress_level;
+    int compress_level_set;
+    char *chunking;
+    char *blocksize;
+    char *image;
+    char *layout;
+    int commit;
+    int clean_budget;
+};
+
+#define ADVFS_OPT(t, p) { t, offsetof(struct advfs_options, p), 0 }
+#define ADVFS_OPT_FLAG(t, p) { t, offsetof(struct advfs_options, p), 1 }
+static const struct fuse_opt advfs_opts[] = {
+    ADVFS_OPT("compress=%s", compress),
+    ADVFS_OPT("compress_level=%d", compress_level),
+    ADVFS_OPT_FLAG("compress_level=", compress_level_set),
+    ADVFS_OPT("chunking=%s", chunking),
+    ADVFS_OPT("blocksize=%s", blocksize),
+    ADVFS_OPT("image=%s", image),
+    ADVFS_OPT("layout=%s", layout),
+    ADVFS_OPT("clean_budget=%d", clean_budget),
+    ADVFS_OPT("commit=%d", commit),
+    FUSE_OPT_END
+};
+
 /* Prototype declarations */
 static int _path2inode_rec(advfs_t *, uint64_t *, uint64_t, const char *, int);
 
@@ -44,6 +117,7 @@ static int _path2inode_rec(advfs_t *, uint64_t *, uint64_t, const char *, int);
 static int
 _increase_block(advfs_t *advfs, uint64_t inr, uint64_t nb)
 {
+    uint64_t b;
     uint64_t b2;
     uint64_t pos;
     uint8_t buf[ADVFS_BLOCK_SIZE];
@@ -66,7 +140,7 @@ _increase_block(advfs_t *advfs, uint64_t inr, uint64_t nb)
         if ( i == ADVFS_INODE_BLOCKPTR - 1 ) {
             if ( alloc ) {
                 /* Allocate a new block */
-                b2 = advfs_alloc_block(advfs);
+                b2 = advfs_alloc_meta_block(advfs);
                 if ( 0 == b2 ) {
                     return -1;
                 }
@@ -80,16 +154,18 @@ _increase_block(advfs_t *advfs, uint64_t inr, uint64_t nb)
             block = (uint64_t *)buf;
             pos = 0;
         } else if ( pos == (ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1) ) {
-            /* Write back */
-            advfs_write_raw_block(advfs, buf, b2);
-
             if ( alloc ) {
-                b2 = advfs_alloc_block(advfs);
-                if ( 0 == b2 ) {
+                /* Link a new block to the chain, then write back */
+                b = advfs_alloc_meta_block(advfs);
+                if ( 0 == b ) {
                     return -1;
                 }
-                block[pos] = b2;
+                block[pos] = b;
+                advfs_write_raw_block(advfs, buf, b2);
+                b2 = b;
             } else {
+                /* Write back */
+                advfs_write_raw_block(advfs, buf, b2);
                 b2 = block[pos];
             }
             advfs_read_raw_block(advfs, buf, b2);
@@ -119,64 +195,31 @@ _increase_block(advfs_t *advfs, uint64_t inr, uint64_t nb)
 static int
 _shrink_block(advfs_t *advfs, uint64_t inr, uint64_t nb)
 {
-    uint64_t fb;
     uint64_t b;
-    uint64_t pos;
-    uint64_t *block;
-    ssize_t i;
-    int free;
+    uint64_t next;
+    uint64_t nc;
+    uint64_t i;
     advfs_inode_t e;
     uint8_t buf[ADVFS_BLOCK_SIZE];
 
     /* Read the inode */
     advfs_read_inode(advfs, &e, inr);
 
-    block = e.blocks;
-    pos = 0;
-    fb = 0;
-    b = 0;
-    for ( i = 0; i < (ssize_t)nb; i++ ) {
-        free = (i >= (ssize_t)nb) ? 1 : 0;
-
-        /* Next chain */
-        if ( i == ADVFS_INODE_BLOCKPTR - 1 ) {
-            if ( 0 != fb ) {
-                advfs_free_block(advfs, fb);
-            }
-            b = block[ADVFS_INODE_BLOCKPTR - 1];
-            advfs_read_raw_block(advfs, buf, b);
-            block = (uint64_t *)buf;
-            pos = 0;
-            if ( free ) {
-                fb = b;
-            }
-        } else if ( pos == (ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1) ) {
-            /* Write back */
-            if ( 0 != b ) {
-                advfs_write_raw_block(advfs, buf, b);
-            }
-            if ( 0 != fb ) {
-                advfs_free_block(advfs, fb);
-            }
-            b = block[ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1];
-            advfs_read_raw_block(advfs, buf, b);
-            block = (uint64_t *)buf;
-            pos = 0;
-            if ( free ) {
-                fb = b;
-            }
-        }
-
-        if ( free ) {
-            advfs_unref_block(advfs, inr, pos);
-        }
-        pos++;
+    /* Unreference the blocks beyond the new size */
+    for ( i = nb; i < e.attr.n_blocks; i++ ) {
+        advfs_unref_block(advfs, inr, i);
     }
 
-    if ( 0 != fb ) {
-        advfs_free_block(advfs, fb);
-    } else if ( 0 != b ) {
-        advfs_write_raw_block(advfs, buf, b);
+    /* Release the chain blocks that are no longer used */
+    nc = advfs_chain_count(e.attr.n_blocks);
+    b = e.blocks[ADVFS_INODE_BLOCKPTR - 1];
+    for ( i = 0; i < nc; i++ ) {
+        advfs_read_raw_block(advfs, buf, b);
+        next = ((uint64_t *)buf)[ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1];
+        if ( i >= advfs_chain_count(nb) ) {
+            advfs_free_block(advfs, b);
+        }
+        b = next;
     }
 
     e.attr.n_blocks = nb;
@@ -223,8 +266,13 @@ _get_inode_in_dir(advfs_t *advfs, uint64_t inr, uint64_t nr)
 
     advfs_read_block(advfs, inr, buf, bidx);
     block = (uint64_t *)buf;
+    if ( ADVFS_DIR_TOMBSTONE == block[idx] ) {
+        return ADVFS_DIR_TOMBSTONE;
+    }
 
-    return block[idx];
+    /* The entries of a directory of a snapshot are the inodes of the
+       snapshot */
+    return ADVFS_INODE_BASE(inr) + block[idx];
 }
 
 /*
@@ -261,7 +309,7 @@ _set_inode_in_dir(advfs_t *advfs, uint64_t inr, uint64_t inode)
     advfs_read_block(advfs, inr, buf, bidx);
     block = (uint64_t *)buf;
     block[idx] = inode;
-    advfs_write_block(advfs, inr, buf, bidx);
+    advfs_write_meta_block(advfs, inr, buf, bidx);
 
     advfs_read_inode(advfs, &dir, inr);
     dir.attr.size++;
@@ -270,6 +318,237 @@ _set_inode_in_dir(advfs_t *advfs, uint64_t inr, uint64_t inode)
     return 0;
 }
 
+/*
+ * Overwrite the slot nr of the directory
+ */
+static int
+_put_inode_in_dir(advfs_t *advfs, uint64_t inr, uint64_t nr, uint64_t inode)
+{
+    uint64_t idx;
+    uint64_t *block;
+    uint64_t bidx;
+    uint8_t buf[ADVFS_BLOCK_SIZE];
+
+    /* Get the block index for the specified index nr */
+    bidx = nr / (ADVFS_BLOCK_SIZE / sizeof(uint64_t));
+    idx = nr % (ADVFS_BLOCK_SIZE / sizeof(uint64_t));
+
+    advfs_read_block(advfs, inr, buf, bidx);
+    block = (uint64_t *)buf;
+    block[idx] = inode;
+    advfs_write_meta_block(advfs, inr, buf, bidx);
+
+    return 0;
+}
+
+/*
+ * Compact the directory by squeezing out the tombstones.  Only the slots
+ * move; this must not run while the directory is being listed because the
+ * readdir offsets are slot positions.
+ */
+static int
+_compact_dir(advfs_t *advfs, uint64_t inr)
+{
+    advfs_inode_t dir;
+    uint64_t per;
+    uint64_t i;
+    uint64_t n;
+    uint64_t *src;
+    uint64_t *dst;
+    uint8_t sbuf[ADVFS_BLOCK_SIZE];
+    uint8_t dbuf[ADVFS_BLOCK_SIZE];
+
+    advfs_read_inode(advfs, &dir, inr);
+
+    per = ADVFS_BLOCK_SIZE / sizeof(uint64_t);
+    src = (uint64_t *)sbuf;
+    dst = (uint64_t *)dbuf;
+    n = 0;
+    for ( i = 0; i < dir.attr.size; i++ ) {
+        if ( 0 == i % per ) {
+            advfs_read_block(advfs, inr, sbuf, i / per);
+        }
+        if ( ADVFS_DIR_TOMBSTONE == src[i % per] ) {
+            continue;
+        }
+        /* The destination block never goes ahead of the source block */
+        if ( 0 == n % per ) {
+            memset(dbuf, 0, ADVFS_BLOCK_SIZE);
+        }
+        dst[n % per] = src[i % per];
+        n++;
+        if ( 0 == n % per ) {
+            advfs_write_meta_block(advfs, inr, dbuf, n / per - 1);
+        }
+    }
+    if ( 0 != n % per ) {
+        advfs_write_meta_block(advfs, inr, dbuf, n / per);
+    }
+
+    /* Re-read the inode since writing the blocks updates the block map */
+    advfs_read_inode(advfs, &dir, inr);
+    dir.attr.size = n;
+    dir.attr.n_dead = 0;
+    advfs_write_inode(advfs, &dir, inr);
+
+    return _resize_block(advfs, inr, (n + per - 1) / per);
+}
+
+/*
+ * Reclaim the tombstones of the directory
+ */
+static int
+_reclaim_dir(advfs_t *advfs, uint64_t inr)
+{
+    advfs_inode_t dir;
+    uint64_t per;
+
+    advfs_read_inode(advfs, &dir, inr);
+
+    /* Drop the trailing tombstones; this does not move any live slot */
+    while ( dir.attr.n_dead > 0
+            && ADVFS_DIR_TOMBSTONE
+            == _get_inode_in_dir(advfs, inr, dir.attr.size - 1) ) {
+        dir.attr.size--;
+        dir.attr.n_dead--;
+    }
+    advfs_write_inode(advfs, &dir, inr);
+
+    /* Compact when more than half of the slots are tombstones, unless the
+       directory is being listed (then it is left to releasedir). */
+    if ( dir.attr.n_dead * 2 > dir.attr.size && 0 == advfs->dir_open[inr] ) {
+        return _compact_dir(advfs, inr);
+    }
+
+    per = ADVFS_BLOCK_SIZE / sizeof(uint64_t);
+
+    return _resize_block(advfs, inr, (dir.attr.size + per - 1) / per);
+}
+
+/*
+ * Remove the slot nr from the directory
+ */
+static int
+_remove_slot(advfs_t *advfs, uint64_t inr, uint64_t nr)
+{
+    advfs_inode_t dir;
+
+    /* Leave a tombstone in the slot instead of shifting the other entries */
+    _put_inode_in_dir(advfs, inr, nr, ADVFS_DIR_TOMBSTONE);
+    advfs_read_inode(advfs, &dir, inr);
+    dir.attr.n_dead++;
+    advfs_write_inode(advfs, &dir, inr);
+
+    return _reclaim_dir(advfs, inr);
+}
+
+/*
+ * Look up the name in the directory
+ */
+static int
+_dir_lookup(advfs_t *advfs, uint64_t inr, const char *name, uint64_t *nr,
+            uint64_t *res)
+{
+    advfs_inode_t dir;
+    advfs_inode_t e;
+    uint64_t inode;
+    uint64_t i;
+
+    advfs_read_inode(advfs, &dir, inr);
+    if ( dir.attr.type != ADVFS_DIR ) {
+        return -1;
+    }
+
+    for ( i = 0; i < dir.attr.size; i++ ) {
+        inode = _get_inode_in_dir(advfs, inr, i);
+        if ( ADVFS_DIR_TOMBSTONE == inode ) {
+            continue;
+        }
+        advfs_read_inode(advfs, &e, inode);
+        if ( 0 == strcmp(name, e.name) ) {
+            /* Found */
+            *nr = i;
+            *res = inode;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Find the extent including the offset from the extent table
+ */
+static int
+_extent_lookup(advfs_t *advfs, uint64_t b, uint64_t off, advfs_extent_t *res)
+{
+    advfs_extent_block_t eb;
+    advfs_extent_t *last;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t mid;
+
+    while ( 0 != b ) {
+        advfs_read_raw_block(advfs, &eb, b);
+        last = &eb.e[eb.n - 1];
+        if ( off < last->offset + last->len ) {
+            /* Binary search for the last extent starting at or before the
+               offset */
+            lo = 0;
+            hi = eb.n - 1;
+            while ( lo < hi ) {
+                mid = (lo + hi + 1) / 2;
+                if ( eb.e[mid].offset <= off ) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            *res = eb.e[lo];
+            return 0;
+        }
+        b = eb.next;
+    }
+
+    return -1;
+}
+
+/*
+ * Release an inode and its blocks
+ */
+static int
+_release_inode(advfs_t *advfs, uint64_t inr)
+{
+    advfs_inode_t e;
+    advfs_superblock_t sb;
+    int ret;
+
+    advfs_digest_index_remove(advfs, inr);
+    advfs_compress_reset(advfs, inr);
+
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 != e.attr.extents ) {
+        advfs_free_extents(advfs, e.attr.extents);
+        e.attr.extents = 0;
+        advfs_write_inode(advfs, &e, inr);
+    }
+
+    ret = _resize_block(advfs, inr, 0);
+    if ( 0 != ret ) {
+        return -1;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.type = ADVFS_UNUSED;
+    e.attr.size = 0;
+    advfs_write_inode(advfs, &e, inr);
+
+    advfs_read_superblock(advfs, &sb);
+    sb.n_inode_used--;
+    advfs_write_superblock(advfs, &sb);
+
+    return 0;
+}
+
 /*
  * Find a free inode
  */
@@ -290,6 +569,77 @@ _find_free_inode(advfs_t *advfs, uint64_t *nr)
     return -1;
 }
 
+/*
+ * Allocate an inode linked from no directory to build a block map
+ */
+static int
+_alloc_temp_inode(advfs_t *advfs, uint64_t *nr)
+{
+    advfs_inode_t e;
+    advfs_superblock_t sb;
+    int ret;
+
+    ret = _find_free_inode(advfs, nr);
+    if ( 0 != ret ) {
+        return -1;
+    }
+    memset(&e, 0, sizeof(advfs_inode_t));
+    e.attr.type = ADVFS_REGULAR_FILE;
+    advfs_write_inode(advfs, &e, *nr);
+
+    advfs_read_superblock(advfs, &sb);
+    sb.n_inode_used++;
+    advfs_write_superblock(advfs, &sb);
+
+    return 0;
+}
+
+/*
+ * Swap the block maps of two inodes
+ */
+static void
+_swap_block_map(advfs_t *advfs, uint64_t a, uint64_t b)
+{
+    advfs_inode_t ea;
+    advfs_inode_t eb;
+    uint64_t blocks[ADVFS_INODE_BLOCKPTR];
+    uint64_t n_blocks;
+    uint64_t flags;
+
+    advfs_read_inode(advfs, &ea, a);
+    advfs_read_inode(advfs, &eb, b);
+    memcpy(blocks, ea.blocks, sizeof(blocks));
+    memcpy(ea.blocks, eb.blocks, sizeof(blocks));
+    memcpy(eb.blocks, blocks, sizeof(blocks));
+    n_blocks = ea.attr.n_blocks;
+    ea.attr.n_blocks = eb.attr.n_blocks;
+    eb.attr.n_blocks = n_blocks;
+    /* The block size class goes with the block map */
+    flags = ea.attr.flags & ADVFS_INODE_BCLASS_MASK;
+    ea.attr.flags = (ea.attr.flags & ~ADVFS_INODE_BCLASS_MASK)
+        | (eb.attr.flags & ADVFS_INODE_BCLASS_MASK);
+    eb.attr.flags = (eb.attr.flags & ~ADVFS_INODE_BCLASS_MASK) | flags;
+    advfs_write_inode(advfs, &ea, a);
+    advfs_write_inode(advfs, &eb, b);
+}
+
+/*
+ * Check if the block is all zeros
+ */
+static int
+_is_zero_block(const uint8_t *block)
+{
+    ssize_t i;
+
+    for ( i = 0; i < ADVFS_BLOCK_SIZE; i++ ) {
+        if ( 0 != block[i] ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 /*
  * Resolve the entry corresponding to the path name
  */
@@ -342,6 +692,9 @@ _path2inode_rec(advfs_t *advfs, uint64_t *res, uint64_t inr, const char *path,
     /* Resolve the entry */
     for ( i = 0; i < (ssize_t)cur.attr.size; i++ ) {
         inode = _get_inode_in_dir(advfs, inr, i);
+        if ( ADVFS_DIR_TOMBSTONE == inode ) {
+            continue;
+        }
         advfs_read_inode(advfs, &e, inode);
         if ( 0 == strcmp(name, e.name) ) {
             /* Found */
@@ -360,7 +713,7 @@ _path2inode_rec(advfs_t *advfs, uint64_t *res, uint64_t inr, const char *path,
     /* Not found */
     if ( '\0' == *path && create ) {
         /* Create */
-        if ( cur.attr.size >= ADVFS_MAX_CHILDREN ) {
+        if ( cur.attr.size - cur.attr.n_dead >= ADVFS_MAX_CHILDREN ) {
             return -1;
         }
         /* Search an unused inode */
@@ -378,6 +731,11 @@ _path2inode_rec(advfs_t *advfs, uint64_t *res, uint64_t inr, const char *path,
         advfs_read_inode(advfs, &e, inode);
         memset(&e, 0, sizeof(advfs_inode_t));
         memcpy(e.name, name, len + 1);
+        if ( cur.attr.flags & ADVFS_INODE_BCLASS_SET ) {
+            /* Block size class policy of the directory */
+            e.attr.flags = cur.attr.flags
+                & (ADVFS_INODE_BCLASS_MASK | ADVFS_INODE_BCLASS_SET);
+        }
         advfs_write_inode(advfs, &e, inode);
         *res = inode;
 
@@ -386,47 +744,197 @@ _path2inode_rec(advfs_t *advfs, uint64_t *res, uint64_t inr, const char *path,
 
     return -1;
 }
-int
-advfs_path2inode(advfs_t *advfs, uint64_t *res, const char *path, int create)
+
+/*
+ * Whether the caller is root or the owner of the mount (the user running
+ * the daemon); the operations that reach contents by their hash values or
+ * the files of the host are limited to them
+ */
+static int
+_caller_privileged(void)
 {
-    uint64_t root;
+    struct fuse_context *ctx;
 
-    root = advfs->superblock->root;
-    return _path2inode_rec(advfs, res, root, path, create);
+    ctx = fuse_get_context();
+
+    return 0 == ctx->uid || getuid() == ctx->uid;
 }
 
 /*
- * Remove an entry
+ * Parse the hash value in hex digits
  */
-int
-_remove_inode_rec(advfs_t *advfs, uint64_t inr, const char *path)
+static int
+_hex2hash(unsigned char *hash, const char *s)
 {
-    advfs_inode_t cur;
-    advfs_inode_t e;
-    advfs_inode_t e0;
-    char name[ADVFS_NAME_MAX + 1];
-    char *s;
-    size_t len;
-    ssize_t i;
-    uint64_t nb;
-    uint64_t inr2;
-    int ret;
-
-    advfs_read_inode(advfs, &cur, inr);
-    if ( cur.attr.type != ADVFS_DIR ) {
-        return -ENOENT;
-    }
-
-    /* Remove the head '/'s */
-    if ( '/' != *path ) {
-        return -ENOENT;
+    int i;
+    int j;
+    int c;
+
+    for ( i = 0; i < SHA384_DIGEST_LENGTH * 2; i++ ) {
+        c = s[i];
+        if ( c >= '0' && c <= '9' ) {
+            c -= '0';
+        } else if ( c >= 'a' && c <= 'f' ) {
+            c -= 'a' - 10;
+        } else if ( c >= 'A' && c <= 'F' ) {
+            c -= 'A' - 10;
+        } else {
+            return -1;
+        }
+        j = i / 2;
+        hash[j] = (i % 2) ? (hash[j] | c) : (c << 4);
     }
-    while ( '/' == *path ) {
-        path++;
+    if ( '\0' != s[i] ) {
+        return -1;
     }
 
-    /* Get the file/directory entry name */
-    s = index(path, '/');
+    return 0;
+}
+
+/*
+ * Resolve the name in ADVFS_BYHASH_DIR; the whole-file digest of a live file
+ * first, then the hash value of a stored block
+ */
+static int
+_byhash_path2inode(advfs_t *advfs, uint64_t *res, const char *path)
+{
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    uint64_t inr;
+    uint64_t b;
+
+    if ( _hex2hash(hash, path) < 0 ) {
+        return -1;
+    }
+    if ( 0 == advfs_digest_index_lookup(advfs, hash, &inr) ) {
+        *res = ADVFS_VINODE_FILE + inr;
+        return 0;
+    }
+    if ( !_caller_privileged() ) {
+        /* A block is readable by anyone naming its hash, regardless of the
+           files it belongs to */
+        return -1;
+    }
+    b = advfs_block_lookup(advfs, hash);
+    if ( 0 != b ) {
+        *res = ADVFS_VINODE_BLOCK + b;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Resolve the path in the control namespace; the snapshots are read-only
+ * trees under ADVFS_SNAPSHOT_DIR, and the files and blocks are looked up by
+ * the hex digits of their hash values under ADVFS_BYHASH_DIR
+ */
+static int
+_ctl_path2inode(advfs_t *advfs, uint64_t *res, const char *path, int create)
+{
+    const char *s;
+    size_t len;
+    int i;
+
+    if ( create ) {
+        return -1;
+    }
+
+    len = strlen(ADVFS_BYHASH_DIR);
+    if ( 0 == strncmp(path, ADVFS_BYHASH_DIR, len)
+         && ('\0' == path[len] || '/' == path[len]) ) {
+        path += len;
+        while ( '/' == *path ) {
+            path++;
+        }
+        if ( '\0' == *path ) {
+            *res = ADVFS_VINODE_BYHASH;
+            return 0;
+        }
+        return _byhash_path2inode(advfs, res, path);
+    }
+
+    len = strlen(ADVFS_SNAPSHOT_DIR);
+    if ( 0 != strncmp(path, ADVFS_SNAPSHOT_DIR, len)
+         || ('\0' != path[len] && '/' != path[len]) ) {
+        /* The control directory itself */
+        path += strlen(ADVFS_CTL_DIR);
+        while ( '/' == *path ) {
+            path++;
+        }
+        if ( '\0' != *path ) {
+            return -1;
+        }
+        *res = ADVFS_VINODE_CTL;
+        return 0;
+    }
+    path += len;
+    while ( '/' == *path ) {
+        path++;
+    }
+    if ( '\0' == *path ) {
+        *res = ADVFS_VINODE_SNAPSHOTS;
+        return 0;
+    }
+
+    /* Resolve the rest from the root of the snapshot */
+    s = index(path, '/');
+    len = (NULL == s) ? strlen(path) : (size_t)(s - path);
+    i = advfs_snapshot_lookup(advfs, path, len);
+    if ( i < 0 ) {
+        return -1;
+    }
+
+    return _path2inode_rec(advfs, res,
+                           ADVFS_INODE_NUM * (i + 1) + advfs->superblock->root,
+                           (NULL == s) ? "/" : s, 0);
+}
+
+int
+advfs_path2inode(advfs_t *advfs, uint64_t *res, const char *path, int create)
+{
+    uint64_t root;
+    size_t len;
+
+    len = strlen(ADVFS_CTL_DIR);
+    if ( 0 == strncmp(path, ADVFS_CTL_DIR, len)
+         && ('\0' == path[len] || '/' == path[len]) ) {
+        return _ctl_path2inode(advfs, res, path, create);
+    }
+
+    root = advfs->superblock->root;
+    return _path2inode_rec(advfs, res, root, path, create);
+}
+
+/*
+ * Remove an entry
+ */
+int
+_remove_inode_rec(advfs_t *advfs, uint64_t inr, const char *path)
+{
+    advfs_inode_t cur;
+    advfs_inode_t e;
+    char name[ADVFS_NAME_MAX + 1];
+    char *s;
+    size_t len;
+    ssize_t i;
+    uint64_t inr2;
+    int ret;
+
+    advfs_read_inode(advfs, &cur, inr);
+    if ( cur.attr.type != ADVFS_DIR ) {
+        return -ENOENT;
+    }
+
+    /* Remove the head '/'s */
+    if ( '/' != *path ) {
+        return -ENOENT;
+    }
+    while ( '/' == *path ) {
+        path++;
+    }
+
+    /* Get the file/directory entry name */
+    s = index(path, '/');
     if ( NULL == s ) {
         len = strlen(path);
     } else {
@@ -443,8 +951,12 @@ _remove_inode_rec(advfs_t *advfs, uint64_t inr, const char *path)
     path += len;
 
     /* Resolve the entry */
+    inr2 = 0;
     for ( i = 0; i < (ssize_t)cur.attr.size; i++ ) {
         inr2 = _get_inode_in_dir(advfs, inr, i);
+        if ( ADVFS_DIR_TOMBSTONE == inr2 ) {
+            continue;
+        }
         advfs_read_inode(advfs, &e, inr2);
         if ( 0 == strcmp(name, e.name) ) {
             /* Found */
@@ -463,24 +975,14 @@ _remove_inode_rec(advfs_t *advfs, uint64_t inr, const char *path)
     }
 
     /* Free the entry */
-    if ( e.attr.type == ADVFS_DIR && e.attr.size > 0 ) {
+    if ( e.attr.type == ADVFS_DIR && e.attr.size - e.attr.n_dead > 0 ) {
         return -ENOTEMPTY;
     }
-    e.attr.type = ADVFS_UNUSED;
-
-    /* Shift the child entries */
-    cur.attr.size--;
-    advfs_write_inode(advfs, &cur, inr);
-
-    for ( ; i < (ssize_t)cur.attr.size; i++ ) {
-        advfs_read_inode(advfs, &e0, _get_inode_in_dir(advfs, inr, i + 1));
-        advfs_write_inode(advfs, &e0, _get_inode_in_dir(advfs, inr, i));
+    ret = _release_inode(advfs, inr2);
+    if ( 0 != ret ) {
+        return -EFAULT;
     }
-
-    /* Resize */
-    nb = (cur.attr.size + (ADVFS_BLOCK_SIZE / sizeof(uint64_t)) - 1)
-        / (ADVFS_BLOCK_SIZE / sizeof(uint64_t));
-    ret = _resize_block(advfs, inr, nb);
+    ret = _remove_slot(advfs, inr, i);
     if ( 0 != ret ) {
         return -EFAULT;
     }
@@ -496,66 +998,95 @@ advfs_remove_inode(advfs_t *advfs, const char *path)
     return _remove_inode_rec(advfs, root, path);
 }
 
-
 /*
- * getattr
+ * Resolve the parent directory of the path, and the last component name
  */
 int
-advfs_getattr(const char *path, struct stat *stbuf)
+advfs_path2parent(advfs_t *advfs, uint64_t *res, char *name, const char *path)
 {
-    struct fuse_context *ctx;
-    advfs_t *advfs;
-    uint64_t inr;
     advfs_inode_t e;
-    int status;
+    char *s;
+    char *dir;
+    size_t len;
     int ret;
 
-    /* Reset the stat structure */
-    memset(stbuf, 0, sizeof(struct stat));
-
-    /* Get the context */
-    ctx = fuse_get_context();
-    advfs = ctx->private_data;
+    s = rindex(path, '/');
+    if ( NULL == s ) {
+        return -ENOENT;
+    }
+    len = strlen(s + 1);
+    if ( len == 0 ) {
+        return -ENOENT;
+    } else if ( len > ADVFS_NAME_MAX ) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(name, s + 1, len + 1);
 
-    ret = advfs_path2inode(advfs, &inr, path, 0);
+    /* Resolve the parent directory (including the trailing '/') */
+    dir = strndup(path, s - path + 1);
+    if ( NULL == dir ) {
+        return -ENOMEM;
+    }
+    ret = advfs_path2inode(advfs, res, dir, 0);
+    free(dir);
     if ( ret < 0 ) {
-        /* No entry found */
         return -ENOENT;
     }
-    advfs_read_inode(advfs, &e, inr);
-    if ( e.attr.type == ADVFS_DIR ) {
+    advfs_read_inode(advfs, &e, *res);
+    if ( e.attr.type != ADVFS_DIR ) {
+        return -ENOTDIR;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Fill the stat structure from the inode
+ */
+static int
+_inode2stat(struct fuse_context *ctx, const advfs_inode_t *e,
+            struct stat *stbuf)
+{
+    int status;
+
+    /* Reset the stat structure */
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if ( e->attr.type == ADVFS_DIR ) {
         /* Directory */
-        stbuf->st_mode = S_IFDIR | e.attr.mode;
-        stbuf->st_nlink = 2 + e.attr.size;
+        stbuf->st_mode = S_IFDIR | e->attr.mode;
+        stbuf->st_nlink = 2 + e->attr.size - e->attr.n_dead;
         stbuf->st_uid = ctx->uid;
         stbuf->st_gid = ctx->gid;
         status = 0;
-        stbuf->st_atime = e.attr.atime;
-        stbuf->st_mtime = e.attr.mtime;
-        stbuf->st_ctime = e.attr.ctime;
+        stbuf->st_atime = e->attr.atime;
+        stbuf->st_mtime = e->attr.mtime;
+        stbuf->st_ctime = e->attr.ctime;
 #ifdef HAVE_STRUCT_STAT_ST_BIRTHTIME
-        stbuf->st_birthtime = e.attr.ctime;
+        stbuf->st_birthtime = e->attr.ctime;
 #endif
         stbuf->st_rdev = 0;
-        stbuf->st_size = e.attr.n_blocks * ADVFS_BLOCK_SIZE;
+        stbuf->st_size = e->attr.n_blocks * ADVFS_BLOCK_SIZE;
         stbuf->st_blksize = ADVFS_BLOCK_SIZE;
-        stbuf->st_blocks = e.attr.n_blocks;
-    } else if ( e.attr.type == ADVFS_REGULAR_FILE ) {
-        stbuf->st_mode = S_IFREG | e.attr.mode;
+        stbuf->st_blocks = e->attr.n_blocks;
+    } else if ( e->attr.type == ADVFS_REGULAR_FILE ) {
+        stbuf->st_mode = S_IFREG | e->attr.mode;
         stbuf->st_nlink = 1;
         stbuf->st_uid = ctx->uid;
         stbuf->st_gid = ctx->gid;
         status = 0;
-        stbuf->st_atime = e.attr.atime;
-        stbuf->st_mtime = e.attr.mtime;
-        stbuf->st_ctime = e.attr.ctime;
+        stbuf->st_atime = e->attr.atime;
+        stbuf->st_mtime = e->attr.mtime;
+        stbuf->st_ctime = e->attr.ctime;
 #ifdef HAVE_STRUCT_STAT_ST_BIRTHTIME
-        stbuf->st_birthtime = e.attr.ctime;
+        stbuf->st_birthtime = e->attr.ctime;
 #endif
         stbuf->st_rdev = 0;
-        stbuf->st_size = e.attr.size;
-        stbuf->st_blksize = ADVFS_BLOCK_SIZE;
-        stbuf->st_blocks = e.attr.n_blocks;
+        stbuf->st_size = e->attr.size;
+        stbuf->st_blksize = ADVFS_INODE_BSIZE(e);
+        stbuf->st_blocks = e->attr.n_blocks
+            << ADVFS_BCLASS_SHIFT(ADVFS_INODE_BCLASS(e));
     } else {
         status = -ENOENT;
     }
@@ -564,127 +1095,181 @@ advfs_getattr(const char *path, struct stat *stbuf)
 }
 
 /*
- * readdir
+ * getattr
  */
+#ifdef HAVE_FUSE3
 int
-advfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-              off_t offset, struct fuse_file_info *fi)
+advfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+#else
+int
+advfs_getattr(const char *path, struct stat *stbuf)
+#endif
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
-    advfs_inode_t e;
-    advfs_inode_t e2;
-    ssize_t i;
     uint64_t inr;
-    uint64_t inr2;
+    advfs_inode_t e;
     int ret;
 
-    /* Ignore */
-    (void)offset;
-    (void)fi;
-
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
 
     ret = advfs_path2inode(advfs, &inr, path, 0);
     if ( ret < 0 ) {
+        /* No entry found */
+        memset(stbuf, 0, sizeof(struct stat));
         return -ENOENT;
     }
     advfs_read_inode(advfs, &e, inr);
-    if ( e.attr.type != ADVFS_DIR ) {
-        /* No entry found or non-directory entry */
-        return -ENOENT;
-    }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    for ( i = 0; i < (ssize_t)e.attr.size; i++ ) {
-        inr2 = _get_inode_in_dir(advfs, inr, i);
-        advfs_read_inode(advfs, &e2, inr2);
-        filler(buf, e2.name, NULL, 0);
-    }
-
-    return 0;
+    return _inode2stat(ctx, &e, stbuf);
 }
 
 /*
- * statfs
+ * opendir
  */
 int
-advfs_statfs(const char *path, struct statvfs *buf)
+advfs_opendir(const char *path, struct fuse_file_info *fi)
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
-    advfs_superblock_t *sblk;
+    advfs_inode_t e;
+    uint64_t inr;
+    int ret;
 
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
-    sblk = advfs->superblock;
-
-    memset(buf, 0, sizeof(struct statvfs));
-
-    buf->f_bsize = ADVFS_BLOCK_SIZE;
-    buf->f_frsize = ADVFS_BLOCK_SIZE;
-    buf->f_blocks = advfs->superblock->n_blocks;    /* in f_frsize unit */
-    buf->f_bfree = sblk->n_blocks - sblk->n_block_used;
-    buf->f_bavail = sblk->n_blocks - sblk->n_block_used;
 
-    buf->f_files = sblk->n_inodes;
-    buf->f_ffree = sblk->n_inodes - sblk->n_inode_used;
-    buf->f_favail = sblk->n_inodes - sblk->n_inode_used;
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( e.attr.type != ADVFS_DIR ) {
+        return -ENOTDIR;
+    }
 
-    buf->f_fsid = 0;
-    buf->f_flag = 0;
-    buf->f_namemax = ADVFS_NAME_MAX;
+    /* Hold off the compaction of the directory while it is listed */
+    fi->fh = inr;
+    if ( !ADVFS_INODE_READONLY(inr) ) {
+        advfs->dir_open[inr]++;
+    }
 
     return 0;
 }
 
 /*
- * open
+ * releasedir
  */
 int
-advfs_open(const char *path, struct fuse_file_info *fi)
+advfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
+    advfs_inode_t e;
     uint64_t inr;
-    int ret;
 
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
 
-    ret = advfs_path2inode(advfs, &inr, path, 0);
-    if ( ret < 0 ) {
-        return -ENOENT;
+    inr = fi->fh;
+    if ( ADVFS_INODE_READONLY(inr) ) {
+        return 0;
+    }
+    advfs->dir_open[inr]--;
+
+    /* Reclaim the tombstones left while the directory was listed */
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 == advfs->dir_open[inr] && e.attr.type == ADVFS_DIR
+         && e.attr.n_dead > 0 ) {
+        _reclaim_dir(advfs, inr);
     }
 
     return 0;
 }
 
 /*
- * read
+ * List the control directory, or the snapshots by the slot; ADVFS_BYHASH_DIR
+ * is not enumerable
+ */
+static int
+_readdir_ctl(struct fuse_context *ctx, advfs_t *advfs, uint64_t inr,
+             void *buf, fuse_fill_dir_t filler, off_t offset)
+{
+    advfs_snapshot_t *s;
+    advfs_inode_t e;
+    struct stat st;
+    int i;
+
+    if ( ADVFS_VINODE_CTL == inr ) {
+        if ( offset < 3 ) {
+            advfs_read_inode(advfs, &e, ADVFS_VINODE_SNAPSHOTS);
+            _inode2stat(ctx, &e, &st);
+            if ( FILLER(filler, buf, "snapshots", &st, 3) ) {
+                return 0;
+            }
+        }
+        if ( offset < 4 ) {
+            advfs_read_inode(advfs, &e, ADVFS_VINODE_BYHASH);
+            _inode2stat(ctx, &e, &st);
+            FILLER(filler, buf, "by-hash", &st, 4);
+        }
+        return 0;
+    } else if ( ADVFS_VINODE_BYHASH == inr ) {
+        return 0;
+    }
+
+    i = (offset < 2) ? 0 : offset - 2;
+    for ( ; i < ADVFS_SNAPSHOT_NUM; i++ ) {
+        s = &advfs->superblock->snapshots[i];
+        if ( 0 == s->table[0] ) {
+            continue;
+        }
+        advfs_read_inode(advfs, &e,
+                         ADVFS_INODE_NUM * (i + 1) + advfs->superblock->root);
+        _inode2stat(ctx, &e, &st);
+        if ( FILLER(filler, buf, s->name, &st, i + 3) ) {
+            /* Buffer full */
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * readdir
  */
+#ifdef HAVE_FUSE3
 int
-advfs_read(const char *path, char *buf, size_t size, off_t offset,
-           struct fuse_file_info *fi)
+advfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset, struct fuse_file_info *fi,
+              enum fuse_readdir_flags flags)
+#else
+int
+advfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset, struct fuse_file_info *fi)
+#endif
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
     advfs_inode_t e;
-    int perm;
-    uint8_t block[ADVFS_BLOCK_SIZE];
-    off_t pos;
-    ssize_t remain;
-    ssize_t i;
-    ssize_t j;
-    off_t k;
+    advfs_inode_t e2;
+    struct stat st;
+    uint64_t i;
+    uint64_t bidx;
+    uint64_t *block;
     uint64_t inr;
+    uint64_t inr2;
+    uint8_t dbuf[ADVFS_BLOCK_SIZE];
     int ret;
 
+    /* Ignore */
+    (void)fi;
+
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
@@ -694,121 +1279,3225 @@ advfs_read(const char *path, char *buf, size_t size, off_t offset,
         return -ENOENT;
     }
     advfs_read_inode(advfs, &e, inr);
-    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
+    if ( e.attr.type != ADVFS_DIR ) {
+        /* No entry found or non-directory entry */
+        return -ENOENT;
+    }
+
+    /* The offset is a cookie to resume the listing: "." and ".." are
+       followed by 1 and 2, and the entry in the slot i of the directory is
+       followed by i + 3.  Stop when the filler buffer gets full, then the
+       kernel calls again with the cookie of the last entry filled. */
+
+    /* Return the attributes of each entry along with its name since the
+       inode has to be loaded for the name anyway.  This saves a getattr
+       (and a path walk) per entry. */
+    if ( offset < 1 ) {
+        _inode2stat(ctx, &e, &st);
+        if ( FILLER(filler, buf, ".", &st, 1) ) {
+            return 0;
+        }
+    }
+    if ( offset < 2 ) {
+        if ( FILLER(filler, buf, "..", NULL, 2) ) {
+            return 0;
+        }
+    }
+    if ( inr >= ADVFS_VINODE_CTL ) {
+        return _readdir_ctl(ctx, advfs, inr, buf, filler, offset);
+    }
+    i = (offset < 2) ? 0 : offset - 2;
+    block = (uint64_t *)dbuf;
+    bidx = (uint64_t)-1;
+    for ( ; i < e.attr.size; i++ ) {
+        /* Read each block of the directory once */
+        if ( bidx != i / (ADVFS_BLOCK_SIZE / sizeof(uint64_t)) ) {
+            bidx = i / (ADVFS_BLOCK_SIZE / sizeof(uint64_t));
+            advfs_read_block(advfs, inr, dbuf, bidx);
+        }
+        inr2 = block[i % (ADVFS_BLOCK_SIZE / sizeof(uint64_t))];
+        if ( ADVFS_DIR_TOMBSTONE == inr2 ) {
+            continue;
+        }
+        advfs_read_inode(advfs, &e2, ADVFS_INODE_BASE(inr) + inr2);
+        _inode2stat(ctx, &e2, &st);
+        if ( FILLER(filler, buf, e2.name, &st, i + 3) ) {
+            /* Buffer full */
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * statfs
+ */
+int
+advfs_statfs(const char *path, struct statvfs *buf)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_superblock_t *sblk;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    sblk = advfs->superblock;
+
+    memset(buf, 0, sizeof(struct statvfs));
+
+    buf->f_bsize = ADVFS_BLOCK_SIZE;
+    buf->f_frsize = ADVFS_BLOCK_SIZE;
+    buf->f_blocks = advfs->superblock->n_blocks;    /* in f_frsize unit */
+    buf->f_bfree = sblk->n_blocks - sblk->n_block_used;
+    buf->f_bavail = sblk->n_blocks - sblk->n_block_used;
+
+    buf->f_files = sblk->n_inodes;
+    buf->f_ffree = sblk->n_inodes - sblk->n_inode_used;
+    buf->f_favail = sblk->n_inodes - sblk->n_inode_used;
+
+    buf->f_fsid = 0;
+    buf->f_flag = 0;
+    buf->f_namemax = ADVFS_NAME_MAX;
+
+    return 0;
+}
+
+/*
+ * open
+ */
+int
+advfs_open(const char *path, struct fuse_file_info *fi)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    if ( ADVFS_INODE_READONLY(inr)
+         && ((fi->flags & 3) != O_RDONLY || (fi->flags & O_TRUNC)) ) {
+        return -EROFS;
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve a regular file
+ */
+static int
+_path2file(advfs_t *advfs, uint64_t *res, const char *path)
+{
+    advfs_inode_t e;
+    int ret;
+
+    ret = advfs_path2inode(advfs, res, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    advfs_read_inode(advfs, &e, *res);
+    if ( e.attr.type == ADVFS_DIR ) {
         return -EISDIR;
+    } else if ( e.attr.type != ADVFS_REGULAR_FILE ) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+/*
+ * Read data from the chunked file; each chunk starts at a block boundary of
+ * the block map
+ */
+static ssize_t
+_read_extents(advfs_t *advfs, uint64_t inr, uint64_t head, char *buf,
+              size_t size, off_t offset)
+{
+    advfs_extent_t ext;
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint64_t in;
+    uint64_t end;
+    size_t k;
+    size_t n;
+    int ret;
+
+    k = 0;
+    while ( k < size ) {
+        ret = _extent_lookup(advfs, head, offset + k, &ext);
+        if ( 0 != ret ) {
+            return -EIO;
+        }
+        end = ext.offset + ext.len;
+        while ( k < size && offset + k < end ) {
+            in = offset + k - ext.offset;
+            advfs_read_block(advfs, inr, block,
+                             ext.pos + in / ADVFS_BLOCK_SIZE);
+            n = ADVFS_BLOCK_SIZE - in % ADVFS_BLOCK_SIZE;
+            if ( n > end - (offset + k) ) {
+                n = end - (offset + k);
+            }
+            if ( n > size - k ) {
+                n = size - k;
+            }
+            memcpy(buf + k, block + in % ADVFS_BLOCK_SIZE, n);
+            k += n;
+        }
+    }
+
+    return k;
+}
+
+/*
+ * Read data from the file
+ */
+static ssize_t
+_read_data(advfs_t *advfs, uint64_t inr, char *buf, size_t size, off_t offset)
+{
+    advfs_inode_t e;
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    off_t pos;
+    ssize_t remain;
+    ssize_t i;
+    ssize_t j;
+    off_t k;
+
+    advfs_read_inode(advfs, &e, inr);
+
+    /* Do not read beyond the end of the file */
+    if ( offset >= (off_t)e.attr.size ) {
+        return 0;
+    }
+    if ( offset + size > e.attr.size ) {
+        size = e.attr.size - offset;
+    }
+    if ( 0 != e.attr.extents ) {
+        return _read_extents(advfs, inr, e.attr.extents, buf, size, offset);
+    }
+
+    remain = size;
+    k = 0;
+    while ( remain > 0 ) {
+        pos = offset / ADVFS_BLOCK_SIZE;
+        advfs_read_block(advfs, inr, block, pos);
+        for ( i = (offset % ADVFS_BLOCK_SIZE), j = 0;
+              i < ADVFS_BLOCK_SIZE && j < remain; i++, j++, k++ ) {
+            buf[k] = block[i];
+        }
+        offset += j;
+        remain -= j;
+    }
+
+    return k;
+}
+
+/*
+ * Convert the chunked file back to the fixed-size block layout
+ */
+static int
+_unseal_file(advfs_t *advfs, uint64_t inr)
+{
+    advfs_inode_t e;
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint64_t tinr;
+    uint64_t nb;
+    uint64_t pos;
+    uint64_t head;
+    ssize_t n;
+    int ret;
+
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 == e.attr.extents ) {
+        return 0;
+    }
+
+    /* Build the fixed layout in a temporary inode */
+    ret = _alloc_temp_inode(advfs, &tinr);
+    if ( 0 != ret ) {
+        return -ENOSPC;
+    }
+    nb = (e.attr.size + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+    ret = _resize_block(advfs, tinr, nb);
+    if ( 0 != ret ) {
+        _release_inode(advfs, tinr);
+        return -ENOSPC;
+    }
+    for ( pos = 0; pos < nb; pos++ ) {
+        n = _read_data(advfs, inr, (char *)block, ADVFS_BLOCK_SIZE,
+                       pos * ADVFS_BLOCK_SIZE);
+        if ( n < 0 ) {
+            _release_inode(advfs, tinr);
+            return n;
+        }
+        memset(block + n, 0, ADVFS_BLOCK_SIZE - n);
+        if ( _is_zero_block(block) ) {
+            continue;
+        }
+        ret = advfs_write_block(advfs, tinr, block, pos, pos == nb - 1);
+        if ( 0 != ret ) {
+            _release_inode(advfs, tinr);
+            return -ENOSPC;
+        }
+    }
+
+    /* Replace the block map; the chunks are released with the temporary
+       inode.  The content, hence the digest, is unchanged. */
+    _swap_block_map(advfs, inr, tinr);
+    advfs_read_inode(advfs, &e, inr);
+    head = e.attr.extents;
+    e.attr.extents = 0;
+    advfs_write_inode(advfs, &e, inr);
+    advfs_free_extents(advfs, head);
+    _release_inode(advfs, tinr);
+
+    return 0;
+}
+
+/*
+ * Split the file into content-defined chunks.  Each chunk is stored from a
+ * block boundary so that the same chunks at different offsets of files share
+ * the physical blocks through the deduplication; the last block of a chunk
+ * is tail-packed.
+ */
+static int
+_seal_file(advfs_t *advfs, uint64_t inr)
+{
+    advfs_inode_t e;
+    advfs_extent_block_t eb;
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint8_t *win;
+    uint64_t tinr;
+    uint64_t off;
+    uint64_t nb;
+    uint64_t cap;
+    uint64_t head;
+    uint64_t cur;
+    uint64_t b;
+    uint64_t i;
+    uint64_t pieces;
+    size_t have;
+    size_t len;
+    size_t n;
+    ssize_t ret;
+
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 != e.attr.extents || e.attr.size <= ADVFS_CDC_MIN
+         || 0 != ADVFS_INODE_BCLASS(&e) ) {
+        return 0;
+    }
+
+    /* Calculate the digest before the layout changes */
+    advfs_file_digest(advfs, inr, digest);
+
+    win = malloc(2 * ADVFS_CDC_MAX);
+    if ( NULL == win ) {
+        return -ENOMEM;
+    }
+    ret = _alloc_temp_inode(advfs, &tinr);
+    if ( 0 != ret ) {
+        free(win);
+        return -ENOSPC;
+    }
+
+    head = 0;
+    cur = 0;
+    nb = 0;
+    cap = 0;
+    off = 0;
+    have = 0;
+    ret = 0;
+    while ( off < e.attr.size ) {
+        /* Fill the window to find the cut point */
+        ret = _read_data(advfs, inr, (char *)win + have,
+                         2 * ADVFS_CDC_MAX - have, off + have);
+        if ( ret < 0 ) {
+            break;
+        }
+        have += ret;
+        ret = 0;
+        len = advfs_cdc_cut(win, have);
+
+        /* Append the extent */
+        if ( 0 == cur || ADVFS_EXTENT_PER_BLOCK == eb.n ) {
+            b = advfs_alloc_meta_block(advfs);
+            if ( 0 == b ) {
+                ret = -ENOSPC;
+                break;
+            }
+            if ( 0 == cur ) {
+                head = b;
+            } else {
+                eb.next = b;
+                advfs_write_raw_block(advfs, &eb, cur);
+            }
+            cur = b;
+            memset(&eb, 0, sizeof(advfs_extent_block_t));
+        }
+        eb.e[eb.n].offset = off;
+        eb.e[eb.n].pos = nb;
+        eb.e[eb.n].len = len;
+        eb.n++;
+
+        /* Store the chunk; the block map grows geometrically */
+        pieces = (len + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+        if ( nb + pieces > cap ) {
+            cap = (2 * cap > nb + pieces) ? 2 * cap : nb + pieces;
+            if ( 0 != _resize_block(advfs, tinr, cap) ) {
+                ret = -ENOSPC;
+                break;
+            }
+        }
+        for ( i = 0; i < pieces; i++ ) {
+            n = len - i * ADVFS_BLOCK_SIZE;
+            if ( n > ADVFS_BLOCK_SIZE ) {
+                n = ADVFS_BLOCK_SIZE;
+            }
+            memset(block, 0, ADVFS_BLOCK_SIZE);
+            memcpy(block, win + i * ADVFS_BLOCK_SIZE, n);
+            if ( _is_zero_block(block) ) {
+                continue;
+            }
+            if ( 0 != advfs_write_block(advfs, tinr, block, nb + i,
+                                        i == pieces - 1) ) {
+                ret = -ENOSPC;
+                break;
+            }
+        }
+        if ( ret < 0 ) {
+            break;
+        }
+        nb += pieces;
+
+        memmove(win, win + len, have - len);
+        have -= len;
+        off += len;
+    }
+    if ( 0 != cur ) {
+        advfs_write_raw_block(advfs, &eb, cur);
+    }
+    free(win);
+    if ( 0 == ret && 0 != _resize_block(advfs, tinr, nb) ) {
+        ret = -ENOSPC;
+    }
+    if ( ret < 0 ) {
+        advfs_free_extents(advfs, head);
+        _release_inode(advfs, tinr);
+        return ret;
+    }
+
+    /* Replace the block map; the fixed-size blocks are released with the
+       temporary inode */
+    _swap_block_map(advfs, inr, tinr);
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.extents = head;
+    advfs_write_inode(advfs, &e, inr);
+    _release_inode(advfs, tinr);
+
+    return 0;
+}
+
+/*
+ * Read a block of the block size class of the file
+ */
+static void
+_read_file_block(advfs_t *advfs, uint64_t inr, uint8_t *block, uint64_t pos,
+                 size_t bsz)
+{
+    uint64_t i;
+    uint64_t n;
+
+    n = bsz / ADVFS_BLOCK_SIZE;
+    for ( i = 0; i < n; i++ ) {
+        advfs_read_block(advfs, inr, block + i * ADVFS_BLOCK_SIZE, pos * n + i);
+    }
+}
+
+/*
+ * Take the extent table of the chunked file for a change; a table shared
+ * with clones is copied first
+ */
+static int
+_own_extents(advfs_t *advfs, uint64_t inr)
+{
+    advfs_inode_t e;
+    advfs_block_mgt_t mgt;
+    advfs_extent_block_t eb;
+    advfs_extent_block_t cb;
+    uint64_t head;
+    uint64_t prev;
+    uint64_t b;
+    uint64_t nb;
+
+    advfs_read_inode(advfs, &e, inr);
+    advfs_read_block_mgt(advfs, &mgt, e.attr.extents);
+    if ( 1 == mgt.ref ) {
+        return 0;
+    }
+
+    memset(&cb, 0, sizeof(advfs_extent_block_t));
+    head = 0;
+    prev = 0;
+    for ( b = e.attr.extents; 0 != b; b = eb.next ) {
+        advfs_read_raw_block(advfs, &eb, b);
+        nb = advfs_alloc_meta_block(advfs);
+        if ( 0 == nb ) {
+            if ( 0 != prev ) {
+                cb.next = 0;
+                advfs_write_raw_block(advfs, &cb, prev);
+            }
+            advfs_free_extents(advfs, head);
+            return -ENOSPC;
+        }
+        if ( 0 == prev ) {
+            head = nb;
+        } else {
+            cb.next = nb;
+            advfs_write_raw_block(advfs, &cb, prev);
+        }
+        memcpy(&cb, &eb, sizeof(advfs_extent_block_t));
+        prev = nb;
+    }
+    cb.next = 0;
+    advfs_write_raw_block(advfs, &cb, prev);
+
+    /* Drop the reference to the shared table */
+    advfs_free_extents(advfs, e.attr.extents);
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.extents = head;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * Append the extents to the table of the chunked file; the blocks of the
+ * table are allocated first so that it is not left half-appended
+ */
+static int
+_append_extents(advfs_t *advfs, uint64_t inr, const advfs_extent_t *x,
+                uint64_t n)
+{
+    advfs_inode_t e;
+    advfs_extent_block_t eb;
+    uint64_t *nbs;
+    uint64_t need;
+    uint64_t cur;
+    uint64_t i;
+    uint64_t j;
+    int ret;
+
+    ret = _own_extents(advfs, inr);
+    if ( 0 != ret ) {
+        return ret;
+    }
+    advfs_read_inode(advfs, &e, inr);
+
+    /* The last block of the table */
+    cur = e.attr.extents;
+    advfs_read_raw_block(advfs, &eb, cur);
+    while ( 0 != eb.next ) {
+        cur = eb.next;
+        advfs_read_raw_block(advfs, &eb, cur);
+    }
+
+    need = 0;
+    if ( n > ADVFS_EXTENT_PER_BLOCK - eb.n ) {
+        need = (n - (ADVFS_EXTENT_PER_BLOCK - eb.n)
+                + ADVFS_EXTENT_PER_BLOCK - 1) / ADVFS_EXTENT_PER_BLOCK;
+    }
+    nbs = malloc((need + 1) * sizeof(uint64_t));
+    if ( NULL == nbs ) {
+        return -ENOMEM;
+    }
+    for ( j = 0; j < need; j++ ) {
+        nbs[j] = advfs_alloc_meta_block(advfs);
+        if ( 0 == nbs[j] ) {
+            while ( j > 0 ) {
+                advfs_release_block(advfs, nbs[--j]);
+            }
+            free(nbs);
+            return -ENOSPC;
+        }
+    }
+
+    j = 0;
+    for ( i = 0; i < n; i++ ) {
+        if ( ADVFS_EXTENT_PER_BLOCK == eb.n ) {
+            eb.next = nbs[j];
+            advfs_write_raw_block(advfs, &eb, cur);
+            cur = nbs[j++];
+            memset(&eb, 0, sizeof(advfs_extent_block_t));
+        }
+        eb.e[eb.n++] = x[i];
+    }
+    advfs_write_raw_block(advfs, &eb, cur);
+    free(nbs);
+
+    return 0;
+}
+
+/*
+ * Append the bytes (zeros if buf is NULL) to the chunked file.  The data is
+ * split into content-defined chunks and the zeros are holes, stored from
+ * the end of the block map so that the blocks of the extents stay in the
+ * order of the offsets.
+ */
+static int
+_extents_append(advfs_t *advfs, uint64_t inr, const char *buf, size_t size)
+{
+    advfs_inode_t e;
+    advfs_extent_t *x;
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint64_t onb;
+    uint64_t nb;
+    uint64_t pieces;
+    uint64_t i;
+    uint64_t n;
+    size_t len;
+    size_t k;
+    size_t m;
+    int ret;
+
+    advfs_read_inode(advfs, &e, inr);
+    onb = e.attr.n_blocks;
+
+    /* The chunks but the last are at least of the minimum size */
+    n = (NULL != buf) ? size / ADVFS_CDC_MIN + 1
+        : size / ADVFS_EXTENT_LEN_MAX + 1;
+    x = malloc(n * sizeof(advfs_extent_t));
+    if ( NULL == x ) {
+        return -ENOMEM;
+    }
+
+    n = 0;
+    nb = onb;
+    ret = 0;
+    for ( k = 0; k < size; k += len ) {
+        if ( NULL != buf ) {
+            len = advfs_cdc_cut((const uint8_t *)buf + k, size - k);
+        } else {
+            len = size - k;
+            if ( len > ADVFS_EXTENT_LEN_MAX ) {
+                len = ADVFS_EXTENT_LEN_MAX;
+            }
+        }
+        pieces = (len + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+        if ( 0 != _resize_block(advfs, inr, nb + pieces) ) {
+            ret = -ENOSPC;
+            break;
+        }
+        for ( i = 0; NULL != buf && i < pieces; i++ ) {
+            m = len - i * ADVFS_BLOCK_SIZE;
+            if ( m > ADVFS_BLOCK_SIZE ) {
+                m = ADVFS_BLOCK_SIZE;
+            }
+            memset(block, 0, ADVFS_BLOCK_SIZE);
+            memcpy(block, buf + k + i * ADVFS_BLOCK_SIZE, m);
+            if ( _is_zero_block(block) ) {
+                continue;
+            }
+            if ( 0 != advfs_write_block(advfs, inr, block, nb + i,
+                                        i == pieces - 1) ) {
+                ret = -ENOSPC;
+                break;
+            }
+        }
+        if ( ret < 0 ) {
+            break;
+        }
+        x[n].offset = e.attr.size + k;
+        x[n].pos = nb;
+        x[n].len = len;
+        n++;
+        nb += pieces;
+    }
+    if ( 0 == ret ) {
+        ret = _append_extents(advfs, inr, x, n);
+    }
+    free(x);
+    if ( 0 != ret ) {
+        _resize_block(advfs, inr, onb);
+        return ret;
+    }
+
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.size += size;
+    e.attr.flags &= ~ADVFS_INODE_DIGEST;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * Write the bytes (zeros if buf is NULL) over the chunked file within its
+ * size.  The blocks of the extents are rewritten in place, so neither the
+ * extent table nor the other chunks change; the blocks that become zeros
+ * are punched.
+ */
+static int
+_extents_rewrite(advfs_t *advfs, uint64_t inr, const char *buf, size_t size,
+                 off_t offset)
+{
+    advfs_inode_t e;
+    advfs_extent_t ext;
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint64_t end;
+    uint64_t in;
+    uint64_t pos;
+    size_t blen;
+    size_t k;
+    size_t n;
+    int ret;
+
+    advfs_read_inode(advfs, &e, inr);
+    k = 0;
+    while ( k < size ) {
+        ret = _extent_lookup(advfs, e.attr.extents, offset + k, &ext);
+        if ( 0 != ret ) {
+            return -EIO;
+        }
+        end = ext.offset + ext.len;
+        while ( k < size && offset + k < end ) {
+            in = offset + k - ext.offset;
+            pos = ext.pos + in / ADVFS_BLOCK_SIZE;
+            /* The bytes of the block within the extent; the rest is never
+               read, and cleared */
+            blen = ext.len - (in - in % ADVFS_BLOCK_SIZE);
+            if ( blen > ADVFS_BLOCK_SIZE ) {
+                blen = ADVFS_BLOCK_SIZE;
+            }
+            n = blen - in % ADVFS_BLOCK_SIZE;
+            if ( n > size - k ) {
+                n = size - k;
+            }
+            if ( n == blen ) {
+                memset(block, 0, ADVFS_BLOCK_SIZE);
+            } else {
+                advfs_read_block(advfs, inr, block, pos);
+                memset(block + blen, 0, ADVFS_BLOCK_SIZE - blen);
+            }
+            if ( NULL != buf ) {
+                memcpy(block + in % ADVFS_BLOCK_SIZE, buf + k, n);
+            } else {
+                memset(block + in % ADVFS_BLOCK_SIZE, 0, n);
+            }
+            if ( _is_zero_block(block) ) {
+                ret = advfs_punch_block(advfs, inr, pos);
+            } else {
+                ret = advfs_write_block(advfs, inr, block, pos,
+                                        in / ADVFS_BLOCK_SIZE
+                                        == (ext.len - 1) / ADVFS_BLOCK_SIZE);
+            }
+            if ( 0 != ret ) {
+                return -ENOSPC;
+            }
+            k += n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Shrink the chunked file to a non-zero size.  The extents beyond the size
+ * are removed and the one including the end is cut; the block map ends with
+ * it as the blocks of the extents are in the order of the offsets.
+ */
+static int
+_extents_truncate(advfs_t *advfs, uint64_t inr, uint64_t size)
+{
+    advfs_inode_t e;
+    advfs_extent_block_t eb;
+    uint64_t cur;
+    uint64_t next;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t mid;
+    uint64_t nb;
+    int ret;
+
+    ret = _own_extents(advfs, inr);
+    if ( 0 != ret ) {
+        return ret;
+    }
+    advfs_read_inode(advfs, &e, inr);
+
+    /* Find the last extent starting before the size */
+    cur = e.attr.extents;
+    advfs_read_raw_block(advfs, &eb, cur);
+    while ( size > eb.e[eb.n - 1].offset + eb.e[eb.n - 1].len
+            && 0 != eb.next ) {
+        cur = eb.next;
+        advfs_read_raw_block(advfs, &eb, cur);
+    }
+    lo = 0;
+    hi = eb.n - 1;
+    while ( lo < hi ) {
+        mid = (lo + hi + 1) / 2;
+        if ( eb.e[mid].offset < size ) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    eb.e[lo].len = size - eb.e[lo].offset;
+    nb = eb.e[lo].pos
+        + (eb.e[lo].len + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+    eb.n = lo + 1;
+    next = eb.next;
+    eb.next = 0;
+    advfs_write_raw_block(advfs, &eb, cur);
+
+    /* Release the rest of the table and the blocks */
+    advfs_free_extents(advfs, next);
+    ret = _resize_block(advfs, inr, nb);
+    if ( 0 != ret ) {
+        return -ENOSPC;
+    }
+
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.size = size;
+    e.attr.flags &= ~ADVFS_INODE_DIGEST;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * Write data to the chunked file; in place within the size, and appended
+ * beyond it
+ */
+static int
+_write_extents(advfs_t *advfs, uint64_t inr, const char *buf, size_t size,
+               off_t offset)
+{
+    advfs_inode_t e;
+    size_t n;
+    int ret;
+
+    advfs_read_inode(advfs, &e, inr);
+    n = 0;
+    ret = 0;
+    if ( (uint64_t)offset < e.attr.size ) {
+        n = e.attr.size - offset;
+        if ( n > size ) {
+            n = size;
+        }
+        ret = _extents_rewrite(advfs, inr, buf, n, offset);
+    } else if ( (uint64_t)offset > e.attr.size ) {
+        /* The gap beyond the end is a hole */
+        ret = _extents_append(advfs, inr, NULL, offset - e.attr.size);
+    }
+    if ( 0 != ret ) {
+        return ret;
+    }
+    if ( n < size ) {
+        return _extents_append(advfs, inr, buf + n, size - n);
+    }
+
+    return 0;
+}
+
+/*
+ * Write data to the file
+ */
+static ssize_t
+_write_data(advfs_t *advfs, uint64_t inr, const char *buf, size_t size,
+            off_t offset)
+{
+    advfs_inode_t e;
+    size_t nsize;
+    size_t bsz;
+    uint64_t nb;
+    int ret;
+    size_t in;
+    size_t n;
+    size_t k;
+    off_t pos;
+    uint8_t *block;
+    int ingest;
+
+    if ( size <= 0 ) {
+        return 0;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 != e.attr.extents ) {
+        ret = _write_extents(advfs, inr, buf, size, offset);
+        return ( 0 != ret ) ? ret : (ssize_t)size;
+    }
+
+    /* Extend the block region if the write goes beyond the last block */
+    bsz = ADVFS_INODE_BSIZE(&e);
+    nsize = offset + size;
+    nb = (nsize + bsz - 1) / bsz;
+    if ( nb > e.attr.n_blocks ) {
+        ret = _resize_block(advfs, inr, nb);
+        if ( 0 != ret ) {
+            return -ENOSPC;
+        }
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( nsize > e.attr.size ) {
+        e.attr.size = nsize;
+        e.attr.flags &= ~ADVFS_INODE_DIGEST;
+    }
+    /* Write back */
+    advfs_write_inode(advfs, &e, inr);
+    ingest = e.attr.flags & ADVFS_INODE_INGEST;
+
+    block = malloc(bsz);
+    if ( NULL == block ) {
+        return -ENOMEM;
+    }
+
+    k = 0;
+    while ( k < size ) {
+        pos = (offset + k) / bsz;
+        in = (offset + k) % bsz;
+        n = bsz - in;
+        if ( n > size - k ) {
+            n = size - k;
+        }
+        if ( ingest && n == bsz ) {
+            /* Skip the hashing if the block in place has the same content */
+            _read_file_block(advfs, inr, block, pos, bsz);
+            if ( 0 == memcmp(block, buf + k, bsz) ) {
+                k += n;
+                continue;
+            }
+            ingest = 0;
+        }
+        if ( n != bsz ) {
+            /* Partial block write needs the current content */
+            _read_file_block(advfs, inr, block, pos, bsz);
+        }
+        memcpy(block + in, buf + k, n);
+        ret = advfs_write_block(advfs, inr, block, pos,
+                                (pos + 1) * bsz >= e.attr.size);
+        if ( 0 != ret ) {
+            free(block);
+            return -ENOSPC;
+        }
+        k += n;
+    }
+    free(block);
+
+    return size;
+}
+
+/*
+ * Change the size of the file
+ */
+static int
+_truncate_data(advfs_t *advfs, uint64_t inr, off_t size)
+{
+    advfs_inode_t e;
+    uint8_t *block;
+    uint64_t nb;
+    size_t bsz;
+    off_t off;
+    int ret;
+
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 != e.attr.extents ) {
+        if ( (off_t)e.attr.size > size && size > 0 ) {
+            return _extents_truncate(advfs, inr, size);
+        } else if ( (off_t)e.attr.size < size ) {
+            return _extents_append(advfs, inr, NULL, size - e.attr.size);
+        } else if ( 0 != size ) {
+            return 0;
+        }
+        /* The chunks are released below */
+        advfs_free_extents(advfs, e.attr.extents);
+        e.attr.extents = 0;
+        advfs_write_inode(advfs, &e, inr);
+    }
+
+    /* Clear the bytes beyond the (old or new) end in the last block so that
+       they read as zeros when the file is extended */
+    bsz = ADVFS_INODE_BSIZE(&e);
+    off = ((off_t)e.attr.size < size) ? (off_t)e.attr.size : size;
+    if ( 0 != off % bsz && (uint64_t)off / bsz < e.attr.n_blocks ) {
+        block = malloc(bsz);
+        if ( NULL == block ) {
+            return -ENOMEM;
+        }
+        _read_file_block(advfs, inr, block, off / bsz, bsz);
+        memset(block + off % bsz, 0, bsz - off % bsz);
+        ret = advfs_write_block(advfs, inr, block, off / bsz,
+                                off == size);
+        free(block);
+        if ( 0 != ret ) {
+            return -ENOSPC;
+        }
+    }
+
+    /* Calculate the number of blocks; the blocks added are holes */
+    nb = (size + bsz - 1) / bsz;
+    ret = _resize_block(advfs, inr, nb);
+    if ( 0 != ret ) {
+        return -ENOSPC;
+    }
+
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.size = size;
+    e.attr.flags &= ~ADVFS_INODE_DIGEST;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * Block size class of the size heuristic; the largest class of which the
+ * file has enough blocks
+ */
+static int
+_size_bclass(uint64_t size)
+{
+    int c;
+
+    for ( c = ADVFS_BCLASS_NUM - 1; c > 0; c-- ) {
+        if ( size >= ADVFS_BCLASS_MIN_BLOCKS * ADVFS_BCLASS_SIZE(c) ) {
+            break;
+        }
+    }
+
+    return c;
+}
+
+/*
+ * Pick the block size class of an empty file by the expected size unless
+ * chosen by a hint or a directory policy
+ */
+static void
+_auto_bclass(advfs_t *advfs, uint64_t inr, uint64_t size)
+{
+    advfs_inode_t e;
+
+    advfs_read_inode(advfs, &e, inr);
+    if ( (e.attr.flags & ADVFS_INODE_BCLASS_SET) || 0 != e.attr.n_blocks ) {
+        return;
+    }
+    e.attr.flags = (e.attr.flags & ~ADVFS_INODE_BCLASS_MASK)
+        | ((uint64_t)_size_bclass(size) << ADVFS_INODE_BCLASS_SHIFT);
+    advfs_write_inode(advfs, &e, inr);
+}
+
+/*
+ * Convert the file to the block size class c
+ */
+static int
+_convert_file(advfs_t *advfs, uint64_t inr, int c)
+{
+    advfs_inode_t e;
+    uint8_t *block;
+    uint64_t tinr;
+    uint64_t off;
+    size_t bsz;
+    ssize_t n;
+    int ret;
+
+    advfs_read_inode(advfs, &e, inr);
+    if ( c == (int)ADVFS_INODE_BCLASS(&e) ) {
+        return 0;
+    }
+    ret = _unseal_file(advfs, inr);
+    if ( 0 != ret ) {
+        return ret;
+    }
+
+    /* Build the block map of the class in a temporary inode */
+    bsz = ADVFS_BCLASS_SIZE(c);
+    block = malloc(bsz);
+    if ( NULL == block ) {
+        return -ENOMEM;
+    }
+    ret = _alloc_temp_inode(advfs, &tinr);
+    if ( 0 != ret ) {
+        free(block);
+        return -ENOSPC;
+    }
+    advfs_read_inode(advfs, &e, tinr);
+    e.attr.flags |= (uint64_t)c << ADVFS_INODE_BCLASS_SHIFT;
+    advfs_write_inode(advfs, &e, tinr);
+
+    advfs_read_inode(advfs, &e, inr);
+    for ( off = 0; off < e.attr.size; off += bsz ) {
+        n = _read_data(advfs, inr, (char *)block, bsz, off);
+        if ( n < 0 ) {
+            ret = n;
+            break;
+        }
+        if ( 0 == block[0] && 0 == memcmp(block, block + 1, n - 1) ) {
+            /* Keep the hole */
+            continue;
+        }
+        n = _write_data(advfs, tinr, (char *)block, n, off);
+        if ( n < 0 ) {
+            ret = n;
+            break;
+        }
+    }
+    free(block);
+    if ( 0 == ret ) {
+        ret = _truncate_data(advfs, tinr, e.attr.size);
+    }
+    if ( 0 != ret ) {
+        _release_inode(advfs, tinr);
+        return ret;
+    }
+
+    /* Replace the block map; the content, hence the digest, is unchanged */
+    _swap_block_map(advfs, inr, tinr);
+    _release_inode(advfs, tinr);
+
+    return 0;
+}
+
+/*
+ * Zero a range of the block region; the whole blocks become holes
+ */
+static int
+_zero_range(advfs_t *advfs, uint64_t inr, off_t offset, off_t len)
+{
+    advfs_inode_t e;
+    uint8_t *block;
+    uint64_t pos;
+    size_t bsz;
+    off_t end;
+    off_t n;
+    int ret;
+
+    /* Only the blocks in the block region */
+    advfs_read_inode(advfs, &e, inr);
+    bsz = ADVFS_INODE_BSIZE(&e);
+    end = offset + len;
+    if ( end > (off_t)(e.attr.n_blocks * bsz) ) {
+        end = e.attr.n_blocks * bsz;
+    }
+
+    while ( offset < end ) {
+        pos = offset / bsz;
+        n = bsz - offset % bsz;
+        if ( n > end - offset ) {
+            n = end - offset;
+        }
+        if ( n == (off_t)bsz ) {
+            /* Whole block */
+            advfs_punch_block(advfs, inr, pos);
+        } else if ( 0 != advfs_resolve_block(advfs, inr, pos) ) {
+            /* Partial block */
+            block = malloc(bsz);
+            if ( NULL == block ) {
+                return -ENOMEM;
+            }
+            _read_file_block(advfs, inr, block, pos, bsz);
+            memset(block + offset % bsz, 0, n);
+            ret = advfs_write_block(advfs, inr, block, pos,
+                                    (pos + 1) * bsz >= e.attr.size);
+            free(block);
+            if ( 0 != ret ) {
+                return -ENOSPC;
+            }
+        }
+        offset += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Clone a range of the source file to the destination file.  Where the
+ * source and destination offsets are equally aligned, the whole blocks share
+ * the physical blocks of the source by reference counting; only the
+ * unaligned head and tail are copied.
+ */
+static ssize_t
+_clone_range(advfs_t *advfs, uint64_t dinr, off_t doff, uint64_t sinr,
+             off_t soff, size_t len)
+{
+    advfs_inode_t src;
+    advfs_inode_t dst;
+    uint8_t buf[ADVFS_BLOCK_SIZE];
+    uint8_t *cbuf;
+    uint64_t nb;
+    uint64_t i;
+    size_t bsz;
+    size_t done;
+    size_t n;
+    ssize_t ret;
+
+    advfs_read_inode(advfs, &src, sinr);
+    advfs_read_inode(advfs, &dst, dinr);
+
+    /* The blocks of a chunked file are not in the file offsets, and the
+       blocks of the larger classes are not shared by ranges */
+    done = 0;
+    if ( 0 == src.attr.extents && 0 == dst.attr.extents
+         && 0 == ADVFS_INODE_BCLASS(&src) && 0 == ADVFS_INODE_BCLASS(&dst)
+         && soff % ADVFS_BLOCK_SIZE == doff % ADVFS_BLOCK_SIZE ) {
+        /* Copy the head up to the block boundary */
+        n = (ADVFS_BLOCK_SIZE - soff % ADVFS_BLOCK_SIZE) % ADVFS_BLOCK_SIZE;
+        if ( n > len ) {
+            n = len;
+        }
+        if ( n > 0 ) {
+            ret = _read_data(advfs, sinr, (char *)buf, n, soff);
+            if ( ret >= 0 ) {
+                ret = _write_data(advfs, dinr, (char *)buf, ret, doff);
+            }
+            if ( ret < 0 ) {
+                return ret;
+            }
+            done += n;
+        }
+
+        /* Share the whole blocks.  The last partial block can be shared as
+           well if it is the end of both files. */
+        n = (len - done) / ADVFS_BLOCK_SIZE;
+        if ( 0 != (len - done) % ADVFS_BLOCK_SIZE
+             && soff + len == src.attr.size && doff + len >= dst.attr.size ) {
+            n++;
+        }
+        if ( n > 0 ) {
+            nb = (doff + done) / ADVFS_BLOCK_SIZE + n;
+            advfs_read_inode(advfs, &dst, dinr);
+            if ( nb > dst.attr.n_blocks ) {
+                ret = _resize_block(advfs, dinr, nb);
+                if ( 0 != ret ) {
+                    return -ENOSPC;
+                }
+            }
+            for ( i = 0; i < n; i++ ) {
+                ret = advfs_clone_block(advfs,
+                                        dinr, (doff + done) / ADVFS_BLOCK_SIZE
+                                        + i,
+                                        sinr, (soff + done) / ADVFS_BLOCK_SIZE
+                                        + i);
+                if ( 0 != ret ) {
+                    return -EIO;
+                }
+            }
+            done += (n * ADVFS_BLOCK_SIZE < len - done)
+                ? n * ADVFS_BLOCK_SIZE : len - done;
+
+            /* Update the size (the block map has been updated) */
+            advfs_read_inode(advfs, &dst, dinr);
+            if ( (off_t)dst.attr.size < doff + (off_t)done ) {
+                dst.attr.size = doff + done;
+                dst.attr.flags &= ~ADVFS_INODE_DIGEST;
+                advfs_write_inode(advfs, &dst, dinr);
+            }
+        }
+    }
+
+    /* Copy the rest by the blocks of the destination */
+    bsz = ADVFS_INODE_BSIZE(&dst);
+    cbuf = buf;
+    if ( bsz > sizeof(buf) ) {
+        cbuf = malloc(bsz);
+        if ( NULL == cbuf ) {
+            return -ENOMEM;
+        }
+    }
+    ret = 0;
+    while ( done < len ) {
+        n = len - done;
+        if ( n > bsz ) {
+            n = bsz;
+        }
+        ret = _read_data(advfs, sinr, (char *)cbuf, n, soff + done);
+        if ( ret >= 0 ) {
+            ret = _write_data(advfs, dinr, (char *)cbuf, ret, doff + done);
+        }
+        if ( ret < 0 ) {
+            break;
+        }
+        done += n;
+    }
+    if ( cbuf != buf ) {
+        free(cbuf);
+    }
+
+    return ( ret < 0 ) ? ret : (ssize_t)done;
+}
+
+/*
+ * read
+ */
+int
+advfs_read(const char *path, char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    int perm;
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
+        return -EISDIR;
+    }
+
+    /* Mode check (the writeback cache also reads through write-only
+       files to fill partially written pages) */
+    perm = fi->flags & 3;
+    if ( !advfs->writeback && perm != O_RDONLY && perm != O_RDWR ) {
+        return -EACCES;
+    }
+
+    return _read_data(advfs, inr, buf, size, offset);
+}
+
+/*
+ * write
+ */
+int
+advfs_write(const char *path, const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    int perm;
+    int ret;
+    uint64_t inr;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
+        return -EISDIR;
+    }
+
+    /* Mode check */
+    perm = fi->flags & 3;
+    if ( perm != O_WRONLY && perm != O_RDWR ) {
+        return -EACCES;
+    }
+
+    return _write_data(advfs, inr, buf, size, offset);
+}
+
+/*
+ * truncate
+ */
+#ifdef HAVE_FUSE3
+int
+advfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+#else
+int
+advfs_truncate(const char *path, off_t size)
+#endif
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    if ( ADVFS_INODE_READONLY(inr) ) {
+        return -EROFS;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
+        return -EISDIR;
+    }
+
+    return _truncate_data(advfs, inr, size);
+}
+
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_FALLOCATE
+/*
+ * fallocate
+ */
+int
+advfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                struct fuse_file_info *fi)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    uint64_t inr;
+    uint64_t nb;
+    size_t bsz;
+    off_t end;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    if ( mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE
+                  | FALLOC_FL_ZERO_RANGE) ) {
+        return -EOPNOTSUPP;
+    }
+    if ( (mode & FALLOC_FL_PUNCH_HOLE)
+         && (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)) ) {
+        return -EOPNOTSUPP;
+    }
+    if ( offset < 0 || length <= 0 ) {
+        return -EINVAL;
+    }
+
+    ret = _path2file(advfs, &inr, path);
+    if ( ret < 0 ) {
+        return ret;
+    }
+    if ( ADVFS_INODE_READONLY(inr) ) {
+        return -EROFS;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    end = offset + length;
+
+    if ( 0 != e.attr.extents ) {
+        /* The chunked file has no preallocation; the range is cleared in
+           place, and the extension is a hole */
+        if ( (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+             && offset < (off_t)e.attr.size ) {
+            ret = _extents_rewrite(advfs, inr, NULL,
+                                   ((end < (off_t)e.attr.size)
+                                    ? end : (off_t)e.attr.size) - offset,
+                                   offset);
+            if ( ret < 0 ) {
+                return ret;
+            }
+        }
+        if ( !(mode & FALLOC_FL_KEEP_SIZE) && end > (off_t)e.attr.size ) {
+            return _extents_append(advfs, inr, NULL, end - e.attr.size);
+        }
+        return 0;
+    }
+
+    if ( mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE) ) {
+        /* Unreference the blocks in the range (within the file) */
+        if ( offset < (off_t)e.attr.size ) {
+            ret = _zero_range(advfs, inr, offset,
+                              ((end < (off_t)e.attr.size)
+                               ? end : (off_t)e.attr.size) - offset);
+            if ( ret < 0 ) {
+                return ret;
+            }
+        }
+        if ( mode & FALLOC_FL_PUNCH_HOLE ) {
+            return 0;
+        }
+    }
+
+    /* The size of an empty file is known in advance */
+    if ( 0 == e.attr.size && 0 == e.attr.n_blocks ) {
+        _auto_bclass(advfs, inr, end);
+        advfs_read_inode(advfs, &e, inr);
+    }
+
+    /* Allocate the block map; the new blocks are holes, and the identical
+       zero blocks would be deduplicated to one block anyway */
+    bsz = ADVFS_INODE_BSIZE(&e);
+    nb = (end + bsz - 1) / bsz;
+    if ( nb > e.attr.n_blocks ) {
+        ret = _resize_block(advfs, inr, nb);
+        if ( 0 != ret ) {
+            return -ENOSPC;
+        }
+    }
+
+    advfs_read_inode(advfs, &e, inr);
+    if ( !(mode & FALLOC_FL_KEEP_SIZE) && end > (off_t)e.attr.size ) {
+        /* Clear the bytes beyond the old end */
+        ret = _zero_range(advfs, inr, e.attr.size, end - e.attr.size);
+        if ( ret < 0 ) {
+            return ret;
+        }
+        advfs_read_inode(advfs, &e, inr);
+        e.attr.size = end;
+        e.attr.flags &= ~ADVFS_INODE_DIGEST;
+        advfs_write_inode(advfs, &e, inr);
+    }
+
+    return 0;
+}
+#endif
+
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+/*
+ * lseek (SEEK_DATA and SEEK_HOLE; the kernel handles the others)
+ */
+off_t
+advfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    uint64_t inr;
+    uint64_t pos;
+    uint64_t nb;
+    uint64_t b;
+    size_t bsz;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+
+    if ( whence != SEEK_DATA && whence != SEEK_HOLE ) {
+        return -EINVAL;
+    }
+
+    ret = _path2file(advfs, &inr, path);
+    if ( ret < 0 ) {
+        return ret;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( off < 0 || off >= (off_t)e.attr.size ) {
+        return -ENXIO;
+    }
+    if ( 0 != e.attr.extents ) {
+        /* A chunked file has no holes */
+        return (whence == SEEK_DATA) ? off : (off_t)e.attr.size;
+    }
+
+    /* Walk the block map from the block including the offset */
+    bsz = ADVFS_INODE_BSIZE(&e);
+    nb = (e.attr.size + bsz - 1) / bsz;
+    if ( nb > e.attr.n_blocks ) {
+        nb = e.attr.n_blocks;
+    }
+    for ( pos = off / bsz; pos < nb; pos++ ) {
+        b = advfs_resolve_block(advfs, inr, pos);
+        if ( (whence == SEEK_DATA) == (b != 0) ) {
+            break;
+        }
+    }
+
+    if ( pos >= nb ) {
+        /* There is an implicit hole at the end of the file */
+        return (whence == SEEK_DATA) ? -ENXIO : (off_t)e.attr.size;
+    }
+    if ( (off_t)(pos * bsz) > off ) {
+        off = pos * bsz;
+    }
+
+    return off;
+}
+#endif
+
+/*
+ * utimens
+ */
+#ifdef HAVE_FUSE3
+int
+advfs_utimens(const char *path, const struct timespec tv[2],
+              struct fuse_file_info *fi)
+#else
+int
+advfs_utimens(const char *path, const struct timespec tv[2])
+#endif
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        /* No entry found or non-directory entry */
+        return -ENOENT;
+    }
+    if ( ADVFS_INODE_READONLY(inr) ) {
+        return -EROFS;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( NULL != tv ) {
+        e.attr.atime = tv[0].tv_sec;
+        e.attr.mtime = tv[1].tv_sec;
+    }
+
+    /* Write back */
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * create
+ */
+int
+advfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    struct timeval tv;
+    char name[ADVFS_NAME_MAX + 1];
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    gettimeofday(&tv, NULL);
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret == 0 ) {
+        /* Already exists */
+        return -EEXIST;
+    }
+    ret = advfs_path2parent(advfs, &inr, name, path);
+    if ( 0 == ret && ADVFS_INODE_READONLY(inr) ) {
+        return -EROFS;
+    }
+
+    ret = advfs_path2inode(advfs, &inr, path, 1);
+    if ( ret < 0 ) {
+        /* No entry found or non-directory entry */
+        return -EACCES;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.type = ADVFS_REGULAR_FILE;
+    e.attr.mode = mode;
+    e.attr.atime = tv.tv_sec;
+    e.attr.mtime = tv.tv_sec;
+    e.attr.ctime = tv.tv_sec;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * mkdir
+ */
+int
+advfs_mkdir(const char *path, mode_t mode)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    struct timeval tv;
+    char name[ADVFS_NAME_MAX + 1];
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    gettimeofday(&tv, NULL);
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret == 0 ) {
+        /* Already exists */
+        return -EEXIST;
+    }
+
+    /* A directory made in the snapshot directory takes a snapshot */
+    ret = advfs_path2parent(advfs, &inr, name, path);
+    if ( 0 == ret && ADVFS_VINODE_SNAPSHOTS == inr ) {
+        return advfs_snapshot_create(advfs, name);
+    } else if ( 0 == ret && ADVFS_INODE_READONLY(inr) ) {
+        return -EROFS;
+    }
+
+    ret = advfs_path2inode(advfs, &inr, path, 1);
+    if ( ret < 0 ) {
+        /* No entry found or non-directory entry */
+        return -EACCES;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.type = ADVFS_DIR;
+    e.attr.mode = mode;
+    e.attr.atime = tv.tv_sec;
+    e.attr.mtime = tv.tv_sec;
+    e.attr.ctime = tv.tv_sec;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * rmdir
+ */
+int
+advfs_rmdir(const char *path)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    char name[ADVFS_NAME_MAX + 1];
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( e.attr.type != ADVFS_DIR ) {
+        return -ENOTDIR;
+    }
+    if ( ADVFS_INODE_READONLY(inr) ) {
+        /* Removing the root of a snapshot deletes the snapshot */
+        ret = advfs_path2parent(advfs, &inr, name, path);
+        if ( 0 == ret && ADVFS_VINODE_SNAPSHOTS == inr ) {
+            return advfs_snapshot_delete(advfs, name);
+        }
+        return -EROFS;
+    }
+
+    return advfs_remove_inode(advfs, path);
+}
+
+/*
+ * unlink
+ */
+int
+advfs_unlink(const char *path)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    uint64_t inr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    ret = advfs_path2inode(advfs, &inr, path, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    if ( ADVFS_INODE_READONLY(inr) ) {
+        return -EROFS;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
+        return -ENOENT;
+    }
+
+    return advfs_remove_inode(advfs, path);
+}
+
+/*
+ * Whether the path a is a proper ancestor of the path b
+ */
+static int
+_path_is_ancestor(const char *a, const char *b)
+{
+    size_t len;
+
+    len = strlen(a);
+
+    return 0 == strncmp(a, b, len) && '/' == b[len];
+}
+
+/*
+ * rename; only the directory slots and the name in the inode change, the
+ * blocks of the file are not touched.
+ */
+#ifdef HAVE_FUSE3
+int
+advfs_rename(const char *from, const char *to, unsigned int flags)
+#else
+int
+advfs_rename(const char *from, const char *to)
+#endif
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t e;
+    advfs_inode_t e2;
+    advfs_inode_t dir;
+    char sname[ADVFS_NAME_MAX + 1];
+    char dname[ADVFS_NAME_MAX + 1];
+    struct timeval tv;
+    uint64_t sdir;
+    uint64_t ddir;
+    uint64_t snr;
+    uint64_t dnr;
+    uint64_t inr;
+    uint64_t inr2;
+    int inplace;
+    int ret;
+#ifndef HAVE_FUSE3
+    unsigned int flags = 0;
+#endif
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    if ( flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE) ) {
+        return -EINVAL;
+    }
+
+    gettimeofday(&tv, NULL);
+
+    /* Resolve the source entry */
+    ret = advfs_path2parent(advfs, &sdir, sname, from);
+    if ( ret < 0 ) {
+        return ret;
+    }
+    ret = _dir_lookup(advfs, sdir, sname, &snr, &inr);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    advfs_read_inode(advfs, &e, inr);
+
+    /* Resolve the destination directory */
+    ret = advfs_path2parent(advfs, &ddir, dname, to);
+    if ( ret < 0 ) {
+        return ret;
+    }
+    if ( ADVFS_INODE_READONLY(sdir) || ADVFS_INODE_READONLY(ddir)
+         || (ddir == advfs->superblock->root
+             && 0 == strcmp(dname, ADVFS_CTL_DIR + 1)) ) {
+        return -EROFS;
+    }
+
+    /* A directory cannot be moved into itself, nor exchanged with one of
+       its ancestors */
+    if ( e.attr.type == ADVFS_DIR && _path_is_ancestor(from, to) ) {
+        return -EINVAL;
+    }
+    if ( (flags & RENAME_EXCHANGE) && _path_is_ancestor(to, from) ) {
+        return -EINVAL;
+    }
+
+    inplace = 0;
+    ret = _dir_lookup(advfs, ddir, dname, &dnr, &inr2);
+    if ( 0 == ret ) {
+        /* The destination exists */
+        if ( inr == inr2 ) {
+            return 0;
+        }
+        if ( flags & RENAME_NOREPLACE ) {
+            return -EEXIST;
+        }
+        advfs_read_inode(advfs, &e2, inr2);
+
+        if ( flags & RENAME_EXCHANGE ) {
+            /* Swap the slots and the names */
+            _put_inode_in_dir(advfs, ddir, dnr, inr);
+            _put_inode_in_dir(advfs, sdir, snr, inr2);
+            memcpy(e.name, dname, sizeof(e.name));
+            memcpy(e2.name, sname, sizeof(e2.name));
+            e.attr.ctime = tv.tv_sec;
+            e2.attr.ctime = tv.tv_sec;
+            advfs_write_inode(advfs, &e, inr);
+            advfs_write_inode(advfs, &e2, inr2);
+            return 0;
+        }
+
+        if ( e.attr.type == ADVFS_DIR && e2.attr.type != ADVFS_DIR ) {
+            return -ENOTDIR;
+        } else if ( e.attr.type != ADVFS_DIR && e2.attr.type == ADVFS_DIR ) {
+            return -EISDIR;
+        } else if ( e2.attr.type == ADVFS_DIR
+                    && e2.attr.size - e2.attr.n_dead > 0 ) {
+            return -ENOTEMPTY;
+        }
+
+        /* Replace the destination slot in one step, then release the
+           replaced inode */
+        _put_inode_in_dir(advfs, ddir, dnr, inr);
+        ret = _release_inode(advfs, inr2);
+        if ( 0 != ret ) {
+            return -EFAULT;
+        }
+    } else {
+        if ( flags & RENAME_EXCHANGE ) {
+            return -ENOENT;
+        }
+        if ( sdir == ddir ) {
+            /* Only the name changes */
+            inplace = 1;
+        } else {
+            /* Link the inode to the destination directory */
+            advfs_read_inode(advfs, &dir, ddir);
+            if ( dir.attr.size - dir.attr.n_dead >= ADVFS_MAX_CHILDREN ) {
+                return -ENOSPC;
+            }
+            ret = _set_inode_in_dir(advfs, ddir, inr);
+            if ( 0 != ret ) {
+                return -ENOSPC;
+            }
+        }
+    }
+
+    /* Unlink from the source directory unless renamed in place */
+    if ( !inplace ) {
+        ret = _remove_slot(advfs, sdir, snr);
+        if ( 0 != ret ) {
+            return -EFAULT;
+        }
+    }
+
+    /* Rename */
+    advfs_read_inode(advfs, &e, inr);
+    memcpy(e.name, dname, sizeof(e.name));
+    e.attr.ctime = tv.tv_sec;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+/*
+ * copy_file_range; shares the blocks with the source where possible
+ */
+ssize_t
+advfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                      off_t offset_in, const char *path_out,
+                      struct fuse_file_info *fi_out, off_t offset_out,
+                      size_t size, int flags)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    advfs_inode_t src;
+    uint64_t sinr;
+    uint64_t dinr;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    if ( 0 != flags ) {
+        return -EINVAL;
+    }
+    ret = _path2file(advfs, &sinr, path_in);
+    if ( ret < 0 ) {
+        return ret;
+    }
+    ret = _path2file(advfs, &dinr, path_out);
+    if ( ret < 0 ) {
+        return ret;
+    }
+
+    /* Do not copy beyond the end of the source file */
+    advfs_read_inode(advfs, &src, sinr);
+    if ( offset_in >= (off_t)src.attr.size ) {
+        return 0;
+    }
+    if ( offset_in + size > src.attr.size ) {
+        size = src.attr.size - offset_in;
+    }
+
+    /* Overlapping ranges in the same file */
+    if ( sinr == dinr && offset_in < offset_out + (off_t)size
+         && offset_out < offset_in + (off_t)size ) {
+        return -EINVAL;
+    }
+
+    return _clone_range(advfs, dinr, offset_out, sinr, offset_in, size);
+}
+#endif
+
+/*
+ * ADVFS_IOC_CLONE_RANGE
+ */
+static int
+_ioctl_clone_range(advfs_t *advfs, uint64_t dinr,
+                   struct advfs_ioc_clone_range *args)
+{
+    advfs_inode_t src;
+    uint64_t sinr;
+    uint64_t len;
+    ssize_t ret;
+
+    args->src[ADVFS_IOC_PATH_MAX - 1] = '\0';
+    ret = _path2file(advfs, &sinr, args->src);
+    if ( ret < 0 ) {
+        return ret;
+    }
+    advfs_read_inode(advfs, &src, sinr);
+
+    if ( 0 == args->src_length && 0 == args->src_offset
+         && 0 == args->dest_offset ) {
+        /* Whole file clone */
+        if ( sinr == dinr ) {
+            return 0;
+        }
+        ret = _truncate_data(advfs, dinr, 0);
+        if ( ret < 0 ) {
+            return ret;
+        }
+        ret = _clone_range(advfs, dinr, 0, sinr, 0, src.attr.size);
+
+        return ret < 0 ? ret : 0;
+    }
+
+    if ( args->src_offset > src.attr.size ) {
+        return -EINVAL;
+    }
+    len = args->src_length;
+    if ( 0 == len || args->src_offset + len > src.attr.size ) {
+        len = src.attr.size - args->src_offset;
+    }
+    if ( sinr == dinr && args->src_offset < args->dest_offset + len
+         && args->dest_offset < args->src_offset + len ) {
+        return -EINVAL;
+    }
+    ret = _clone_range(advfs, dinr, args->dest_offset, sinr, args->src_offset,
+                       len);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * ADVFS_IOC_DEDUPE_RANGE
+ */
+static int
+_ioctl_dedupe_range(advfs_t *advfs, uint64_t dinr,
+                    struct advfs_ioc_dedupe_range *args)
+{
+    advfs_inode_t src;
+    advfs_inode_t dst;
+    uint8_t sblock[ADVFS_BLOCK_SIZE];
+    uint8_t dblock[ADVFS_BLOCK_SIZE];
+    uint64_t sinr;
+    uint64_t len;
+    uint64_t nb;
+    uint64_t i;
+    size_t n;
+    int ret;
+
+    args->src[ADVFS_IOC_PATH_MAX - 1] = '\0';
+    args->bytes_deduped = 0;
+    args->status = ADVFS_DEDUPE_RANGE_SAME;
+    ret = _path2file(advfs, &sinr, args->src);
+    if ( ret < 0 ) {
+        return ret;
+    }
+    if ( ADVFS_INODE_READONLY(sinr) ) {
+        /* The source is remapped as well */
+        return -EROFS;
+    }
+    advfs_read_inode(advfs, &src, sinr);
+    if ( 0 != src.attr.extents ) {
+        /* The blocks of a chunked source are not in the file offsets */
+        return -EINVAL;
+    }
+    ret = _unseal_file(advfs, dinr);
+    if ( 0 != ret ) {
+        return ret;
+    }
+    advfs_read_inode(advfs, &dst, dinr);
+
+    /* Ranges are deduplicated by 4 KiB blocks */
+    if ( 0 != ADVFS_INODE_BCLASS(&src) || 0 != ADVFS_INODE_BCLASS(&dst) ) {
+        return -EINVAL;
+    }
+    if ( 0 != args->src_offset % ADVFS_BLOCK_SIZE
+         || 0 != args->dest_offset % ADVFS_BLOCK_SIZE ) {
+        return -EINVAL;
+    }
+    if ( args->src_offset > src.attr.size
+         || args->dest_offset > dst.attr.size ) {
+        return -EINVAL;
+    }
+
+    /* Clamp the range to the both files; a partial block is allowed only at
+       the end of the both files */
+    len = args->src_length;
+    if ( args->src_offset + len > src.attr.size ) {
+        len = src.attr.size - args->src_offset;
+    }
+    if ( args->dest_offset + len > dst.attr.size ) {
+        len = dst.attr.size - args->dest_offset;
+    }
+    if ( 0 != len % ADVFS_BLOCK_SIZE
+         && (args->src_offset + len != src.attr.size
+             || args->dest_offset + len != dst.attr.size) ) {
+        len -= len % ADVFS_BLOCK_SIZE;
+    }
+    if ( sinr == dinr && args->src_offset < args->dest_offset + len
+         && args->dest_offset < args->src_offset + len ) {
+        return -EINVAL;
+    }
+    nb = (len + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+
+    /* Compare the whole range first */
+    for ( i = 0; i < nb; i++ ) {
+        n = len - i * ADVFS_BLOCK_SIZE;
+        if ( n > ADVFS_BLOCK_SIZE ) {
+            n = ADVFS_BLOCK_SIZE;
+        }
+        advfs_read_block(advfs, sinr, sblock,
+                         args->src_offset / ADVFS_BLOCK_SIZE + i);
+        advfs_read_block(advfs, dinr, dblock,
+                         args->dest_offset / ADVFS_BLOCK_SIZE + i);
+        if ( 0 != memcmp(sblock, dblock, n) ) {
+            args->status = ADVFS_DEDUPE_RANGE_DIFFERS;
+            return 0;
+        }
+    }
+
+    /* Point the destination at the blocks of the source */
+    for ( i = 0; i < nb; i++ ) {
+        ret = advfs_clone_block(advfs,
+                                dinr, args->dest_offset / ADVFS_BLOCK_SIZE + i,
+                                sinr, args->src_offset / ADVFS_BLOCK_SIZE + i);
+        if ( 0 != ret ) {
+            return -EIO;
+        }
+    }
+    args->bytes_deduped = len;
+
+    return 0;
+}
+
+/*
+ * Make the file a duplicate of the file sinr with the same content by sharing
+ * the whole block map
+ */
+static int
+_dedup_file(advfs_t *advfs, uint64_t inr, uint64_t sinr)
+{
+    advfs_inode_t src;
+    advfs_inode_t e;
+    uint64_t nb;
+    uint64_t pos;
+    advfs_block_mgt_t mgt;
+    int ret;
+
+    advfs_read_inode(advfs, &src, sinr);
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 != e.attr.extents ) {
+        /* The content is replaced */
+        advfs_free_extents(advfs, e.attr.extents);
+        e.attr.extents = 0;
+        advfs_write_inode(advfs, &e, inr);
+    }
+    if ( ADVFS_INODE_BCLASS(&e) != ADVFS_INODE_BCLASS(&src) ) {
+        /* Take the block size class of the source */
+        ret = _resize_block(advfs, inr, 0);
+        if ( 0 != ret ) {
+            return -ENOSPC;
+        }
+        advfs_read_inode(advfs, &e, inr);
+        e.attr.flags = (e.attr.flags & ~ADVFS_INODE_BCLASS_MASK)
+            | (src.attr.flags & ADVFS_INODE_BCLASS_MASK);
+        advfs_write_inode(advfs, &e, inr);
+    }
+
+    /* A chunked source shares its whole block map and extent table */
+    if ( 0 != src.attr.extents ) {
+        nb = src.attr.n_blocks;
+    } else {
+        nb = (src.attr.size + ADVFS_INODE_BSIZE(&src) - 1)
+            / ADVFS_INODE_BSIZE(&src);
+    }
+    ret = _resize_block(advfs, inr, nb);
+    if ( 0 != ret ) {
+        return -ENOSPC;
+    }
+    for ( pos = 0; pos < nb; pos++ ) {
+        ret = advfs_clone_block(advfs, inr, pos, sinr, pos);
+        if ( 0 != ret ) {
+            return -EIO;
+        }
+    }
+
+    if ( 0 != src.attr.extents ) {
+        advfs_read_block_mgt(advfs, &mgt, src.attr.extents);
+        mgt.ref++;
+        advfs_write_block_mgt(advfs, &mgt, src.attr.extents);
+    }
+
+    /* The same size and digest */
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.size = src.attr.size;
+    e.attr.extents = src.attr.extents;
+    e.attr.flags &= ~ADVFS_INODE_DIGEST;
+    e.attr.flags |= src.attr.flags & ADVFS_INODE_DIGEST;
+    memcpy(e.attr.digest, src.attr.digest, sizeof(e.attr.digest));
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * ADVFS_IOC_INGEST
+ */
+static int
+_ioctl_ingest(advfs_t *advfs, uint64_t inr, struct advfs_ioc_ingest *args)
+{
+    advfs_inode_t e;
+    uint64_t sinr;
+    int ret;
+
+    /* The digest alone is no proof that the caller has the content */
+    if ( !_caller_privileged() ) {
+        return -EPERM;
+    }
+
+    args->found = 0;
+    ret = advfs_digest_index_lookup(advfs, args->digest, &sinr);
+    if ( ret < 0 ) {
+        return 0;
+    }
+    args->found = 1;
+
+    if ( sinr != inr ) {
+        ret = _dedup_file(advfs, inr, sinr);
+        if ( ret < 0 ) {
+            return ret;
+        }
+    }
+    advfs_read_inode(advfs, &e, inr);
+    e.attr.flags |= ADVFS_INODE_INGEST;
+    advfs_write_inode(advfs, &e, inr);
+
+    return 0;
+}
+
+/*
+ * ADVFS_IOC_INGEST_BLOCKS
+ */
+static int
+_ioctl_ingest_blocks(advfs_t *advfs, uint64_t inr,
+                     struct advfs_ioc_ingest_blocks *args)
+{
+    advfs_inode_t e;
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint64_t pos;
+    uint64_t tail;
+    uint32_t m;
+    uint32_t i;
+    int ret;
+
+    if ( !_caller_privileged() ) {
+        return -EPERM;
+    }
+    if ( args->n > ADVFS_INGEST_BLOCKS_MAX ) {
+        return -EINVAL;
+    }
+    ret = _unseal_file(advfs, inr);
+    if ( 0 != ret ) {
+        return ret;
+    }
+    advfs_read_inode(advfs, &e, inr);
+    if ( 0 != ADVFS_INODE_BCLASS(&e) ) {
+        return -EINVAL;
+    }
+    for ( i = 0; i < args->n; i++ ) {
+        if ( 0 != args->blocks[i].offset % ADVFS_BLOCK_SIZE
+             || args->blocks[i].offset >= e.attr.size ) {
+            return -EINVAL;
+        }
+    }
+
+    /* Bytes beyond the end in the last block must be zeros */
+    tail = e.attr.size % ADVFS_BLOCK_SIZE;
+
+    m = 0;
+    for ( i = 0; i < args->n; i++ ) {
+        pos = args->blocks[i].offset / ADVFS_BLOCK_SIZE;
+        ret = advfs_map_block(advfs, inr, args->blocks[i].hash, pos);
+        if ( 0 == ret && 0 != tail
+             && pos == e.attr.size / ADVFS_BLOCK_SIZE ) {
+            advfs_read_block(advfs, inr, block, pos);
+            memset(block, 0, tail);
+            if ( !_is_zero_block(block) ) {
+                advfs_punch_block(advfs, inr, pos);
+                ret = -1;
+            }
+        }
+        if ( 0 != ret ) {
+            /* Missing */
+            args->blocks[m++] = args->blocks[i];
+        }
+    }
+    args->n_missing = m;
+
+    return 0;
+}
+
+/*
+ * Count the inodes and the blocks to clone the directory tree
+ */
+static void
+_clone_tree_count(advfs_t *advfs, uint64_t sinr, uint64_t *ni, uint64_t *nb)
+{
+    advfs_inode_t dir;
+    advfs_inode_t e;
+    uint64_t inr;
+    uint64_t n;
+    uint64_t i;
+
+    advfs_read_inode(advfs, &dir, sinr);
+    for ( i = 0; i < dir.attr.size; i++ ) {
+        inr = _get_inode_in_dir(advfs, sinr, i);
+        if ( ADVFS_DIR_TOMBSTONE == inr ) {
+            continue;
+        }
+        advfs_read_inode(advfs, &e, inr);
+        (*ni)++;
+        if ( e.attr.type == ADVFS_DIR ) {
+            /* The entries are written to new blocks without the
+               tombstones */
+            n = (e.attr.size - e.attr.n_dead + ADVFS_BLOCK_SIZE
+                 / sizeof(uint64_t) - 1) / (ADVFS_BLOCK_SIZE / sizeof(uint64_t));
+            *nb += n + advfs_chain_count(n);
+            _clone_tree_count(advfs, inr, ni, nb);
+        } else {
+            *nb += advfs_chain_count(e.attr.n_blocks);
+        }
+    }
+}
+
+/*
+ * Clone the entries of the directory sinr into the directory dinr
+ */
+static int
+_clone_tree(advfs_t *advfs, uint64_t dinr, uint64_t sinr)
+{
+    advfs_inode_t dir;
+    advfs_inode_t e;
+    advfs_superblock_t sb;
+    uint64_t inr;
+    uint64_t nr;
+    uint64_t i;
+    int ret;
+
+    advfs_read_inode(advfs, &dir, sinr);
+    for ( i = 0; i < dir.attr.size; i++ ) {
+        inr = _get_inode_in_dir(advfs, sinr, i);
+        if ( ADVFS_DIR_TOMBSTONE == inr ) {
+            continue;
+        }
+        ret = _find_free_inode(advfs, &nr);
+        if ( 0 != ret ) {
+            return -ENOSPC;
+        }
+        advfs_read_inode(advfs, &e, inr);
+        if ( e.attr.type == ADVFS_DIR ) {
+            /* Rebuild the entries with the new inodes */
+            e.attr.size = 0;
+            e.attr.n_blocks = 0;
+            e.attr.n_dead = 0;
+            memset(e.blocks, 0, sizeof(e.blocks));
+        } else {
+            e.attr.flags &= ~ADVFS_INODE_INGEST;
+            ret = advfs_share_block_map(advfs, &e);
+            if ( 0 != ret ) {
+                return -ENOSPC;
+            }
+        }
+        advfs_write_inode(advfs, &e, nr);
+        advfs_read_superblock(advfs, &sb);
+        sb.n_inode_used++;
+        advfs_write_superblock(advfs, &sb);
+
+        ret = _set_inode_in_dir(advfs, dinr, nr);
+        if ( 0 != ret ) {
+            return -ENOSPC;
+        }
+        if ( e.attr.type == ADVFS_DIR ) {
+            ret = _clone_tree(advfs, nr, inr);
+            if ( 0 != ret ) {
+                return ret;
+            }
+        } else if ( e.attr.flags & ADVFS_INODE_DIGEST ) {
+            /* The digest is known without reading the content */
+            advfs_digest_index_add(advfs, nr);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * ADVFS_IOC_CLONE_TREE
+ */
+static int
+_ioctl_clone_tree(advfs_t *advfs, uint64_t dinr, const char *path,
+                  struct advfs_ioc_clone_tree *args)
+{
+    advfs_inode_t src;
+    advfs_inode_t dst;
+    advfs_inode_t e;
+    advfs_superblock_t sb;
+    uint64_t sinr;
+    uint64_t ni;
+    uint64_t nb;
+    uint64_t nfree;
+    size_t len;
+    ssize_t i;
+    int ret;
+
+    args->src[ADVFS_IOC_PATH_MAX - 1] = '\0';
+    ret = advfs_path2inode(advfs, &sinr, args->src, 0);
+    if ( ret < 0 ) {
+        return -ENOENT;
+    }
+    advfs_read_inode(advfs, &src, sinr);
+    advfs_read_inode(advfs, &dst, dinr);
+    if ( src.attr.type != ADVFS_DIR || dst.attr.type != ADVFS_DIR ) {
+        return -ENOTDIR;
+    }
+    if ( ADVFS_INODE_READONLY(dinr) ) {
+        return -EROFS;
+    }
+    if ( dst.attr.size - dst.attr.n_dead > 0 ) {
+        return -ENOTEMPTY;
+    }
+
+    /* The destination must not be in the source tree */
+    len = strlen(args->src);
+    while ( len > 0 && '/' == args->src[len - 1] ) {
+        len--;
+    }
+    if ( sinr == dinr
+         || (0 == strncmp(path, args->src, len) && '/' == path[len]) ) {
+        return -EINVAL;
+    }
+
+    /* Check the space not to fail halfway */
+    ni = 0;
+    nb = 0;
+    _clone_tree_count(advfs, sinr, &ni, &nb);
+    nfree = 0;
+    for ( i = 0; i < ADVFS_NUM_ENTRIES; i++ ) {
+        advfs_read_inode(advfs, &e, i);
+        if ( e.attr.type == ADVFS_UNUSED ) {
+            nfree++;
+        }
+    }
+    advfs_read_superblock(advfs, &sb);
+    if ( ni > nfree || sb.n_block_used + nb > sb.n_blocks ) {
+        return -ENOSPC;
+    }
+
+    return _clone_tree(advfs, dinr, sinr);
+}
+
+/*
+ * List of the blocks in a replication stream
+ */
+struct _stream_block {
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    uint64_t inr;
+    uint64_t pos;
+};
+struct _stream_blocks {
+    struct _stream_block *a;
+    size_t n;
+    size_t max;
+};
+
+static int
+_stream_blocks_add(struct _stream_blocks *l, const unsigned char *hash,
+                   uint64_t inr, uint64_t pos)
+{
+    struct _stream_block *a;
+    size_t max;
+
+    if ( l->n == l->max ) {
+        max = l->max ? l->max * 2 : 1024;
+        a = realloc(l->a, sizeof(struct _stream_block) * max);
+        if ( NULL == a ) {
+            return -ENOMEM;
+        }
+        l->a = a;
+        l->max = max;
+    }
+    memcpy(l->a[l->n].hash, hash, SHA384_DIGEST_LENGTH);
+    l->a[l->n].inr = inr;
+    l->a[l->n].pos = pos;
+    l->n++;
+
+    return 0;
+}
+
+static int
+_stream_block_cmp(const void *a, const void *b)
+{
+    return memcmp(((const struct _stream_block *)a)->hash,
+                  ((const struct _stream_block *)b)->hash,
+                  SHA384_DIGEST_LENGTH);
+}
+
+/*
+ * Sort the list by the hash value, and find the first entry of the hash
+ */
+static void
+_stream_blocks_sort(struct _stream_blocks *l)
+{
+    qsort(l->a, l->n, sizeof(struct _stream_block), _stream_block_cmp);
+}
+static ssize_t
+_stream_blocks_find(struct _stream_blocks *l, const unsigned char *hash)
+{
+    size_t lo;
+    size_t hi;
+    size_t mid;
+
+    lo = 0;
+    hi = l->n;
+    while ( lo < hi ) {
+        mid = (lo + hi) / 2;
+        if ( memcmp(l->a[mid].hash, hash, SHA384_DIGEST_LENGTH) < 0 ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ( lo < l->n
+         && 0 == memcmp(l->a[lo].hash, hash, SHA384_DIGEST_LENGTH) ) {
+        return lo;
+    }
+
+    return -1;
+}
+
+/*
+ * Write or read the whole buffer
+ */
+static int
+_stream_write(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = write(fd, buf, len);
+        if ( n < 0 && EINTR == errno ) {
+            continue;
+        } else if ( n <= 0 ) {
+            return -EIO;
+        }
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+static int
+_stream_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = read(fd, buf, len);
+        if ( n < 0 && EINTR == errno ) {
+            continue;
+        } else if ( n <= 0 ) {
+            return -EIO;
+        }
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Read a 4 KiB block of the file (zero-padded)
+ */
+static void
+_read_leaf(advfs_t *advfs, uint64_t inr, uint64_t pos, uint8_t *block)
+{
+    ssize_t n;
+
+    n = _read_data(advfs, inr, (char *)block, ADVFS_BLOCK_SIZE,
+                   pos * ADVFS_BLOCK_SIZE);
+    if ( n < 0 ) {
+        n = 0;
+    }
+    memset(block + n, 0, ADVFS_BLOCK_SIZE - n);
+}
+
+/*
+ * Check if the fingerprint is zero (a hole or the end of a list)
+ */
+static int
+_is_zero_hash(const unsigned char *hash)
+{
+    int i;
+
+    for ( i = 0; i < SHA384_DIGEST_LENGTH; i++ ) {
+        if ( 0 != hash[i] ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Fingerprint of a 4 KiB block of the file; the hash value stored in the
+ * block management is used as is for a file of 4 KiB blocks
+ */
+static void
+_leaf_hash(advfs_t *advfs, uint64_t inr, const advfs_inode_t *e, uint64_t pos,
+           unsigned char *hash)
+{
+    advfs_block_mgt_t mgt;
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint64_t b;
+
+    if ( 0 == e->attr.extents && 0 == ADVFS_INODE_BCLASS(e) ) {
+        b = advfs_resolve_block(advfs, inr, pos);
+        if ( 0 == b ) {
+            memset(hash, 0, SHA384_DIGEST_LENGTH);
+        } else {
+            advfs_read_block_mgt(advfs, &mgt, b);
+            memcpy(hash, mgt.hash, SHA384_DIGEST_LENGTH);
+        }
+        return;
+    }
+
+    _read_leaf(advfs, inr, pos, block);
+    if ( _is_zero_block(block) ) {
+        memset(hash, 0, SHA384_DIGEST_LENGTH);
+    } else {
+        SHA384(block, ADVFS_BLOCK_SIZE, hash);
+    }
+}
+
+/*
+ * Write the entries of the directory and the fingerprints of the files
+ */
+static int
+_send_tree(advfs_t *advfs, int fd, uint64_t sinr, uint64_t parent,
+           uint64_t *idx, struct _stream_blocks *l)
+{
+    struct advfs_send_entry ent;
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    advfs_inode_t dir;
+    advfs_inode_t e;
+    uint64_t inr;
+    uint64_t pos;
+    uint64_t i;
+    int ret;
+
+    advfs_read_inode(advfs, &dir, sinr);
+    for ( i = 0; i < dir.attr.size; i++ ) {
+        inr = _get_inode_in_dir(advfs, sinr, i);
+        if ( ADVFS_DIR_TOMBSTONE == inr ) {
+            continue;
+        }
+        advfs_read_inode(advfs, &e, inr);
+
+        memset(&ent, 0, sizeof(ent));
+        ent.type = (e.attr.type == ADVFS_DIR) ? ADVFS_SEND_DIR : ADVFS_SEND_FILE;
+        ent.mode = e.attr.mode;
+        ent.parent = parent;
+        ent.atime = e.attr.atime;
+        ent.mtime = e.attr.mtime;
+        ent.ctime = e.attr.ctime;
+        if ( e.attr.type == ADVFS_REGULAR_FILE ) {
+            ent.size = e.attr.size;
+            ent.n_leaves = (e.attr.size + ADVFS_BLOCK_SIZE - 1)
+                / ADVFS_BLOCK_SIZE;
+        }
+        memcpy(ent.name, e.name, sizeof(ent.name));
+        ret = _stream_write(fd, &ent, sizeof(ent));
+        if ( ret < 0 ) {
+            return ret;
+        }
+        (*idx)++;
+
+        if ( e.attr.type == ADVFS_DIR ) {
+            ret = _send_tree(advfs, fd, inr, *idx, idx, l);
+            if ( ret < 0 ) {
+                return ret;
+            }
+            continue;
+        }
+        for ( pos = 0; pos < ent.n_leaves; pos++ ) {
+            _leaf_hash(advfs, inr, &e, pos, hash);
+            ret = _stream_write(fd, hash, sizeof(hash));
+            if ( ret < 0 ) {
+                return ret;
+            }
+            if ( !_is_zero_hash(hash) ) {
+                ret = _stream_blocks_add(l, hash, inr, pos);
+                if ( ret < 0 ) {
+                    return ret;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write a block record of the stream
+ */
+static int
+_send_block(advfs_t *advfs, int fd, const struct _stream_block *sb)
+{
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    int ret;
+
+    _read_leaf(advfs, sb->inr, sb->pos, block);
+    ret = _stream_write(fd, sb->hash, SHA384_DIGEST_LENGTH);
+    if ( ret < 0 ) {
+        return ret;
+    }
+
+    return _stream_write(fd, block, ADVFS_BLOCK_SIZE);
+}
+
+/*
+ * ADVFS_IOC_SEND
+ */
+static int
+_ioctl_send(advfs_t *advfs, uint64_t sinr, struct advfs_ioc_stream *args)
+{
+    struct advfs_send_header hdr;
+    struct advfs_send_entry ent;
+    struct _stream_blocks l;
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    advfs_inode_t src;
+    uint64_t idx;
+    ssize_t k;
+    size_t i;
+    size_t n;
+    int fd;
+    int rfd;
+    int ret;
+
+    if ( !_caller_privileged() ) {
+        return -EPERM;
+    }
+    args->stream[ADVFS_IOC_PATH_MAX - 1] = '\0';
+    args->reply[ADVFS_IOC_PATH_MAX - 1] = '\0';
+    advfs_read_inode(advfs, &src, sinr);
+    if ( src.attr.type != ADVFS_DIR ) {
+        return -ENOTDIR;
+    }
+
+    fd = open(args->stream, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 ) {
+        return -errno;
+    }
+
+    /* Metadata and fingerprints */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ADVFS_SEND_MAGIC, sizeof(hdr.magic));
+    hdr.version = ADVFS_SEND_VERSION;
+    memset(&l, 0, sizeof(l));
+    idx = 0;
+    ret = _stream_write(fd, &hdr, sizeof(hdr));
+    if ( 0 == ret ) {
+        ret = _send_tree(advfs, fd, sinr, 0, &idx, &l);
+    }
+    if ( 0 == ret ) {
+        memset(&ent, 0, sizeof(ent));
+        ent.type = ADVFS_SEND_END;
+        ret = _stream_write(fd, &ent, sizeof(ent));
+    }
+
+    /* Distinct blocks */
+    _stream_blocks_sort(&l);
+    n = 0;
+    for ( i = 0; i < l.n; i++ ) {
+        if ( 0 == n || 0 != _stream_block_cmp(&l.a[n - 1], &l.a[i]) ) {
+            l.a[n++] = l.a[i];
+        }
+    }
+    l.n = n;
+
+    /* Blocks the receiver lacks, or all; the reply is opened after the
+       metadata is written not to block the receiver on a FIFO */
+    rfd = -1;
+    if ( 0 == ret && '\0' != args->reply[0] ) {
+        rfd = open(args->reply, O_RDONLY);
+        if ( rfd < 0 ) {
+            ret = -errno;
+        }
+    }
+    if ( 0 == ret && rfd >= 0 ) {
+        for ( ;; ) {
+            ret = _stream_read(rfd, hash, sizeof(hash));
+            if ( ret < 0 || _is_zero_hash(hash) ) {
+                break;
+            }
+            k = _stream_blocks_find(&l, hash);
+            if ( k < 0 ) {
+                ret = -EPROTO;
+                break;
+            }
+            ret = _send_block(advfs, fd, &l.a[k]);
+            if ( ret < 0 ) {
+                break;
+            }
+        }
+    } else if ( 0 == ret ) {
+        for ( i = 0; i < l.n && 0 == ret; i++ ) {
+            ret = _send_block(advfs, fd, &l.a[i]);
+        }
+    }
+    if ( 0 == ret ) {
+        memset(hash, 0, sizeof(hash));
+        ret = _stream_write(fd, hash, sizeof(hash));
+    }
+
+    free(l.a);
+    if ( rfd >= 0 ) {
+        close(rfd);
+    }
+    close(fd);
+
+    return ret;
+}
+
+/*
+ * Create an entry of the received tree
+ */
+static int
+_receive_entry(advfs_t *advfs, uint64_t dinr,
+               const struct advfs_send_entry *ent, uint64_t *res)
+{
+    advfs_inode_t dir;
+    advfs_inode_t e;
+    advfs_superblock_t sb;
+    uint64_t nr;
+    int ret;
+
+    advfs_read_inode(advfs, &dir, dinr);
+    if ( dir.attr.size - dir.attr.n_dead >= ADVFS_MAX_CHILDREN ) {
+        return -ENOSPC;
+    }
+    ret = _find_free_inode(advfs, &nr);
+    if ( 0 != ret ) {
+        return -ENOSPC;
+    }
+    memset(&e, 0, sizeof(advfs_inode_t));
+    e.attr.type = (ADVFS_SEND_DIR == ent->type)
+        ? ADVFS_DIR : ADVFS_REGULAR_FILE;
+    e.attr.mode = ent->mode;
+    e.attr.atime = ent->atime;
+    e.attr.mtime = ent->mtime;
+    e.attr.ctime = ent->ctime;
+    memcpy(e.name, ent->name, sizeof(e.name));
+    advfs_write_inode(advfs, &e, nr);
+    advfs_read_superblock(advfs, &sb);
+    sb.n_inode_used++;
+    advfs_write_superblock(advfs, &sb);
+
+    ret = _set_inode_in_dir(advfs, dinr, nr);
+    if ( 0 != ret ) {
+        return -ENOSPC;
+    }
+    if ( ADVFS_SEND_FILE == ent->type ) {
+        ret = _resize_block(advfs, nr, ent->n_leaves);
+        if ( 0 != ret ) {
+            return -ENOSPC;
+        }
+        advfs_read_inode(advfs, &e, nr);
+        e.attr.size = ent->size;
+        advfs_write_inode(advfs, &e, nr);
+    }
+    *res = nr;
+
+    return 0;
+}
+
+/*
+ * ADVFS_IOC_RECEIVE
+ */
+static int
+_ioctl_receive(advfs_t *advfs, uint64_t dinr, struct advfs_ioc_stream *args)
+{
+    struct advfs_send_header hdr;
+    struct advfs_send_entry ent;
+    struct _stream_blocks l;
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    unsigned char h2[SHA384_DIGEST_LENGTH];
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    advfs_inode_t dst;
+    advfs_inode_t e;
+    uint64_t *map;
+    uint8_t *isdir;
+    uint64_t nmap;
+    uint64_t inr;
+    uint64_t pos;
+    uint64_t done;
+    ssize_t k;
+    size_t i;
+    int fd;
+    int rfd;
+    int ret;
+
+    if ( !_caller_privileged() ) {
+        return -EPERM;
+    }
+    args->stream[ADVFS_IOC_PATH_MAX - 1] = '\0';
+    args->reply[ADVFS_IOC_PATH_MAX - 1] = '\0';
+    advfs_read_inode(advfs, &dst, dinr);
+    if ( dst.attr.type != ADVFS_DIR ) {
+        return -ENOTDIR;
+    }
+    if ( ADVFS_INODE_READONLY(dinr) ) {
+        return -EROFS;
+    }
+    if ( dst.attr.size - dst.attr.n_dead > 0 ) {
+        return -ENOTEMPTY;
+    }
+
+    fd = open(args->stream, O_RDONLY);
+    if ( fd < 0 ) {
+        return -errno;
+    }
+    ret = _stream_read(fd, &hdr, sizeof(hdr));
+    if ( 0 == ret && (0 != memcmp(hdr.magic, ADVFS_SEND_MAGIC,
+                                  sizeof(hdr.magic))
+                      || ADVFS_SEND_VERSION != hdr.version) ) {
+        ret = -EINVAL;
+    }
+    if ( ret < 0 ) {
+        close(fd);
+        return ret;
+    }
+
+    /* The entries; the inode of the entry i is map[i], and the blocks not
+       stored yet are listed */
+    memset(&l, 0, sizeof(l));
+    map = malloc(sizeof(uint64_t) * (ADVFS_INODE_NUM + 1));
+    isdir = malloc(ADVFS_INODE_NUM + 1);
+    if ( NULL == map || NULL == isdir ) {
+        free(map);
+        free(isdir);
+        close(fd);
+        return -ENOMEM;
+    }
+    map[0] = dinr;
+    isdir[0] = 1;
+    nmap = 1;
+    for ( ;; ) {
+        ret = _stream_read(fd, &ent, sizeof(ent));
+        if ( ret < 0 || ADVFS_SEND_END == ent.type ) {
+            break;
+        }
+        ent.name[sizeof(ent.name) - 1] = '\0';
+        if ( (ADVFS_SEND_DIR != ent.type && ADVFS_SEND_FILE != ent.type)
+             || ent.parent >= nmap || !isdir[ent.parent]
+             || '\0' == ent.name[0] || NULL != index(ent.name, '/')
+             || ent.n_leaves != (ent.size + ADVFS_BLOCK_SIZE - 1)
+             / ADVFS_BLOCK_SIZE ) {
+            ret = -EINVAL;
+            break;
+        }
+        if ( nmap > ADVFS_INODE_NUM ) {
+            ret = -ENOSPC;
+            break;
+        }
+        ret = _receive_entry(advfs, map[ent.parent], &ent, &inr);
+        if ( ret < 0 ) {
+            break;
+        }
+        map[nmap] = inr;
+        isdir[nmap] = (ADVFS_SEND_DIR == ent.type);
+        nmap++;
+
+        for ( pos = 0; pos < ent.n_leaves && 0 == ret; pos++ ) {
+            ret = _stream_read(fd, hash, sizeof(hash));
+            if ( 0 == ret && !_is_zero_hash(hash)
+                 && 0 != advfs_map_block(advfs, inr, hash, pos) ) {
+                ret = _stream_blocks_add(&l, hash, inr, pos);
+            }
+        }
+        if ( ret < 0 ) {
+            break;
+        }
+    }
+    free(map);
+    free(isdir);
+    _stream_blocks_sort(&l);
+
+    /* Reply the missing fingerprints */
+    if ( 0 == ret && '\0' != args->reply[0] ) {
+        rfd = open(args->reply, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if ( rfd < 0 ) {
+            ret = -errno;
+        }
+        for ( i = 0; i < l.n && 0 == ret; i++ ) {
+            if ( 0 == i || 0 != _stream_block_cmp(&l.a[i - 1], &l.a[i]) ) {
+                ret = _stream_write(rfd, l.a[i].hash, SHA384_DIGEST_LENGTH);
+            }
+        }
+        if ( 0 == ret ) {
+            memset(hash, 0, sizeof(hash));
+            ret = _stream_write(rfd, hash, sizeof(hash));
+        }
+        if ( rfd >= 0 ) {
+            close(rfd);
+        }
+    }
+
+    /* Store the blocks shipped */
+    done = 0;
+    for ( ;; ) {
+        if ( ret < 0 ) {
+            break;
+        }
+        ret = _stream_read(fd, hash, sizeof(hash));
+        if ( ret < 0 || _is_zero_hash(hash) ) {
+            break;
+        }
+        ret = _stream_read(fd, block, sizeof(block));
+        if ( ret < 0 ) {
+            break;
+        }
+        SHA384(block, sizeof(block), h2);
+        if ( 0 != memcmp(hash, h2, sizeof(hash)) ) {
+            ret = -EIO;
+            break;
+        }
+        k = _stream_blocks_find(&l, hash);
+        for ( ; k >= 0 && (size_t)k < l.n
+                  && 0 == memcmp(l.a[k].hash, hash, sizeof(hash)); k++ ) {
+            advfs_read_inode(advfs, &e, l.a[k].inr);
+            ret = advfs_write_block(advfs, l.a[k].inr, block, l.a[k].pos,
+                                    (l.a[k].pos + 1) * ADVFS_BLOCK_SIZE
+                                    >= e.attr.size);
+            if ( 0 != ret ) {
+                ret = -ENOSPC;
+                break;
+            }
+            done++;
+        }
+    }
+    if ( 0 == ret && done != l.n ) {
+        /* Blocks missing in the stream */
+        ret = -EIO;
+    }
+
+    free(l.a);
+    close(fd);
+
+    return ret;
+}
+
+/*
+ * ioctl
+ */
+int
+advfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+            unsigned int flags, void *data)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
+    uint64_t inr;
+    int perm;
+    int ret;
+
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    if ( flags & FUSE_IOCTL_COMPAT ) {
+        return -ENOSYS;
+    }
+
+    switch ( (unsigned int)cmd ) {
+    case ADVFS_IOC_CLONE_TREE:
+    case ADVFS_IOC_SEND:
+    case ADVFS_IOC_RECEIVE:
+        /* Issued on a directory */
+        ret = advfs_path2inode(advfs, &inr, path, 0);
+        if ( ret < 0 ) {
+            return -ENOENT;
+        }
+        if ( ADVFS_IOC_CLONE_TREE == (unsigned int)cmd ) {
+            return _ioctl_clone_tree(advfs, inr, path, data);
+        } else if ( ADVFS_IOC_SEND == (unsigned int)cmd ) {
+            return _ioctl_send(advfs, inr, data);
+        }
+        return _ioctl_receive(advfs, inr, data);
     }
 
-    /* Mode check */
-    perm = fi->flags & 3;
-    if ( perm != O_RDONLY && perm != O_RDWR ) {
-        return -EACCES;
+    ret = _path2file(advfs, &inr, path);
+    if ( ret < 0 ) {
+        return ret;
     }
+    perm = fi->flags & 3;
 
-    remain = size;
-    k = 0;
-    while ( remain > 0 ) {
-        pos = offset / ADVFS_BLOCK_SIZE;
-        advfs_read_block(advfs, inr, block, pos);
-        for ( i = (offset % ADVFS_BLOCK_SIZE), j = 0;
-              i < ADVFS_BLOCK_SIZE && j < remain; i++, j++, k++ ) {
-            buf[k] = block[j];
+    switch ( (unsigned int)cmd ) {
+    case ADVFS_IOC_CLONE_RANGE:
+        if ( perm != O_WRONLY && perm != O_RDWR ) {
+            return -EBADF;
         }
-        offset += j;
-        remain -= j;
+        return _ioctl_clone_range(advfs, inr, data);
+    case ADVFS_IOC_DEDUPE_RANGE:
+        if ( perm != O_WRONLY && perm != O_RDWR ) {
+            return -EBADF;
+        }
+        return _ioctl_dedupe_range(advfs, inr, data);
+    case ADVFS_IOC_INGEST:
+        if ( perm != O_WRONLY && perm != O_RDWR ) {
+            return -EBADF;
+        }
+        return _ioctl_ingest(advfs, inr, data);
+    case ADVFS_IOC_INGEST_BLOCKS:
+        if ( perm != O_WRONLY && perm != O_RDWR ) {
+            return -EBADF;
+        }
+        return _ioctl_ingest_blocks(advfs, inr, data);
+    default:
+        return -ENOTTY;
     }
-
-    return k;
 }
 
 /*
- * write
+ * release; a file written through the handle is looked up in the whole-file
+ * digest index, and shares the block map with a duplicate if any
  */
 int
-advfs_write(const char *path, const char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+advfs_release(const char *path, struct fuse_file_info *fi)
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
     advfs_inode_t e;
-    int perm;
-    size_t nsize;
-    uint64_t nb;
-    int ret;
-    ssize_t i;
-    ssize_t j;
-    ssize_t remain;
-    off_t pos;
-    uint8_t block[ADVFS_BLOCK_SIZE];
+    unsigned char digest[SHA384_DIGEST_LENGTH];
     uint64_t inr;
+    uint64_t sinr;
+    int ret;
+    int c;
 
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
 
-    ret = advfs_path2inode(advfs, &inr, path, 0);
-    if ( ret < 0 ) {
-        return -ENOENT;
+    if ( (fi->flags & 3) == O_RDONLY ) {
+        return 0;
     }
-    advfs_read_inode(advfs, &e, inr);
-    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
-        return -EISDIR;
+    ret = _path2file(advfs, &inr, path);
+    if ( ret < 0 ) {
+        /* Removed while open */
+        return 0;
     }
 
-    /* Mode check */
-    perm = fi->flags & 3;
-    if ( perm != O_WRONLY && perm != O_RDWR ) {
-        return -EACCES;
+    advfs_read_inode(advfs, &e, inr);
+    if ( e.attr.flags & ADVFS_INODE_INGEST ) {
+        e.attr.flags &= ~ADVFS_INODE_INGEST;
+        advfs_write_inode(advfs, &e, inr);
     }
-    if ( size <= 0 ) {
+    if ( 0 == e.attr.size ) {
         return 0;
     }
 
-    /* Resize the block region */
-    nsize = offset + size;
-    nb = (nsize + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
-    ret = _resize_block(advfs, inr, nb);
-    if ( 0 != ret ) {
-        return -EFAULT;
+    advfs_file_digest(advfs, inr, digest);
+    ret = advfs_digest_index_lookup(advfs, digest, &sinr);
+    if ( 0 == ret && sinr != inr ) {
+        _dedup_file(advfs, inr, sinr);
     }
+    advfs_digest_index_add(advfs, inr);
+
+    /* Pick the block size class by the size unless chosen by a hint or a
+       policy, then split a file of 4 KiB blocks into content-defined
+       chunks.  A file is moved to a smaller class only when it is below
+       half the size of its class, so that a file whose size goes up and
+       down around a boundary is not copied at every close. */
     advfs_read_inode(advfs, &e, inr);
-    if ( nsize > e.attr.size ) {
-        e.attr.size = nsize;
+    if ( !(e.attr.flags & ADVFS_INODE_BCLASS_SET) && 0 == e.attr.extents ) {
+        c = _size_bclass(e.attr.size);
+        if ( c < (int)ADVFS_INODE_BCLASS(&e)
+             && _size_bclass(2 * e.attr.size)
+             >= (int)ADVFS_INODE_BCLASS(&e) ) {
+            c = ADVFS_INODE_BCLASS(&e);
+        }
+        ret = _convert_file(advfs, inr, c);
+        if ( 0 != ret ) {
+            return ret;
+        }
+    }
+    if ( ADVFS_CHUNK_CDC == advfs->chunking ) {
+        _seal_file(advfs, inr);
     }
-    /* Write back */
-    advfs_write_inode(advfs, &e, inr);
 
-    remain = size;
-    while ( remain > 0 ) {
-        pos = offset / ADVFS_BLOCK_SIZE;
-        advfs_read_block(advfs, inr, block, pos);
-        for ( i = (offset % ADVFS_BLOCK_SIZE), j = 0;
-              i < ADVFS_BLOCK_SIZE && j < remain; i++, j++ ) {
-            block[i] = buf[j];
-        }
-        advfs_write_block(advfs, inr, block, pos);
+    return 0;
+}
 
-        offset += j;
-        remain -= j;
-    }
+/*
+ * flush; a close is a boundary of the group commit, but does not make the
+ * file durable
+ */
+int
+advfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    struct fuse_context *ctx;
+    advfs_t *advfs;
 
-    return size;
+    /* Get the context */
+    ctx = fuse_get_context();
+    advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
+
+    return 0;
 }
 
 /*
- * truncate
+ * fsync and fsyncdir; the journal is committed only if the running
+ * transaction has changed the file or the directory
  */
 int
-advfs_truncate(const char *path, off_t size)
+advfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
-    advfs_inode_t e;
-    uint64_t nb;
-    uint8_t block[ADVFS_BLOCK_SIZE];
-    int i;
-    int ret;
-    uint64_t pos;
     uint64_t inr;
+    int ret;
 
     /* Get the context */
     ctx = fuse_get_context();
@@ -816,49 +4505,67 @@ advfs_truncate(const char *path, off_t size)
 
     ret = advfs_path2inode(advfs, &inr, path, 0);
     if ( ret < 0 ) {
-        return -ENOENT;
+        /* Removed while open; commit everything */
+        ret = advfs_journal_commit(advfs);
+    } else {
+        ret = advfs_journal_sync(advfs, inr);
     }
-    advfs_read_inode(advfs, &e, inr);
-    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
-        return -EISDIR;
+    if ( ret < 0 ) {
+        return -EIO;
     }
 
-    /* Calculate the number of blocks */
-    nb = (size + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
-    ret = _resize_block(advfs, inr, nb);
-    if ( 0 != ret ) {
-        return -EFAULT;
-    }
+    return 0;
+}
+int
+advfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return advfs_fsync(path, datasync, fi);
+}
 
-    while ( (off_t)e.attr.size < size ) {
-        pos = e.attr.size / ADVFS_BLOCK_SIZE;
-        advfs_read_block(advfs, inr, block, pos);
-        for ( i = e.attr.size % ADVFS_BLOCK_SIZE;
-              i < ADVFS_BLOCK_SIZE && (off_t)e.attr.size < size; i++ ) {
-            block[i] = 0;
-            e.attr.size++;
+/*
+ * Names of the block size classes
+ */
+static const char *_bclass_names[ADVFS_BCLASS_NUM] = { "4k", "64k", "1m" };
+
+/*
+ * Look up the block size class by the name
+ */
+static int
+_bclass_lookup(const char *name, size_t len)
+{
+    int c;
+
+    for ( c = 0; c < ADVFS_BCLASS_NUM; c++ ) {
+        if ( strlen(_bclass_names[c]) == len
+             && 0 == strncmp(name, _bclass_names[c], len) ) {
+            return c;
         }
-        advfs_write_block(advfs, inr, block, pos);
     }
-    e.attr.size = size;
-
-    /* Write back */
-    advfs_write_inode(advfs, &e, inr);
 
-    return 0;
+    return -1;
 }
 
 /*
- * utimens
+ * getxattr
  */
+#ifdef __APPLE__
 int
-advfs_utimens(const char *path, const struct timespec tv[2])
+advfs_getxattr(const char *path, const char *name, char *value, size_t size,
+               uint32_t position)
+#else
+int
+advfs_getxattr(const char *path, const char *name, char *value, size_t size)
+#endif
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
     advfs_inode_t e;
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    char buf[4096];
     uint64_t inr;
+    int len;
     int ret;
+    int i;
 
     /* Get the context */
     ctx = fuse_get_context();
@@ -866,107 +4573,161 @@ advfs_utimens(const char *path, const struct timespec tv[2])
 
     ret = advfs_path2inode(advfs, &inr, path, 0);
     if ( ret < 0 ) {
-        /* No entry found or non-directory entry */
         return -ENOENT;
     }
-    if ( NULL != tv ) {
-        e.attr.atime = tv[0].tv_sec;
-        e.attr.mtime = tv[1].tv_sec;
+    advfs_read_inode(advfs, &e, inr);
+
+    if ( 0 == strcmp(name, ADVFS_XATTR_DIGEST)
+         && e.attr.type == ADVFS_REGULAR_FILE ) {
+        advfs_file_digest(advfs, inr, digest);
+        for ( i = 0; i < SHA384_DIGEST_LENGTH; i++ ) {
+            snprintf(buf + i * 2, 3, "%02x", digest[i]);
+        }
+        len = SHA384_DIGEST_LENGTH * 2;
+    } else if ( 0 == strcmp(name, ADVFS_XATTR_STATS)
+                && inr == advfs->superblock->root ) {
+        len = advfs_compress_stats(advfs, buf, sizeof(buf));
+        len += advfs_journal_stats(advfs, buf + len, sizeof(buf) - len);
+    } else if ( 0 == strcmp(name, ADVFS_XATTR_BLOCKSIZE)
+                && (e.attr.type == ADVFS_REGULAR_FILE
+                    || (e.attr.flags & ADVFS_INODE_BCLASS_SET)) ) {
+        len = snprintf(buf, sizeof(buf), "%s",
+                       _bclass_names[ADVFS_INODE_BCLASS(&e)]);
+    } else {
+        return -ENODATA;
     }
 
-    /* Write back */
-    advfs_write_inode(advfs, &e, inr);
+    if ( 0 == size ) {
+        return len;
+    }
+    if ( size < (size_t)len ) {
+        return -ERANGE;
+    }
+    memcpy(value, buf, len);
 
-    return 0;
+    return len;
 }
 
 /*
- * create
+ * listxattr
  */
 int
-advfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+advfs_listxattr(const char *path, char *list, size_t size)
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
     advfs_inode_t e;
-    struct timeval tv;
+    const char *names[3];
+    char buf[256];
     uint64_t inr;
+    size_t len;
+    int n;
+    int i;
     int ret;
 
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
 
-    gettimeofday(&tv, NULL);
-
     ret = advfs_path2inode(advfs, &inr, path, 0);
-    if ( ret == 0 ) {
-        /* Already exists */
-        return -EEXIST;
-    }
-
-    ret = advfs_path2inode(advfs, &inr, path, 1);
     if ( ret < 0 ) {
-        /* No entry found or non-directory entry */
-        return -EACCES;
+        return -ENOENT;
     }
     advfs_read_inode(advfs, &e, inr);
-    e.attr.type = ADVFS_REGULAR_FILE;
-    e.attr.mode = mode;
-    e.attr.atime = tv.tv_sec;
-    e.attr.mtime = tv.tv_sec;
-    e.attr.ctime = tv.tv_sec;
-    advfs_write_inode(advfs, &e, inr);
+    n = 0;
+    if ( e.attr.type == ADVFS_REGULAR_FILE ) {
+        names[n++] = ADVFS_XATTR_DIGEST;
+    }
+    if ( inr == advfs->superblock->root ) {
+        names[n++] = ADVFS_XATTR_STATS;
+    }
+    if ( e.attr.type == ADVFS_REGULAR_FILE
+         || (e.attr.flags & ADVFS_INODE_BCLASS_SET) ) {
+        names[n++] = ADVFS_XATTR_BLOCKSIZE;
+    }
 
-    return 0;
+    /* NUL-separated names */
+    len = 0;
+    for ( i = 0; i < n; i++ ) {
+        memcpy(buf + len, names[i], strlen(names[i]) + 1);
+        len += strlen(names[i]) + 1;
+    }
+    if ( 0 == size ) {
+        return len;
+    }
+    if ( size < len ) {
+        return -ERANGE;
+    }
+    memcpy(list, buf, len);
+
+    return len;
 }
 
 /*
- * mkdir
+ * setxattr (the advfs attributes other than the block size class are
+ * read-only; no others are stored)
  */
+#ifdef __APPLE__
 int
-advfs_mkdir(const char *path, mode_t mode)
+advfs_setxattr(const char *path, const char *name, const char *value,
+               size_t size, int flags, uint32_t position)
+#else
+int
+advfs_setxattr(const char *path, const char *name, const char *value,
+               size_t size, int flags)
+#endif
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
     advfs_inode_t e;
-    struct timeval tv;
     uint64_t inr;
     int ret;
+    int c;
 
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
 
-    gettimeofday(&tv, NULL);
+    if ( 0 == strcmp(name, ADVFS_XATTR_BLOCKSIZE) ) {
+        ret = advfs_path2inode(advfs, &inr, path, 0);
+        if ( ret < 0 ) {
+            return -ENOENT;
+        }
+        if ( ADVFS_INODE_READONLY(inr) ) {
+            return -EROFS;
+        }
+        c = _bclass_lookup(value, size);
+        if ( c < 0 ) {
+            return -EINVAL;
+        }
+        advfs_read_inode(advfs, &e, inr);
+        if ( e.attr.type == ADVFS_REGULAR_FILE ) {
+            /* Convert the content */
+            ret = _convert_file(advfs, inr, c);
+            if ( ret < 0 ) {
+                return ret;
+            }
+        }
+        advfs_read_inode(advfs, &e, inr);
+        e.attr.flags = (e.attr.flags & ~ADVFS_INODE_BCLASS_MASK)
+            | ((uint64_t)c << ADVFS_INODE_BCLASS_SHIFT) | ADVFS_INODE_BCLASS_SET;
+        advfs_write_inode(advfs, &e, inr);
 
-    ret = advfs_path2inode(advfs, &inr, path, 0);
-    if ( ret == 0 ) {
-        /* Already exists */
-        return -EEXIST;
+        return 0;
     }
-
-    ret = advfs_path2inode(advfs, &inr, path, 1);
-    if ( ret < 0 ) {
-        /* No entry found or non-directory entry */
-        return -EACCES;
+    if ( 0 == strncmp(name, ADVFS_XATTR_PREFIX, strlen(ADVFS_XATTR_PREFIX)) ) {
+        return -EPERM;
     }
-    advfs_read_inode(advfs, &e, inr);
-    e.attr.type = ADVFS_DIR;
-    e.attr.mode = mode;
-    e.attr.atime = tv.tv_sec;
-    e.attr.mtime = tv.tv_sec;
-    e.attr.ctime = tv.tv_sec;
-    advfs_write_inode(advfs, &e, inr);
 
-    return 0;
+    return -ENOTSUP;
 }
 
 /*
- * rmdir
+ * removexattr
  */
 int
-advfs_rmdir(const char *path)
+advfs_removexattr(const char *path, const char *name)
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
@@ -977,50 +4738,96 @@ advfs_rmdir(const char *path)
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
+    advfs_journal_tick(advfs);
 
-    ret = advfs_path2inode(advfs, &inr, path, 0);
-    if ( ret < 0 ) {
-        return -ENOENT;
+    if ( 0 == strcmp(name, ADVFS_XATTR_BLOCKSIZE) ) {
+        /* Back to the size heuristic; a directory drops the policy */
+        ret = advfs_path2inode(advfs, &inr, path, 0);
+        if ( ret < 0 ) {
+            return -ENOENT;
+        }
+        if ( ADVFS_INODE_READONLY(inr) ) {
+            return -EROFS;
+        }
+        advfs_read_inode(advfs, &e, inr);
+        if ( !(e.attr.flags & ADVFS_INODE_BCLASS_SET) ) {
+            return -ENODATA;
+        }
+        e.attr.flags &= ~ADVFS_INODE_BCLASS_SET;
+        if ( e.attr.type == ADVFS_DIR ) {
+            e.attr.flags &= ~ADVFS_INODE_BCLASS_MASK;
+        }
+        advfs_write_inode(advfs, &e, inr);
+
+        return 0;
     }
-    advfs_read_inode(advfs, &e, inr);
-    if ( e.attr.type != ADVFS_DIR ) {
-        return -ENOTDIR;
+    if ( 0 == strncmp(name, ADVFS_XATTR_PREFIX, strlen(ADVFS_XATTR_PREFIX)) ) {
+        return -EPERM;
     }
 
-    return advfs_remove_inode(advfs, path);
+    return -ENODATA;
 }
 
 /*
- * unlink
+ * init (negotiate the connection parameters with the kernel)
  */
-int
-advfs_unlink(const char *path)
+#ifdef HAVE_FUSE3
+void *
+advfs_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+#else
+void *
+advfs_fuse_init(struct fuse_conn_info *conn)
+#endif
 {
     struct fuse_context *ctx;
     advfs_t *advfs;
-    advfs_inode_t e;
-    uint64_t inr;
-    int ret;
 
     /* Get the context */
     ctx = fuse_get_context();
     advfs = ctx->private_data;
 
-    ret = advfs_path2inode(advfs, &inr, path, 0);
-    if ( ret < 0 ) {
-        return -ENOENT;
+#ifdef HAVE_FUSE3
+    /* Let the kernel batch small writes into large ones in the page cache */
+    if ( conn->capable & FUSE_CAP_WRITEBACK_CACHE ) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        advfs->writeback = 1;
     }
-    advfs_read_inode(advfs, &e, inr);
-    if ( e.attr.type != ADVFS_REGULAR_FILE ) {
-        return -ENOENT;
+    if ( conn->capable & FUSE_CAP_ASYNC_READ ) {
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    }
+    /* readdir always returns the attributes, so use readdirplus for every
+       listing instead of letting the kernel choose adaptively */
+    if ( conn->capable & FUSE_CAP_READDIRPLUS ) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
     }
+    /* Request as large writes as the kernel allows */
+    conn->max_write = ADVFS_MAX_WRITE;
+    conn->max_readahead = ADVFS_MAX_WRITE;
+#else
+    conn->want |= FUSE_CAP_BIG_WRITES;
+    conn->max_write = ADVFS_MAX_WRITE;
+#endif
 
-    return advfs_remove_inode(advfs, path);
+    return advfs;
+}
+
+/*
+ * destroy (commit the journal at unmount)
+ */
+void
+advfs_fuse_destroy(void *private_data)
+{
+    advfs_journal_close(private_data);
 }
 
 static struct fuse_operations advfs_oper = {
+    .init       = advfs_fuse_init,
+    .destroy    = advfs_fuse_destroy,
     .getattr    = advfs_getattr,
+    .opendir    = advfs_opendir,
     .readdir    = advfs_readdir,
+    .releasedir = advfs_releasedir,
     .statfs     = advfs_statfs,
     .open       = advfs_open,
     .read       = advfs_read,
@@ -1029,8 +4836,27 @@ static struct fuse_operations advfs_oper = {
     .create     = advfs_create,
     .mkdir      = advfs_mkdir,
     .rmdir      = advfs_rmdir,
+    .rename     = advfs_rename,
     .utimens    = advfs_utimens,
     .unlink     = advfs_unlink,
+    .ioctl      = advfs_ioctl,
+    .release    = advfs_release,
+    .flush      = advfs_flush,
+    .fsync      = advfs_fsync,
+    .fsyncdir   = advfs_fsyncdir,
+    .getxattr   = advfs_getxattr,
+    .listxattr  = advfs_listxattr,
+    .setxattr   = advfs_setxattr,
+    .removexattr = advfs_removexattr,
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_FALLOCATE
+    .fallocate  = advfs_fallocate,
+#endif
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+    .lseek      = advfs_lseek,
+#endif
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+    .copy_file_range = advfs_copy_file_range,
+#endif
 };
 
 /*
@@ -1039,16 +4865,91 @@ static struct fuse_operations advfs_oper = {
 int
 main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct advfs_options opts;
     advfs_t advfs;
     int ret;
 
+    /* Parse the advfs options */
+    memset(&opts, 0, sizeof(struct advfs_options));
+    opts.commit = ADVFS_COMMIT_INTERVAL;
+    opts.clean_budget = ADVFS_CLEAN_BUDGET;
+    if ( fuse_opt_parse(&args, &opts, advfs_opts, NULL) == -1 ) {
+        return EXIT_FAILURE;
+    }
+    advfs.compress = ADVFS_COMPRESS_NONE;
+    if ( NULL != opts.compress ) {
+        advfs.compress = advfs_compress_lookup(opts.compress);
+        if ( advfs.compress < 0 ) {
+            fprintf(stderr, "advfs: unsupported compression: %s\n",
+                    opts.compress);
+            return EXIT_FAILURE;
+        }
+    }
+    advfs.compress_level = opts.compress_level;
+    if ( !opts.compress_level_set ) {
+        /* Default level of each algorithm */
+        advfs.compress_level = (ADVFS_COMPRESS_ZSTD == advfs.compress) ? 3 : 1;
+    }
+    advfs.chunking = ADVFS_CHUNK_FIXED;
+    if ( NULL != opts.chunking ) {
+        if ( 0 == strcmp(opts.chunking, "cdc") ) {
+            advfs.chunking = ADVFS_CHUNK_CDC;
+        } else if ( 0 != strcmp(opts.chunking, "fixed") ) {
+            fprintf(stderr, "advfs: unsupported chunking: %s\n",
+                    opts.chunking);
+            return EXIT_FAILURE;
+        }
+    }
+    advfs.bclass = 0;
+    if ( NULL != opts.blocksize ) {
+        if ( 0 == strcmp(opts.blocksize, "auto") ) {
+            advfs.bclass = ADVFS_BCLASS_AUTO;
+        } else {
+            advfs.bclass = _bclass_lookup(opts.blocksize,
+                                          strlen(opts.blocksize));
+            if ( advfs.bclass < 0 ) {
+                fprintf(stderr, "advfs: unsupported block size: %s\n",
+                        opts.blocksize);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    advfs.image = opts.image;
+    if ( NULL != opts.image ) {
+        /* The journal commits between the operations; with the handlers
+           running in parallel, a commit would catch the others halfway */
+        fuse_opt_add_arg(&args, "-s");
+    }
+    advfs.commit_interval = opts.commit;
+    /* The layout of a new image; an existing image keeps its own */
+    advfs.log = 0;
+    if ( NULL != opts.layout ) {
+        if ( 0 == strcmp(opts.layout, "log") ) {
+            advfs.log = 1;
+        } else if ( 0 != strcmp(opts.layout, "inplace") ) {
+            fprintf(stderr, "advfs: unsupported layout: %s\n", opts.layout);
+            return EXIT_FAILURE;
+        }
+    }
+    advfs.clean_budget = opts.clean_budget;
+    if ( advfs.clean_budget <= 0 ) {
+        fprintf(stderr, "advfs: invalid clean budget: %d\n",
+                opts.clean_budget);
+        return EXIT_FAILURE;
+    }
+
     /* Initialize */
     ret = advfs_init(&advfs);
     if ( 0 != ret ) {
         return EXIT_FAILURE;
     }
 
-    return fuse_main(argc, argv, &advfs_oper, &advfs);
+    ret = fuse_main(args.argc, args.argv, &advfs_oper, &advfs);
+    fuse_opt_free_args(&args);
+
+    return ret;
 }
 
 /*
@@ -41,6 +41,18 @@ _get_block_mgt(advfs_t *advfs, uint64_t b)
     return &mgt[b];
 }
 
+/*
+ * Resolve the dedup tree root of the block size class
+ */
+static uint64_t *
+_block_root(advfs_t *advfs, int c)
+{
+    if ( 0 == c ) {
+        return &advfs->superblock->block_mgt_root;
+    }
+    return &advfs->superblock->class_root[c];
+}
+
 /*
  * Search
  */
@@ -70,11 +82,11 @@ _block_search_rec(advfs_t *advfs, uint64_t parent, const unsigned char *hash)
     }
 }
 static uint64_t
-_block_search(advfs_t *advfs, const unsigned char *hash)
+_block_search(advfs_t *advfs, int c, const unsigned char *hash)
 {
     uint64_t root;
 
-    root = advfs->superblock->block_mgt_root;
+    root = *_block_root(advfs, c);
 
     return _block_search_rec(advfs, root, hash);
 }
@@ -111,9 +123,9 @@ _block_add_rec(advfs_t *advfs, uint64_t *parent, uint64_t b)
     }
 }
 static int
-_block_add(advfs_t *advfs, uint64_t b)
+_block_add(advfs_t *advfs, int c, uint64_t b)
 {
-    return _block_add_rec(advfs, &advfs->superblock->block_mgt_root, b);
+    return _block_add_rec(advfs, _block_root(advfs, c), b);
 }
 
 /*
@@ -132,9 +144,7 @@ _block_remove_max(advfs_t *advfs, uint64_t *parent)
     }
 
     maxc = *parent;
-    if ( 0 != mgt->left ) {
-        *parent = mgt->left;
-    }
+    *parent = mgt->left;
 
     return maxc;
 }
@@ -164,7 +174,8 @@ _block_delete_rec(advfs_t *advfs, uint64_t *parent, uint64_t b)
         } else if ( 0 != mgt->left ) {
             /* Only left child */
             *parent = mgt->left;
-        } else if ( 0 != mgt->left ) {
+        } else if ( 0 != mgt->right ) {
+            /* Only right child */
             *parent = mgt->right;
         } else {
             /* No children */
@@ -189,9 +200,39 @@ _block_delete_rec(advfs_t *advfs, uint64_t *parent, uint64_t b)
     }
 }
 static int
-_block_delete(advfs_t *advfs, uint64_t b)
+_block_delete(advfs_t *advfs, int c, uint64_t b)
+{
+    return _block_delete_rec(advfs, _block_root(advfs, c), b);
+}
+
+/*
+ * Bulk load; build the balanced tree of the blocks sorted by the hash value
+ * from the leaves up, and make it the tree of the block size class
+ */
+static uint64_t
+_block_build_rec(advfs_t *advfs, const uint64_t *nrs, uint64_t n)
+{
+    advfs_block_mgt_t *mgt;
+    uint64_t left;
+    uint64_t right;
+    uint64_t mid;
+
+    if ( 0 == n ) {
+        return 0;
+    }
+    mid = n / 2;
+    left = _block_build_rec(advfs, nrs, mid);
+    right = _block_build_rec(advfs, nrs + mid + 1, n - mid - 1);
+    mgt = _get_block_mgt(advfs, nrs[mid]);
+    mgt->left = left;
+    mgt->right = right;
+
+    return nrs[mid];
+}
+void
+advfs_block_build(advfs_t *advfs, int c, const uint64_t *nrs, uint64_t n)
 {
-    return _block_delete_rec(advfs, &advfs->superblock->block_mgt_root, b);
+    *_block_root(advfs, c) = _block_build_rec(advfs, nrs, n);
 }
 
 /*
@@ -241,15 +282,14 @@ _update_block_map(advfs_t *advfs, uint64_t inr, uint64_t pos, uint64_t pb)
     advfs_inode_t inode;
     uint8_t buf[ADVFS_BLOCK_SIZE];
 
+    advfs_journal_touch(advfs, inr);
+
     /* Read the inode */
     advfs_read_inode(advfs, &inode, inr);
 
     if ( pos < ADVFS_INODE_BLOCKPTR - 1 ) {
         /* The block number is included in the inode structure */
         inode.blocks[pos] = pb;
-
-        /* Write back */
-        advfs_write_inode(advfs, &inode, inr);
     } else {
         /* Resolve from the chain */
         b = inode.blocks[ADVFS_INODE_BLOCKPTR - 1];
@@ -269,6 +309,10 @@ _update_block_map(advfs_t *advfs, uint64_t inr, uint64_t pos, uint64_t pb)
         advfs_write_raw_block(advfs, buf, b);
     }
 
+    /* The content has been changed */
+    inode.attr.flags &= ~ADVFS_INODE_DIGEST;
+    advfs_write_inode(advfs, &inode, inr);
+
     return 0;
 }
 
@@ -323,100 +367,558 @@ advfs_write_raw_block(advfs_t *advfs, void *buf, uint64_t pos)
 
     block = (void *)advfs->superblock + ADVFS_BLOCK_SIZE * pos;
     memcpy(block, buf, ADVFS_BLOCK_SIZE);
+    advfs_journal_dirty(advfs, pos);
 
     return 0;
 }
 
 /*
- * Read a block
+ * Find n consecutive free slots in a pack block; -1 if not found
+ */
+static int
+_zslot_fit(uint64_t zmask, int n)
+{
+    uint64_t mask;
+    int i;
+
+    mask = (1ULL << n) - 1;
+    for ( i = 0; i + n <= ADVFS_ZSLOT_NUM; i++ ) {
+        if ( 0 == (zmask & (mask << i)) ) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * # of free slots in a pack block
+ */
+static int
+_zslot_free(uint64_t zmask)
+{
+    return ADVFS_ZSLOT_NUM - __builtin_popcountll(zmask);
+}
+
+/*
+ * Store a data block compressed, or without the trailing zeros if it is the
+ * tail (the last block of a file or a chunk), in the slots of a pack block,
+ * and fill the compression fields of its management structure; returns the
+ * compressed block id, or 0 if the block does not shrink by a slot or no
+ * space is left
+ */
+static uint64_t
+_zblock_store(advfs_t *advfs, uint64_t inr, void *buf, int tail,
+              advfs_block_mgt_t *mgt)
+{
+    uint8_t zbuf[ADVFS_BLOCK_SIZE];
+    uint8_t pbuf[ADVFS_BLOCK_SIZE];
+    advfs_block_mgt_t pmgt;
+    advfs_block_mgt_t vmgt;
+    advfs_superblock_t sb;
+    size_t zlen;
+    uint64_t p;
+    uint64_t v;
+    int alg;
+    int slot;
+    int n;
+
+    alg = advfs->compress;
+    zlen = 0;
+    if ( ADVFS_COMPRESS_NONE != alg && advfs_compress_try(advfs, inr, buf) ) {
+        zlen = advfs_compress(advfs, buf, zbuf,
+                              ADVFS_BLOCK_SIZE - ADVFS_ZSLOT_SIZE);
+        advfs_compress_feedback(advfs, inr, 0 != zlen);
+        if ( 0 == zlen ) {
+            advfs->zstats.uncompressible++;
+        }
+    }
+    if ( 0 == zlen ) {
+        /* Pack the content of the tail before the trailing zeros as is */
+        if ( !tail ) {
+            return 0;
+        }
+        for ( zlen = ADVFS_BLOCK_SIZE; zlen > 0; zlen-- ) {
+            if ( 0 != ((uint8_t *)buf)[zlen - 1] ) {
+                break;
+            }
+        }
+        if ( 0 == zlen || zlen > ADVFS_BLOCK_SIZE - ADVFS_ZSLOT_SIZE ) {
+            return 0;
+        }
+        alg = ADVFS_COMPRESS_NONE;
+        memcpy(zbuf, buf, zlen);
+        advfs->zstats.tail_packed++;
+    }
+    n = (zlen + ADVFS_ZSLOT_SIZE - 1) / ADVFS_ZSLOT_SIZE;
+
+    /* Find the slots in the current pack block, or start a new one */
+    p = advfs->zpack;
+    slot = -1;
+    if ( 0 != p ) {
+        advfs_read_block_mgt(advfs, &pmgt, p);
+        slot = _zslot_fit(pmgt.zmask, n);
+    }
+    if ( slot < 0 ) {
+        advfs_read_superblock(advfs, &sb);
+        if ( 0 == sb.zfreelist ) {
+            return 0;
+        }
+        p = advfs_alloc_block(advfs);
+        if ( 0 == p ) {
+            return 0;
+        }
+        memset(&pmgt, 0, sizeof(advfs_block_mgt_t));
+        pmgt.type = ADVFS_BLOCK_PACK;
+        slot = 0;
+        advfs->zpack = p;
+    }
+
+    /* Take a compressed block id from the free list */
+    advfs_read_superblock(advfs, &sb);
+    v = sb.zfreelist;
+    if ( 0 == v ) {
+        return 0;
+    }
+    advfs_read_block_mgt(advfs, &vmgt, v);
+    sb.zfreelist = vmgt.left;
+    advfs_write_superblock(advfs, &sb);
+
+    /* Write the content to the slots */
+    advfs_read_raw_block(advfs, pbuf, p);
+    memcpy(pbuf + slot * ADVFS_ZSLOT_SIZE, zbuf, zlen);
+    advfs_write_raw_block(advfs, pbuf, p);
+    pmgt.zmask |= ((1ULL << n) - 1) << slot;
+    pmgt.ref++;
+    advfs_write_block_mgt(advfs, &pmgt, p);
+
+    mgt->zblock = p;
+    mgt->zslot = slot;
+    mgt->zalg = alg;
+    mgt->zlen = zlen;
+
+    advfs->zstats.live_blocks++;
+    advfs->zstats.live_slots += n;
+
+    return v;
+}
+
+/*
+ * Release a compressed block id and its slots
+ */
+static void
+_zblock_free(advfs_t *advfs, uint64_t v)
+{
+    advfs_block_mgt_t mgt;
+    advfs_block_mgt_t pmgt;
+    advfs_block_mgt_t cmgt;
+    advfs_superblock_t sb;
+    uint64_t p;
+    int n;
+
+    advfs_read_block_mgt(advfs, &mgt, v);
+    p = mgt.zblock;
+    n = (mgt.zlen + ADVFS_ZSLOT_SIZE - 1) / ADVFS_ZSLOT_SIZE;
+
+    /* Release the slots */
+    advfs_read_block_mgt(advfs, &pmgt, p);
+    pmgt.zmask &= ~(((1ULL << n) - 1) << mgt.zslot);
+    pmgt.ref--;
+    advfs_write_block_mgt(advfs, &pmgt, p);
+    if ( 0 == pmgt.ref ) {
+        if ( advfs->zpack == p ) {
+            advfs->zpack = 0;
+        }
+        advfs_free_block(advfs, p);
+    } else if ( advfs->zpack != p ) {
+        /* Fill the pack block with more free slots first */
+        if ( 0 == advfs->zpack ) {
+            advfs->zpack = p;
+        } else {
+            advfs_read_block_mgt(advfs, &cmgt, advfs->zpack);
+            if ( _zslot_free(pmgt.zmask) > _zslot_free(cmgt.zmask) ) {
+                advfs->zpack = p;
+            }
+        }
+    }
+
+    /* Invalidate the cache entry; the id will be reused */
+    if ( advfs->zcache[v % ADVFS_ZCACHE_NUM].b == v ) {
+        advfs->zcache[v % ADVFS_ZCACHE_NUM].b = 0;
+    }
+
+    /* Return the id to the free list */
+    advfs_read_superblock(advfs, &sb);
+    mgt.left = sb.zfreelist;
+    advfs_write_block_mgt(advfs, &mgt, v);
+    sb.zfreelist = v;
+    advfs_write_superblock(advfs, &sb);
+
+    advfs->zstats.live_blocks--;
+    advfs->zstats.live_slots -= n;
+}
+
+/*
+ * Read the content of a data block by its id
+ */
+int
+advfs_load_block(advfs_t *advfs, uint64_t b, void *buf)
+{
+    advfs_zcache_entry_t *ent;
+    advfs_block_mgt_t mgt;
+    uint8_t pbuf[ADVFS_BLOCK_SIZE];
+    int ret;
+
+    if ( b < ADVFS_ZBLOCK_BASE ) {
+        return advfs_read_raw_block(advfs, buf, b);
+    }
+
+    /* Compressed block; look up the cache first */
+    ent = &advfs->zcache[b % ADVFS_ZCACHE_NUM];
+    if ( ent->b == b ) {
+        advfs->zstats.cache_hits++;
+        memcpy(buf, ent->data, ADVFS_BLOCK_SIZE);
+        return 0;
+    }
+    advfs->zstats.cache_misses++;
+
+    advfs_read_block_mgt(advfs, &mgt, b);
+    advfs_read_raw_block(advfs, pbuf, mgt.zblock);
+    ret = advfs_decompress(advfs, mgt.zalg, pbuf + mgt.zslot * ADVFS_ZSLOT_SIZE,
+                           mgt.zlen, buf);
+    if ( 0 != ret ) {
+        return -1;
+    }
+    ent->b = b;
+    memcpy(ent->data, buf, ADVFS_BLOCK_SIZE);
+
+    return 0;
+}
+
+/*
+ * Get the block size class of the inode
+ */
+static int
+_inode_bclass(advfs_t *advfs, uint64_t inr)
+{
+    advfs_inode_t inode;
+
+    advfs_read_inode(advfs, &inode, inr);
+
+    return ADVFS_INODE_BCLASS(&inode);
+}
+
+/*
+ * Read a 4 KiB block; pos is in 4 KiB blocks whatever the block size class
+ * of the file is
  */
 int
 advfs_read_block(advfs_t *advfs, uint64_t inr, void *buf, uint64_t pos)
 {
     uint64_t b;
+    int c;
 
-    b = _resolve_block_map(advfs, inr, pos);
+    c = _inode_bclass(advfs, inr);
+    b = _resolve_block_map(advfs, inr, pos >> ADVFS_BCLASS_SHIFT(c));
     if ( b == 0 ) {
         memset(buf, 0, ADVFS_BLOCK_SIZE);
+    } else if ( 0 != c ) {
+        /* Within the run of the larger block */
+        return advfs_read_raw_block(advfs, buf,
+                                    b + (pos & (ADVFS_BCLASS_BLOCKS(c) - 1)));
     } else {
-        advfs_read_raw_block(advfs, buf, b);
+        return advfs_load_block(advfs, b, buf);
     }
 
     return 0;
 }
 
 /*
- * Write a block
+ * Allocate a run of the contiguous blocks of the block size class c from
+ * the free list of the class, or from the blocks never allocated.  Runs are
+ * not coalesced from the freed 4 KiB blocks.
+ */
+static uint64_t
+_alloc_class_block(advfs_t *advfs, int c)
+{
+    uint64_t b;
+    advfs_free_list_t *fl;
+    advfs_superblock_t sb;
+    uint8_t buf[ADVFS_BLOCK_SIZE];
+
+    advfs_read_superblock(advfs, &sb);
+
+    b = sb.class_freelist[c];
+    if ( 0 != b ) {
+        advfs_read_raw_block(advfs, buf, b);
+        fl = (advfs_free_list_t *)buf;
+        sb.class_freelist[c] = fl->next;
+    } else if ( sb.brk + ADVFS_BCLASS_BLOCKS(c)
+                <= sb.ptr_block + sb.n_blocks ) {
+        b = sb.brk;
+        sb.brk += ADVFS_BCLASS_BLOCKS(c);
+    } else {
+        return 0;
+    }
+    sb.n_block_used += ADVFS_BCLASS_BLOCKS(c);
+    advfs_log_mark_free(advfs, b, ADVFS_BCLASS_BLOCKS(c), 0);
+
+    advfs_write_superblock(advfs, &sb);
+
+    return b;
+}
+
+/*
+ * Clear the reference counter of a block going on a free list; the meta
+ * blocks are released with their counter still set, and the free lists of
+ * a log-structured image are rebuilt from the counters at mount
+ */
+static void
+_clear_block_ref(advfs_t *advfs, uint64_t b)
+{
+    advfs_block_mgt_t mgt;
+
+    advfs_read_block_mgt(advfs, &mgt, b);
+    if ( mgt.ref ) {
+        mgt.ref = 0;
+        advfs_write_block_mgt(advfs, &mgt, b);
+    }
+}
+
+/*
+ * Release a run of the blocks of the block size class c
+ */
+static void
+_free_class_block(advfs_t *advfs, uint64_t b, int c)
+{
+    advfs_free_list_t *fl;
+    advfs_superblock_t sb;
+    uint8_t buf[ADVFS_BLOCK_SIZE];
+
+    _clear_block_ref(advfs, b);
+    advfs_read_superblock(advfs, &sb);
+
+    fl = (advfs_free_list_t *)buf;
+    fl->next = sb.class_freelist[c];
+    advfs_write_raw_block(advfs, buf, b);
+
+    sb.class_freelist[c] = b;
+    sb.n_block_used -= ADVFS_BCLASS_BLOCKS(c);
+    advfs_log_mark_free(advfs, b, ADVFS_BCLASS_BLOCKS(c), 1);
+
+    advfs_write_superblock(advfs, &sb);
+}
+
+/*
+ * Reference a physical block
+ */
+static void
+_ref_phys_block(advfs_t *advfs, uint64_t b)
+{
+    advfs_block_mgt_t mgt;
+
+    advfs_read_block_mgt(advfs, &mgt, b);
+    mgt.ref++;
+    advfs_write_block_mgt(advfs, &mgt, b);
+}
+
+/*
+ * Unreference a physical block, and release it if no longer referenced
+ */
+static void
+_unref_phys_block(advfs_t *advfs, uint64_t b)
+{
+    advfs_block_mgt_t mgt;
+
+    advfs_read_block_mgt(advfs, &mgt, b);
+    mgt.ref--;
+    advfs_write_block_mgt(advfs, &mgt, b);
+    if ( mgt.ref == 0 ) {
+        /* Release this block; metadata blocks are not in the tree */
+        if ( ADVFS_BLOCK_DATA == mgt.type ) {
+            _block_delete(advfs, mgt.bclass, b);
+        }
+        if ( 0 != mgt.bclass ) {
+            _free_class_block(advfs, b, mgt.bclass);
+        } else if ( b >= ADVFS_ZBLOCK_BASE ) {
+            _zblock_free(advfs, b);
+        } else {
+            advfs_free_block(advfs, b);
+        }
+    }
+}
+
+/*
+ * Write a block; pos is in the blocks of the block size class of the file,
+ * and buf has the size of the block.  tail tells that the block is the last
+ * one of the file or of a chunk, which is tail-packed if not compressed.
  */
 int
-advfs_write_block(advfs_t *advfs, uint64_t inr, void *buf, uint64_t pos)
+advfs_write_block(advfs_t *advfs, uint64_t inr, void *buf, uint64_t pos,
+                  int tail)
 {
     uint64_t b;
     uint64_t cur;
+    uint64_t i;
     unsigned char hash[SHA384_DIGEST_LENGTH];
     advfs_block_mgt_t mgt;
-    advfs_inode_t inode;
-
-    /* Read the inode corresponding to inr */
-    advfs_read_inode(advfs, &inode, inr);
+    int c;
 
     /* Calculate the hash value */
-    SHA384(buf, ADVFS_BLOCK_SIZE, hash);
+    c = _inode_bclass(advfs, inr);
+    SHA384(buf, ADVFS_BCLASS_SIZE(c), hash);
 
     /* Resolve the physical block corresponding to the logical block */
     cur = _resolve_block_map(advfs, inr, pos);
 
     /* Check the duplication */
-    b = _block_search(advfs, hash);
+    b = _block_search(advfs, c, hash);
     if ( b != 0 ) {
         /* Found */
-        if ( cur != b ) {
-            if ( cur != 0 ) {
-                /* Unreference the old block */
-                advfs_read_block_mgt(advfs, &mgt, cur);
-                mgt.ref--;
-                advfs_write_block_mgt(advfs, &mgt, cur);
-                if ( mgt.ref == 0 ) {
-                    /* Release this block */
-                    _block_delete(advfs, cur);
-                    advfs_free_block(advfs, cur);
-                }
-            }
-            /* Referencde the new block */
-            advfs_read_block_mgt(advfs, &mgt, b);
-            mgt.ref++;
-            advfs_write_block_mgt(advfs, &mgt, b);
+        if ( cur == b ) {
+            /* Not changed */
+            return 0;
         }
+        /* Referencde the new block */
+        advfs_read_block_mgt(advfs, &mgt, b);
+        mgt.ref++;
+        advfs_write_block_mgt(advfs, &mgt, b);
     } else {
-        /* Not found, then allocate a new block, then write the content */
-        b = advfs_alloc_block(advfs);
-        advfs_write_raw_block(advfs, buf, b);
+        /* Not found, then store the content compressed if enabled, or
+           allocate a new block, then write the content */
+        memset(&mgt, 0, sizeof(advfs_block_mgt_t));
+        b = 0;
+        if ( 0 != c ) {
+            /* A run of the blocks of the larger class, not compressed */
+            b = _alloc_class_block(advfs, c);
+            if ( 0 == b ) {
+                return -1;
+            }
+            for ( i = 0; i < ADVFS_BCLASS_BLOCKS(c); i++ ) {
+                advfs_write_raw_block(advfs,
+                                      (uint8_t *)buf + i * ADVFS_BLOCK_SIZE,
+                                      b + i);
+            }
+            mgt.bclass = c;
+        } else if ( 0 != advfs->superblock->n_zblocks ) {
+            b = _zblock_store(advfs, inr, buf, tail, &mgt);
+        }
+        if ( 0 == b ) {
+            b = advfs_alloc_block(advfs);
+            if ( 0 == b ) {
+                return -1;
+            }
+            advfs_write_raw_block(advfs, buf, b);
+        }
         memcpy(mgt.hash, hash, sizeof(mgt.hash));
         mgt.ref = 1;
         mgt.left = 0;
         mgt.right = 0;
+        mgt.type = ADVFS_BLOCK_DATA;
+        advfs_write_block_mgt(advfs, &mgt, b);
         /* Add to the tree */
-        _block_add(advfs, b);
-
-        if ( cur != 0 ) {
-            /* Unreference and free if needed */
-            advfs_read_block_mgt(advfs, &mgt, cur);
-            mgt.ref--;
-            advfs_write_block_mgt(advfs, &mgt, cur);
-            if ( mgt.ref == 0 ) {
-                /* Release this block */
-                _block_delete(advfs, cur);
-                advfs_free_block(advfs, cur);
-            }
+        _block_add(advfs, c, b);
+    }
+
+    /* Unreference and free the old block if needed */
+    if ( cur != 0 ) {
+        _unref_phys_block(advfs, cur);
+    }
+
+    /* Update the block map */
+    _update_block_map(advfs, inr, pos, b);
+
+    return 0;
+}
+
+/*
+ * Write a metadata block.  Metadata blocks bypass the hashing and the dedup
+ * index, and are updated in place unless shared.
+ */
+int
+advfs_write_meta_block(advfs_t *advfs, uint64_t inr, void *buf, uint64_t pos)
+{
+    uint64_t b;
+    uint64_t cur;
+    advfs_block_mgt_t mgt;
+
+    /* Resolve the physical block corresponding to the logical block */
+    cur = _resolve_block_map(advfs, inr, pos);
+    if ( cur != 0 ) {
+        advfs_read_block_mgt(advfs, &mgt, cur);
+        if ( ADVFS_BLOCK_META == mgt.type && 1 == mgt.ref ) {
+            /* Update in place */
+            advfs_write_raw_block(advfs, buf, cur);
+            advfs_journal_touch(advfs, inr);
+            return 0;
         }
+    }
+
+    /* Allocate a new metadata block */
+    b = advfs_alloc_meta_block(advfs);
+    if ( 0 == b ) {
+        return -1;
+    }
+    advfs_write_raw_block(advfs, buf, b);
 
-        /* Update the block map */
-        _update_block_map(advfs, inr, pos, b);
+    /* Unreference and free the old block if needed */
+    if ( cur != 0 ) {
+        _unref_phys_block(advfs, cur);
     }
 
+    /* Update the block map */
+    _update_block_map(advfs, inr, pos, b);
+
     return 0;
 }
 
+/*
+ * Map the stored block with the hash value to the position; returns -1 if
+ * no such block is stored
+ */
+int
+advfs_map_block(advfs_t *advfs, uint64_t inr, const unsigned char *hash,
+                uint64_t pos)
+{
+    uint64_t b;
+    uint64_t cur;
+
+    b = _block_search(advfs, _inode_bclass(advfs, inr), hash);
+    if ( 0 == b ) {
+        return -1;
+    }
+    cur = _resolve_block_map(advfs, inr, pos);
+    if ( cur == b ) {
+        return 0;
+    }
+    _ref_phys_block(advfs, b);
+    if ( cur != 0 ) {
+        _unref_phys_block(advfs, cur);
+    }
+    _update_block_map(advfs, inr, pos, b);
+
+    return 0;
+}
+
+/*
+ * Look up the stored block with the hash value in all the block size
+ * classes; returns 0 if not found
+ */
+uint64_t
+advfs_block_lookup(advfs_t *advfs, const unsigned char *hash)
+{
+    uint64_t b;
+    int c;
+
+    for ( c = 0; c < ADVFS_BCLASS_NUM; c++ ) {
+        b = _block_search(advfs, c, hash);
+        if ( 0 != b ) {
+            return b;
+        }
+    }
+
+    return 0;
+}
 
 /*
  * Unreference the corresponding block
@@ -425,25 +927,248 @@ int
 advfs_unref_block(advfs_t *advfs, uint64_t inr, uint64_t pos)
 {
     uint64_t cur;
-    advfs_block_mgt_t mgt;
-    advfs_inode_t inode;
-
-    /* Read the inode corresponding to inr */
-    advfs_read_inode(advfs, &inode, inr);
 
     /* Resolve the physical block corresponding to the logical block */
     cur = _resolve_block_map(advfs, inr, pos);
 
     if ( cur != 0 ) {
-        advfs_read_block_mgt(advfs, &mgt, cur);
-        mgt.ref--;
-        advfs_write_block_mgt(advfs, &mgt, cur);
-        if ( mgt.ref == 0 ) {
-            /* Release this block */
-            _block_delete(advfs, cur);
-            advfs_free_block(advfs, cur);
+        _unref_phys_block(advfs, cur);
+    }
+
+    return 0;
+}
+
+/*
+ * Unreference the corresponding block and make it a hole
+ */
+int
+advfs_punch_block(advfs_t *advfs, uint64_t inr, uint64_t pos)
+{
+    uint64_t cur;
+
+    cur = _resolve_block_map(advfs, inr, pos);
+    if ( cur == 0 ) {
+        /* Already a hole */
+        return 0;
+    }
+    _unref_phys_block(advfs, cur);
+
+    /* Update the block map */
+    _update_block_map(advfs, inr, pos, 0);
+
+    return 0;
+}
+
+/*
+ * Resolve the physical block of a logical block (0 for a hole)
+ */
+uint64_t
+advfs_resolve_block(advfs_t *advfs, uint64_t inr, uint64_t pos)
+{
+    return _resolve_block_map(advfs, inr, pos);
+}
+
+/*
+ * Unreference a block by its number, e.g., a block of a table linked from an
+ * inode
+ */
+void
+advfs_release_block(advfs_t *advfs, uint64_t b)
+{
+    _unref_phys_block(advfs, b);
+}
+
+/*
+ * Release the extent table of a chunked file.  The table shared by clones
+ * holds the reference on its first block only.
+ */
+void
+advfs_free_extents(advfs_t *advfs, uint64_t b)
+{
+    advfs_extent_block_t eb;
+    advfs_block_mgt_t mgt;
+    uint64_t next;
+
+    while ( 0 != b ) {
+        advfs_read_block_mgt(advfs, &mgt, b);
+        advfs_read_raw_block(advfs, &eb, b);
+        next = (1 == mgt.ref) ? eb.next : 0;
+        _unref_phys_block(advfs, b);
+        b = next;
+    }
+}
+
+/*
+ * Count the blocks of the chain needed to map nb blocks
+ */
+uint64_t
+advfs_chain_count(uint64_t nb)
+{
+    uint64_t n;
+
+    if ( nb < ADVFS_INODE_BLOCKPTR ) {
+        return 0;
+    }
+    n = ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1;
+
+    return (nb - (ADVFS_INODE_BLOCKPTR - 1) + n - 1) / n;
+}
+
+/*
+ * Share the blocks mapped by the inode with a copy of the inode, which is
+ * not in the inode table (e.g., in a snapshot).  The blocks are referenced,
+ * and the copy gets its own chain of the block map.  Nothing is left
+ * referenced on failure.
+ */
+int
+advfs_share_block_map(advfs_t *advfs, advfs_inode_t *inode)
+{
+    uint64_t buf[ADVFS_BLOCK_SIZE / sizeof(uint64_t)];
+    uint64_t pbuf[ADVFS_BLOCK_SIZE / sizeof(uint64_t)];
+    uint64_t per;
+    uint64_t done;
+    uint64_t n;
+    uint64_t i;
+    uint64_t b;
+    uint64_t nb;
+    uint64_t next;
+    uint64_t prev;
+
+    per = ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1;
+    n = inode->attr.n_blocks;
+    for ( i = 0; i < ADVFS_INODE_BLOCKPTR - 1 && i < n; i++ ) {
+        if ( 0 != inode->blocks[i] ) {
+            _ref_phys_block(advfs, inode->blocks[i]);
         }
     }
+    n -= i;
+    done = i;
+
+    /* Copy the chain */
+    b = (n > 0) ? inode->blocks[ADVFS_INODE_BLOCKPTR - 1] : 0;
+    prev = 0;
+    while ( 0 != b ) {
+        advfs_read_raw_block(advfs, buf, b);
+        for ( i = 0; i < per && i < n; i++ ) {
+            if ( 0 != buf[i] ) {
+                _ref_phys_block(advfs, buf[i]);
+            }
+        }
+        n -= i;
+        next = (n > 0) ? buf[per] : 0;
+
+        nb = advfs_alloc_meta_block(advfs);
+        if ( 0 == nb ) {
+            /* Release the references of this block, and the copy so far */
+            while ( i > 0 ) {
+                if ( 0 != buf[--i] ) {
+                    _unref_phys_block(advfs, buf[i]);
+                }
+            }
+            inode->attr.n_blocks = done;
+            inode->attr.extents = 0;
+            advfs_release_block_map(advfs, inode);
+            return -1;
+        }
+        done += i;
+        if ( 0 == prev ) {
+            inode->blocks[ADVFS_INODE_BLOCKPTR - 1] = nb;
+        } else {
+            advfs_read_raw_block(advfs, pbuf, prev);
+            pbuf[per] = nb;
+            advfs_write_raw_block(advfs, pbuf, prev);
+        }
+        buf[per] = 0;
+        advfs_write_raw_block(advfs, buf, nb);
+        prev = nb;
+        b = next;
+    }
+
+    /* The extent table is shared by its first block */
+    if ( 0 != inode->attr.extents ) {
+        _ref_phys_block(advfs, inode->attr.extents);
+    }
+
+    return 0;
+}
+
+/*
+ * Release the blocks mapped by a copy of an inode made by
+ * advfs_share_block_map(), and its chain of the block map
+ */
+void
+advfs_release_block_map(advfs_t *advfs, const advfs_inode_t *inode)
+{
+    uint64_t buf[ADVFS_BLOCK_SIZE / sizeof(uint64_t)];
+    uint64_t per;
+    uint64_t n;
+    uint64_t i;
+    uint64_t b;
+    uint64_t next;
+
+    per = ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1;
+    n = inode->attr.n_blocks;
+    for ( i = 0; i < ADVFS_INODE_BLOCKPTR - 1 && i < n; i++ ) {
+        if ( 0 != inode->blocks[i] ) {
+            _unref_phys_block(advfs, inode->blocks[i]);
+        }
+    }
+    n -= i;
+
+    b = (n > 0) ? inode->blocks[ADVFS_INODE_BLOCKPTR - 1] : 0;
+    while ( 0 != b ) {
+        advfs_read_raw_block(advfs, buf, b);
+        for ( i = 0; i < per && i < n; i++ ) {
+            if ( 0 != buf[i] ) {
+                _unref_phys_block(advfs, buf[i]);
+            }
+        }
+        n -= i;
+        next = (n > 0) ? buf[per] : 0;
+        advfs_free_block(advfs, b);
+        b = next;
+    }
+
+    if ( 0 != inode->attr.extents ) {
+        advfs_free_extents(advfs, inode->attr.extents);
+    }
+}
+
+/*
+ * Map the logical block pos of the inode inr to the physical block of the
+ * logical block spos of the inode sinr, without copying the content
+ */
+int
+advfs_clone_block(advfs_t *advfs, uint64_t inr, uint64_t pos, uint64_t sinr,
+                  uint64_t spos)
+{
+    uint64_t b;
+    uint64_t cur;
+    advfs_block_mgt_t mgt;
+
+    b = _resolve_block_map(advfs, sinr, spos);
+    cur = _resolve_block_map(advfs, inr, pos);
+    if ( b == cur ) {
+        return 0;
+    }
+
+    if ( b != 0 ) {
+        /* Reference the source block; only data blocks can be shared */
+        advfs_read_block_mgt(advfs, &mgt, b);
+        if ( ADVFS_BLOCK_DATA != mgt.type ) {
+            return -1;
+        }
+        mgt.ref++;
+        advfs_write_block_mgt(advfs, &mgt, b);
+    }
+
+    /* Unreference and free the old block if needed */
+    if ( cur != 0 ) {
+        _unref_phys_block(advfs, cur);
+    }
+
+    /* Update the block map */
+    _update_block_map(advfs, inr, pos, b);
 
     return 0;
 }
@@ -455,6 +1180,8 @@ uint64_t
 advfs_alloc_block(advfs_t *advfs)
 {
     uint64_t b;
+    uint64_t i;
+    int c;
     advfs_free_list_t *fl;
     advfs_superblock_t sb;
     uint8_t buf[ADVFS_BLOCK_SIZE];
@@ -464,18 +1191,39 @@ advfs_alloc_block(advfs_t *advfs)
 
     /* Read the first entry of the freelist */
     b = sb.freelist;
-    if ( 0 == b ) {
-        /* No entry remaining */
-        return 0;
+    if ( 0 != b ) {
+        /* Read from the free block */
+        advfs_read_raw_block(advfs, buf, b);
+        fl = (advfs_free_list_t *)buf;
+        sb.freelist = fl->next;
+    } else if ( sb.brk < sb.ptr_block + sb.n_blocks ) {
+        /* Never allocated block */
+        b = sb.brk++;
+    } else {
+        /* Split a free run of a larger class */
+        for ( c = 1; c < ADVFS_BCLASS_NUM; c++ ) {
+            if ( 0 != sb.class_freelist[c] ) {
+                break;
+            }
+        }
+        if ( c >= ADVFS_BCLASS_NUM ) {
+            /* No entry remaining */
+            return 0;
+        }
+        b = sb.class_freelist[c];
+        advfs_read_raw_block(advfs, buf, b);
+        fl = (advfs_free_list_t *)buf;
+        sb.class_freelist[c] = fl->next;
+        for ( i = ADVFS_BCLASS_BLOCKS(c) - 1; i > 0; i-- ) {
+            fl->next = sb.freelist;
+            advfs_write_raw_block(advfs, buf, b + i);
+            sb.freelist = b + i;
+        }
     }
 
-    /* Read from the free block */
-    advfs_read_raw_block(advfs, buf, b);
-    fl = (advfs_free_list_t *)buf;
-
     /* Update the superblock */
-    sb.freelist = fl->next;
     sb.n_block_used++;
+    advfs_log_mark_free(advfs, b, 1, 0);
 
     /* Write back the super block */
     advfs_write_superblock(advfs, &sb);
@@ -483,6 +1231,28 @@ advfs_alloc_block(advfs_t *advfs)
     return b;
 }
 
+/*
+ * Allocate a new metadata block
+ */
+uint64_t
+advfs_alloc_meta_block(advfs_t *advfs)
+{
+    uint64_t b;
+    advfs_block_mgt_t mgt;
+
+    b = advfs_alloc_block(advfs);
+    if ( 0 == b ) {
+        return 0;
+    }
+
+    memset(&mgt, 0, sizeof(advfs_block_mgt_t));
+    mgt.ref = 1;
+    mgt.type = ADVFS_BLOCK_META;
+    advfs_write_block_mgt(advfs, &mgt, b);
+
+    return b;
+}
+
 /*
  * Release a block
  */
@@ -493,6 +1263,8 @@ advfs_free_block(advfs_t *advfs, uint64_t b)
     advfs_superblock_t sb;
     uint8_t buf[ADVFS_BLOCK_SIZE];
 
+    _clear_block_ref(advfs, b);
+
     /* Read the superblock */
     advfs_read_superblock(advfs, &sb);
 
@@ -503,11 +1275,31 @@ advfs_free_block(advfs_t *advfs, uint64_t b)
     /* Update the superblock */
     sb.freelist = b;
     sb.n_block_used--;
+    advfs_log_mark_free(advfs, b, 1, 1);
 
     /* Write back the superblock */
     advfs_write_superblock(advfs, &sb);
 }
 
+/*
+ * Resolve the block including the inode; the inode table of the live tree,
+ * or the copy of the snapshot (only the cached digest is updated there)
+ */
+static uint64_t
+_inode_block(const advfs_superblock_t *sb, uint64_t nr)
+{
+    uint64_t s;
+    uint64_t b;
+
+    s = nr / ADVFS_INODE_NUM;
+    b = (sizeof(advfs_inode_t) * (nr % ADVFS_INODE_NUM)) / ADVFS_BLOCK_SIZE;
+    if ( 0 == s ) {
+        return sb->ptr_inode + b;
+    }
+
+    return sb->snapshots[s - 1].table[b];
+}
+
 /*
  * Read an inode
  */
@@ -520,12 +1312,36 @@ advfs_read_inode(advfs_t *advfs, advfs_inode_t *inode, uint64_t nr)
     advfs_superblock_t sb;
     uint8_t buf[ADVFS_BLOCK_SIZE];
 
+    if ( nr >= ADVFS_VINODE_BLOCK ) {
+        /* A stored block as a file of the size of its class */
+        b = nr - ADVFS_VINODE_BLOCK;
+        memset(inode, 0, sizeof(advfs_inode_t));
+        inode->attr.type = ADVFS_REGULAR_FILE;
+        inode->attr.mode = 0444;
+        inode->attr.size = ADVFS_BCLASS_SIZE(_get_block_mgt(advfs, b)->bclass);
+        inode->attr.n_blocks = 1;
+        inode->attr.flags
+            = (_get_block_mgt(advfs, b)->bclass << ADVFS_INODE_BCLASS_SHIFT)
+            | ADVFS_INODE_BCLASS_SET;
+        inode->blocks[0] = b;
+        return 0;
+    } else if ( nr >= ADVFS_VINODE_FILE ) {
+        /* Alias of a live file */
+        return advfs_read_inode(advfs, inode, nr - ADVFS_VINODE_FILE);
+    } else if ( nr >= ADVFS_VINODE_CTL ) {
+        /* Virtual directory */
+        memset(inode, 0, sizeof(advfs_inode_t));
+        inode->attr.type = ADVFS_DIR;
+        inode->attr.mode = 0555;
+        return 0;
+    }
+
     /* Read the superblock */
     advfs_read_superblock(advfs, &sb);
 
     /* Resolve the position */
-    b = sb.ptr_inode + (sizeof(advfs_inode_t) * nr) / ADVFS_BLOCK_SIZE;
-    off = (sizeof(advfs_inode_t) * nr) % ADVFS_BLOCK_SIZE;
+    b = _inode_block(&sb, nr);
+    off = (sizeof(advfs_inode_t) * (nr % ADVFS_INODE_NUM)) % ADVFS_BLOCK_SIZE;
 
     /* Assert the size to prevent buffer overflow */
     assert( off + sizeof(advfs_inode_t) <= ADVFS_BLOCK_SIZE );
@@ -550,12 +1366,20 @@ advfs_write_inode(advfs_t *advfs, const advfs_inode_t *inode, uint64_t nr)
     advfs_superblock_t sb;
     uint8_t buf[ADVFS_BLOCK_SIZE];
 
+    if ( nr >= ADVFS_VINODE_FILE && nr < ADVFS_VINODE_BLOCK ) {
+        /* Alias of a live file (e.g., the digest cached on read) */
+        return advfs_write_inode(advfs, inode, nr - ADVFS_VINODE_FILE);
+    } else if ( nr >= ADVFS_VINODE_CTL ) {
+        return -1;
+    }
+    advfs_journal_touch(advfs, nr);
+
     /* Read the superblock */
     advfs_read_superblock(advfs, &sb);
 
     /* Resolve the position */
-    b = sb.ptr_inode + (sizeof(advfs_inode_t) * nr) / ADVFS_BLOCK_SIZE;
-    off = (sizeof(advfs_inode_t) * nr) % ADVFS_BLOCK_SIZE;
+    b = _inode_block(&sb, nr);
+    off = (sizeof(advfs_inode_t) * (nr % ADVFS_INODE_NUM)) % ADVFS_BLOCK_SIZE;
 
     /* Assert the size to prevent buffer overflow */
     assert( off + sizeof(advfs_inode_t) <= ADVFS_BLOCK_SIZE );
@@ -634,6 +1458,280 @@ advfs_write_block_mgt(advfs_t *advfs, const advfs_block_mgt_t *mgt, uint64_t nr)
     return 0;
 }
 
+/*
+ * Combine two nodes of the Merkle tree
+ */
+static void
+_merkle_node(unsigned char *node, const unsigned char *left,
+             const unsigned char *right)
+{
+    unsigned char buf[1 + SHA384_DIGEST_LENGTH * 2];
+
+    buf[0] = 0x01;
+    memcpy(buf + 1, left, SHA384_DIGEST_LENGTH);
+    memcpy(buf + 1 + SHA384_DIGEST_LENGTH, right, SHA384_DIGEST_LENGTH);
+    SHA384(buf, sizeof(buf), node);
+}
+
+/*
+ * Merkle tree under construction: the stack of the complete subtrees and
+ * their # of leaves
+ */
+struct _merkle {
+    unsigned char stack[64][SHA384_DIGEST_LENGTH];
+    uint64_t leaves[64];
+    int sp;
+};
+
+/*
+ * Add a leaf to the Merkle tree
+ */
+static void
+_merkle_push(struct _merkle *m, const unsigned char *leaf)
+{
+    memcpy(m->stack[m->sp], leaf, SHA384_DIGEST_LENGTH);
+    m->leaves[m->sp] = 1;
+    m->sp++;
+    /* Merge the subtrees of the same size */
+    while ( m->sp >= 2 && m->leaves[m->sp - 1] == m->leaves[m->sp - 2] ) {
+        _merkle_node(m->stack[m->sp - 2], m->stack[m->sp - 2],
+                     m->stack[m->sp - 1]);
+        m->leaves[m->sp - 2] *= 2;
+        m->sp--;
+    }
+}
+
+/*
+ * Add the leaves of a chunked file; the chunks are not at the offsets of
+ * the 4 KiB blocks of the digest, so the content is read in the order of
+ * the extents and hashed
+ */
+static void
+_merkle_push_extents(advfs_t *advfs, uint64_t inr, uint64_t b,
+                     struct _merkle *m)
+{
+    advfs_extent_block_t eb;
+    unsigned char leaf[SHA384_DIGEST_LENGTH];
+    uint8_t buf[ADVFS_BLOCK_SIZE];
+    uint8_t block[ADVFS_BLOCK_SIZE];
+    uint64_t in;
+    uint64_t len;
+    size_t fill;
+    size_t n;
+    uint64_t i;
+
+    fill = 0;
+    for ( ; 0 != b; b = eb.next ) {
+        advfs_read_raw_block(advfs, &eb, b);
+        for ( i = 0; i < eb.n; i++ ) {
+            len = eb.e[i].len;
+            for ( in = 0; in < len; in += n ) {
+                if ( 0 == in % ADVFS_BLOCK_SIZE ) {
+                    advfs_read_block(advfs, inr, block,
+                                     eb.e[i].pos + in / ADVFS_BLOCK_SIZE);
+                }
+                n = ADVFS_BLOCK_SIZE - in % ADVFS_BLOCK_SIZE;
+                if ( n > len - in ) {
+                    n = len - in;
+                }
+                if ( n > ADVFS_BLOCK_SIZE - fill ) {
+                    n = ADVFS_BLOCK_SIZE - fill;
+                }
+                memcpy(buf + fill, block + in % ADVFS_BLOCK_SIZE, n);
+                fill += n;
+                if ( ADVFS_BLOCK_SIZE == fill ) {
+                    SHA384(buf, ADVFS_BLOCK_SIZE, leaf);
+                    _merkle_push(m, leaf);
+                    fill = 0;
+                }
+            }
+        }
+    }
+    if ( fill > 0 ) {
+        /* The last block padded with zeros */
+        memset(buf + fill, 0, ADVFS_BLOCK_SIZE - fill);
+        SHA384(buf, ADVFS_BLOCK_SIZE, leaf);
+        _merkle_push(m, leaf);
+    }
+}
+
+/*
+ * Calculate the whole-file digest (see ADVFS_XATTR_DIGEST) from the hashes
+ * of the blocks without reading the content (but for a chunked file); the
+ * result is cached in the inode until the block map or the size is changed
+ */
+int
+advfs_file_digest(advfs_t *advfs, uint64_t inr, unsigned char *digest)
+{
+    advfs_inode_t inode;
+    advfs_block_mgt_t mgt;
+    struct _merkle m;
+    unsigned char zero[SHA384_DIGEST_LENGTH];
+    unsigned char leaf[SHA384_DIGEST_LENGTH];
+    uint8_t buf[ADVFS_BLOCK_SIZE];
+    uint64_t nb;
+    uint64_t pos;
+    uint64_t b;
+    int i;
+    int c;
+
+    advfs_read_inode(advfs, &inode, inr);
+    if ( inode.attr.flags & ADVFS_INODE_DIGEST ) {
+        memcpy(digest, inode.attr.digest, SHA384_DIGEST_LENGTH);
+        return 0;
+    }
+
+    /* Hash of a hole */
+    memset(buf, 0, ADVFS_BLOCK_SIZE);
+    SHA384(buf, ADVFS_BLOCK_SIZE, zero);
+
+    m.sp = 0;
+    if ( 0 != inode.attr.extents ) {
+        _merkle_push_extents(advfs, inr, inode.attr.extents, &m);
+    } else {
+        nb = (inode.attr.size + ADVFS_BLOCK_SIZE - 1) / ADVFS_BLOCK_SIZE;
+        c = ADVFS_INODE_BCLASS(&inode);
+        for ( pos = 0; pos < nb; pos++ ) {
+            b = ((pos >> ADVFS_BCLASS_SHIFT(c)) < inode.attr.n_blocks)
+                ? _resolve_block_map(advfs, inr, pos >> ADVFS_BCLASS_SHIFT(c))
+                : 0;
+            if ( 0 == b ) {
+                memcpy(leaf, zero, SHA384_DIGEST_LENGTH);
+            } else if ( 0 != c ) {
+                /* The leaves of the larger blocks are hashed here */
+                advfs_read_raw_block(advfs, buf,
+                                     b + (pos & (ADVFS_BCLASS_BLOCKS(c) - 1)));
+                SHA384(buf, ADVFS_BLOCK_SIZE, leaf);
+            } else {
+                advfs_read_block_mgt(advfs, &mgt, b);
+                memcpy(leaf, mgt.hash, SHA384_DIGEST_LENGTH);
+            }
+            _merkle_push(&m, leaf);
+        }
+    }
+    /* Merge the rest from the smallest one */
+    while ( m.sp >= 2 ) {
+        _merkle_node(m.stack[m.sp - 2], m.stack[m.sp - 2], m.stack[m.sp - 1]);
+        m.sp--;
+    }
+
+    /* Digest of the size and the root */
+    for ( i = 0; i < 8; i++ ) {
+        buf[i] = (inode.attr.size >> (i * 8)) & 0xff;
+    }
+    if ( m.sp > 0 ) {
+        memcpy(buf + 8, m.stack[0], SHA384_DIGEST_LENGTH);
+        SHA384(buf, 8 + SHA384_DIGEST_LENGTH, digest);
+    } else {
+        SHA384(buf, 8, digest);
+    }
+
+    /* Cache */
+    memcpy(inode.attr.digest, digest, SHA384_DIGEST_LENGTH);
+    inode.attr.flags |= ADVFS_INODE_DIGEST;
+    advfs_write_inode(advfs, &inode, inr);
+
+    return 0;
+}
+
+/*
+ * Bucket of a digest in the whole-file digest index
+ */
+static uint64_t
+_digest_bucket(const unsigned char *digest)
+{
+    uint64_t h;
+    int i;
+
+    h = 0;
+    for ( i = 0; i < 8; i++ ) {
+        h = (h << 8) | digest[i];
+    }
+
+    return h % ADVFS_DIGEST_BUCKETS;
+}
+
+/*
+ * Add a regular file to the whole-file digest index with its current digest
+ */
+void
+advfs_digest_index_add(advfs_t *advfs, uint64_t inr)
+{
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    uint64_t h;
+
+    advfs_digest_index_remove(advfs, inr);
+
+    advfs_file_digest(advfs, inr, digest);
+    h = _digest_bucket(digest);
+    advfs->digest_next[inr] = advfs->digest_bucket[h];
+    advfs->digest_bucket[h] = inr + 1;
+    advfs->digest_indexed[inr] = 1;
+}
+
+/*
+ * Remove an inode from the whole-file digest index
+ */
+void
+advfs_digest_index_remove(advfs_t *advfs, uint64_t inr)
+{
+    uint64_t *link;
+    uint64_t h;
+
+    if ( !advfs->digest_indexed[inr] ) {
+        return;
+    }
+
+    /* The digest may have been changed since indexed, so search all */
+    for ( h = 0; h < ADVFS_DIGEST_BUCKETS; h++ ) {
+        link = &advfs->digest_bucket[h];
+        while ( 0 != *link ) {
+            if ( *link == inr + 1 ) {
+                *link = advfs->digest_next[inr];
+                advfs->digest_next[inr] = 0;
+                advfs->digest_indexed[inr] = 0;
+                return;
+            }
+            link = &advfs->digest_next[*link - 1];
+        }
+    }
+}
+
+/*
+ * Look up a regular file with the digest.  The index is not updated on every
+ * write, so the entries whose content has been changed since are dropped
+ * here.
+ */
+int
+advfs_digest_index_lookup(advfs_t *advfs, const unsigned char *digest,
+                          uint64_t *inr)
+{
+    advfs_inode_t inode;
+    uint64_t *link;
+    uint64_t cur;
+
+    link = &advfs->digest_bucket[_digest_bucket(digest)];
+    while ( 0 != *link ) {
+        cur = *link - 1;
+        advfs_read_inode(advfs, &inode, cur);
+        if ( inode.attr.type != ADVFS_REGULAR_FILE
+             || !(inode.attr.flags & ADVFS_INODE_DIGEST) ) {
+            /* Stale */
+            *link = advfs->digest_next[cur];
+            advfs->digest_next[cur] = 0;
+            advfs->digest_indexed[cur] = 0;
+            continue;
+        }
+        if ( 0 == memcmp(inode.attr.digest, digest, SHA384_DIGEST_LENGTH) ) {
+            *inr = cur;
+            return 0;
+        }
+        link = &advfs->digest_next[cur];
+    }
+
+    return -1;
+}
+
 /*
  * Local variables:
  * tab-width: 4
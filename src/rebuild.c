@@ -0,0 +1,622 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "advfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * The dedup tree and the reference counters are derived from the block maps
+ * and are not trusted from the image; the links of the tree are not even
+ * committed.  At mount, the block maps of the inodes of the live tree and
+ * of the snapshots are scanned in parallel, each thread counting the
+ * references in its own array, and the counters are corrected from the sum.
+ * The blocks no longer referenced are released; in a log-structured image,
+ * whose free list links are not logged, the free lists are rebuilt from
+ * the unreferenced blocks instead.  Then the tree of each
+ * block size class is loaded at once from the sorted array of the hash
+ * values of the data blocks.
+ */
+
+/* Worker scanning a range of the inodes */
+struct _rebuild_worker {
+    advfs_t *advfs;
+    pthread_t thread;
+    /* Inodes [from, to) numbered across the inode tables */
+    uint64_t from;
+    uint64_t to;
+    /* # of references to each block id, and the first blocks of the
+       extent tables */
+    uint32_t *ref;
+    uint8_t *exthead;
+    /* # of inodes in use */
+    uint64_t inodes;
+};
+
+/* Hash value of a data block for the bulk load */
+struct _rebuild_key {
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    uint64_t b;
+};
+
+/*
+ * Monotonic clock in nanoseconds
+ */
+static uint64_t
+_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Whether the block id is allocatable; a corrupt link is not followed
+ */
+static int
+_rebuild_valid(advfs_t *advfs, uint64_t b)
+{
+    advfs_superblock_t *sb;
+
+    sb = advfs->superblock;
+    if ( b >= sb->ptr_block && b < sb->brk ) {
+        return 1;
+    }
+
+    return b >= ADVFS_ZBLOCK_BASE && b < ADVFS_ZBLOCK_BASE + sb->n_zblocks;
+}
+
+/*
+ * Whether the inode table is in use; the live one, or of a snapshot
+ */
+static int
+_rebuild_table(advfs_t *advfs, uint64_t s)
+{
+    return 0 == s || 0 != advfs->superblock->snapshots[s - 1].table[0];
+}
+
+/*
+ * Count the references of the inode; the mapped blocks, the chain of the
+ * block map of its own, and the first block of the extent table
+ */
+static void
+_rebuild_scan_inode(struct _rebuild_worker *w, const advfs_inode_t *e)
+{
+    uint64_t buf[ADVFS_BLOCK_SIZE / sizeof(uint64_t)];
+    advfs_t *advfs;
+    uint64_t per;
+    uint64_t n;
+    uint64_t i;
+    uint64_t b;
+
+    advfs = w->advfs;
+    per = ADVFS_BLOCK_SIZE / sizeof(uint64_t) - 1;
+    n = e->attr.n_blocks;
+    for ( i = 0; i < ADVFS_INODE_BLOCKPTR - 1 && i < n; i++ ) {
+        if ( _rebuild_valid(advfs, e->blocks[i]) ) {
+            w->ref[e->blocks[i]]++;
+        }
+    }
+    n -= i;
+
+    b = (n > 0) ? e->blocks[ADVFS_INODE_BLOCKPTR - 1] : 0;
+    while ( b < ADVFS_BLOCK_NUM && _rebuild_valid(advfs, b) ) {
+        w->ref[b]++;
+        advfs_read_raw_block(advfs, buf, b);
+        for ( i = 0; i < per && i < n; i++ ) {
+            if ( _rebuild_valid(advfs, buf[i]) ) {
+                w->ref[buf[i]]++;
+            }
+        }
+        n -= i;
+        b = (n > 0) ? buf[per] : 0;
+    }
+
+    b = e->attr.extents;
+    if ( b < ADVFS_BLOCK_NUM && _rebuild_valid(advfs, b) ) {
+        w->ref[b]++;
+        w->exthead[b] = 1;
+    }
+}
+
+/*
+ * Worker thread
+ */
+static void *
+_rebuild_worker(void *arg)
+{
+    struct _rebuild_worker *w;
+    advfs_inode_t e;
+    uint64_t nr;
+
+    w = arg;
+    for ( nr = w->from; nr < w->to; nr++ ) {
+        if ( !_rebuild_table(w->advfs, nr / ADVFS_INODE_NUM) ) {
+            /* Skip the table */
+            nr += ADVFS_INODE_NUM - 1 - nr % ADVFS_INODE_NUM;
+            continue;
+        }
+        advfs_read_inode(w->advfs, &e, nr);
+        if ( ADVFS_UNUSED != e.attr.type ) {
+            _rebuild_scan_inode(w, &e);
+            w->inodes++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Count the references in parallel, and sum them up in the array of the
+ * first worker
+ */
+static int
+_rebuild_count(advfs_t *advfs, struct _rebuild_worker *w, int nw,
+               uint64_t nids)
+{
+    uint64_t total;
+    uint64_t b;
+    int started[ADVFS_REBUILD_THREADS_MAX];
+    int i;
+
+    total = ADVFS_INODE_NUM * (ADVFS_SNAPSHOT_NUM + 1);
+    for ( i = 0; i < nw; i++ ) {
+        w[i].advfs = advfs;
+        w[i].from = total * i / nw;
+        w[i].to = total * (i + 1) / nw;
+        w[i].ref = calloc(nids, sizeof(uint32_t));
+        w[i].exthead = calloc(ADVFS_BLOCK_NUM, sizeof(uint8_t));
+        w[i].inodes = 0;
+        if ( NULL == w[i].ref || NULL == w[i].exthead ) {
+            return -1;
+        }
+    }
+
+    /* The first range is scanned by this thread; a worker that cannot be
+       started is run here, too */
+    for ( i = 1; i < nw; i++ ) {
+        started[i] = (0 == pthread_create(&w[i].thread, NULL,
+                                          _rebuild_worker, &w[i]));
+        if ( !started[i] ) {
+            _rebuild_worker(&w[i]);
+        }
+    }
+    _rebuild_worker(&w[0]);
+    for ( i = 1; i < nw; i++ ) {
+        if ( started[i] ) {
+            pthread_join(w[i].thread, NULL);
+        }
+        for ( b = 0; b < nids; b++ ) {
+            w[0].ref[b] += w[i].ref[b];
+        }
+        for ( b = 0; b < ADVFS_BLOCK_NUM; b++ ) {
+            w[0].exthead[b] |= w[i].exthead[b];
+        }
+        w[0].inodes += w[i].inodes;
+    }
+
+    return 0;
+}
+
+/*
+ * Mark the blocks and the compressed block ids on the free lists.  The
+ * links of the free lists of the blocks are not in a log-structured image;
+ * the lists are rebuilt from the references instead.
+ */
+static void
+_rebuild_mark_free(advfs_t *advfs, uint8_t *isfree)
+{
+    advfs_superblock_t *sb;
+    advfs_free_list_t *fl;
+    advfs_block_mgt_t mgt;
+    uint64_t b;
+    uint64_t i;
+    int c;
+
+    sb = advfs->superblock;
+    for ( c = 0; c < ADVFS_BCLASS_NUM && !advfs->log; c++ ) {
+        b = (0 == c) ? sb->freelist : sb->class_freelist[c];
+        while ( b < ADVFS_BLOCK_NUM && _rebuild_valid(advfs, b)
+                && !isfree[b] ) {
+            for ( i = 0; i < ADVFS_BCLASS_BLOCKS(c)
+                      && b + i < ADVFS_BLOCK_NUM; i++ ) {
+                isfree[b + i] = 1;
+            }
+            fl = (void *)((uint8_t *)sb + b * ADVFS_BLOCK_SIZE);
+            b = fl->next;
+        }
+    }
+
+    b = sb->zfreelist;
+    while ( b >= ADVFS_ZBLOCK_BASE && _rebuild_valid(advfs, b)
+            && !isfree[b] ) {
+        isfree[b] = 1;
+        advfs_read_block_mgt(advfs, &mgt, b);
+        b = mgt.left;
+    }
+}
+
+/*
+ * Rebuild the free lists of a log-structured image.  The blocks neither
+ * referenced nor in a run of a larger class in use are free; each stretch
+ * of them is split into the runs of the largest classes first.
+ */
+static void
+_rebuild_free_runs(advfs_t *advfs, const uint32_t *ref, const uint32_t *pref,
+                   uint8_t *isfree)
+{
+    advfs_superblock_t *sb;
+    advfs_free_list_t *fl;
+    advfs_block_mgt_t mgt;
+    uint64_t b;
+    uint64_t e;
+    uint64_t i;
+    uint64_t n;
+    int c;
+
+    sb = advfs->superblock;
+    for ( b = sb->ptr_block; b < sb->brk; b++ ) {
+        isfree[b] = 1;
+    }
+    for ( b = sb->ptr_block; b < sb->brk; b++ ) {
+        if ( 0 == ref[b] && 0 == pref[b] ) {
+            continue;
+        }
+        advfs_read_block_mgt(advfs, &mgt, b);
+        n = ADVFS_BCLASS_BLOCKS(mgt.bclass);
+        for ( i = 0; i < n && b + i < sb->brk; i++ ) {
+            isfree[b + i] = 0;
+        }
+    }
+
+    sb->freelist = 0;
+    for ( c = 0; c < ADVFS_BCLASS_NUM; c++ ) {
+        sb->class_freelist[c] = 0;
+    }
+    sb->n_block_used = sb->brk - sb->ptr_block;
+    for ( b = sb->ptr_block; b < sb->brk; b = e ) {
+        for ( e = b; e < sb->brk && isfree[e]; e++ ) {
+        }
+        if ( e == b ) {
+            e++;
+            continue;
+        }
+        sb->n_block_used -= e - b;
+        advfs_log_mark_free(advfs, b, e - b, 1);
+        for ( i = b; i < e; i++ ) {
+            advfs_read_block_mgt(advfs, &mgt, i);
+            if ( mgt.ref ) {
+                /* Allocated but no longer referenced */
+                mgt.ref = 0;
+                advfs_write_block_mgt(advfs, &mgt, i);
+                advfs->rstats.leaked++;
+            }
+        }
+        for ( i = b; i < e; i += ADVFS_BCLASS_BLOCKS(c) ) {
+            for ( c = ADVFS_BCLASS_NUM - 1;
+                  c > 0 && i + ADVFS_BCLASS_BLOCKS(c) > e; c-- ) {
+            }
+            fl = (void *)((uint8_t *)sb + i * ADVFS_BLOCK_SIZE);
+            if ( 0 == c ) {
+                fl->next = sb->freelist;
+                sb->freelist = i;
+            } else {
+                fl->next = sb->class_freelist[c];
+                sb->class_freelist[c] = i;
+            }
+        }
+    }
+
+    /* The stale copies of the free blocks in the log are no longer needed */
+    advfs_log_drop_free(advfs);
+}
+
+/*
+ * Correct the reference counters, and release the blocks and the compressed
+ * block ids no longer referenced
+ */
+static void
+_rebuild_apply(advfs_t *advfs, const uint32_t *ref, const uint8_t *isfree,
+               const uint32_t *pref, const uint64_t *pmask)
+{
+    advfs_superblock_t *sb;
+    advfs_block_mgt_t mgt;
+    uint64_t b;
+
+    sb = advfs->superblock;
+    for ( b = sb->ptr_block; b < sb->brk; b++ ) {
+        if ( isfree[b] ) {
+            continue;
+        }
+        advfs_read_block_mgt(advfs, &mgt, b);
+        if ( ADVFS_BLOCK_PACK == mgt.type ) {
+            /* Referenced by the compressed blocks in the slots */
+            if ( pref[b] == mgt.ref && pmask[b] == mgt.zmask ) {
+                continue;
+            }
+            if ( 0 == pref[b] ) {
+                mgt.ref = 0;
+                advfs_write_block_mgt(advfs, &mgt, b);
+                advfs_free_block(advfs, b);
+                advfs->rstats.leaked++;
+                continue;
+            }
+            mgt.ref = pref[b];
+            mgt.zmask = pmask[b];
+        } else if ( ref[b] == mgt.ref ) {
+            continue;
+        } else if ( 0 == ref[b] ) {
+            /* Release it as the last reference to a block out of the tree,
+               to the free list of its block size class */
+            mgt.ref = 1;
+            mgt.type = ADVFS_BLOCK_META;
+            advfs_write_block_mgt(advfs, &mgt, b);
+            advfs_release_block(advfs, b);
+            advfs->rstats.leaked++;
+            continue;
+        } else {
+            mgt.ref = ref[b];
+        }
+        advfs_write_block_mgt(advfs, &mgt, b);
+        advfs->rstats.fixed++;
+    }
+
+    for ( b = ADVFS_ZBLOCK_BASE; b < ADVFS_ZBLOCK_BASE + sb->n_zblocks; b++ ) {
+        if ( isfree[b] ) {
+            continue;
+        }
+        advfs_read_block_mgt(advfs, &mgt, b);
+        if ( ref[b] == mgt.ref ) {
+            continue;
+        }
+        if ( 0 == ref[b] ) {
+            /* The slots are already out of the pack block */
+            mgt.ref = 0;
+            mgt.left = sb->zfreelist;
+            sb->zfreelist = b;
+            advfs->rstats.leaked++;
+        } else {
+            mgt.ref = ref[b];
+            advfs->rstats.fixed++;
+        }
+        advfs_write_block_mgt(advfs, &mgt, b);
+    }
+}
+
+/*
+ * Compare the keys by the hash value
+ */
+static int
+_rebuild_key_cmp(const void *a, const void *b)
+{
+    const struct _rebuild_key *x;
+    const struct _rebuild_key *y;
+
+    x = a;
+    y = b;
+
+    return memcmp(x->hash, y->hash, sizeof(x->hash));
+}
+
+/*
+ * Load the dedup tree of each block size class from the sorted hash values
+ * of the data blocks referenced
+ */
+static int
+_rebuild_tree(advfs_t *advfs, const uint32_t *ref, const uint8_t *isfree,
+              uint64_t nids)
+{
+    struct _rebuild_key *keys;
+    advfs_block_mgt_t mgt;
+    uint64_t *nrs;
+    uint64_t n;
+    uint64_t m;
+    uint64_t b;
+    uint64_t i;
+    int c;
+
+    keys = malloc(nids * sizeof(struct _rebuild_key));
+    nrs = malloc(nids * sizeof(uint64_t));
+    if ( NULL == keys || NULL == nrs ) {
+        free(keys);
+        free(nrs);
+        return -1;
+    }
+    for ( c = 0; c < ADVFS_BCLASS_NUM; c++ ) {
+        n = 0;
+        for ( b = 0; b < nids; b++ ) {
+            if ( 0 == ref[b] || isfree[b] ) {
+                continue;
+            }
+            advfs_read_block_mgt(advfs, &mgt, b);
+            if ( ADVFS_BLOCK_DATA != mgt.type || (uint64_t)c != mgt.bclass ) {
+                continue;
+            }
+            memcpy(keys[n].hash, mgt.hash, sizeof(keys[n].hash));
+            keys[n].b = b;
+            n++;
+        }
+        qsort(keys, n, sizeof(struct _rebuild_key), _rebuild_key_cmp);
+
+        /* A block of a duplicate hash value is left out of the tree */
+        m = 0;
+        for ( i = 0; i < n; i++ ) {
+            if ( i > 0 && 0 == _rebuild_key_cmp(&keys[i - 1], &keys[i]) ) {
+                continue;
+            }
+            nrs[m++] = keys[i].b;
+        }
+        advfs_block_build(advfs, c, nrs, m);
+        advfs->rstats.nodes += m;
+    }
+    free(keys);
+    free(nrs);
+
+    return 0;
+}
+
+/*
+ * Rebuild the reference counters and the dedup tree of the loaded image
+ */
+int
+advfs_rebuild(advfs_t *advfs)
+{
+    struct _rebuild_worker w[ADVFS_REBUILD_THREADS_MAX];
+    advfs_block_mgt_t mgt;
+    advfs_superblock_t *sb;
+    uint8_t *isfree;
+    uint32_t *pref;
+    uint64_t *pmask;
+    uint64_t nids;
+    uint64_t b;
+    uint64_t next;
+    uint64_t s;
+    uint64_t i;
+    long ncpu;
+    int nw;
+    int ret;
+    uint64_t t0;
+
+    t0 = _now_ns();
+    sb = advfs->superblock;
+    nids = ADVFS_ZBLOCK_BASE + sb->n_zblocks;
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nw = (ncpu < 1) ? 1 : (ncpu > ADVFS_REBUILD_THREADS_MAX)
+        ? ADVFS_REBUILD_THREADS_MAX : (int)ncpu;
+    memset(w, 0, sizeof(w));
+
+    isfree = calloc(nids, sizeof(uint8_t));
+    pref = calloc(ADVFS_BLOCK_NUM, sizeof(uint32_t));
+    pmask = calloc(ADVFS_BLOCK_NUM, sizeof(uint64_t));
+    ret = -1;
+    if ( NULL == isfree || NULL == pref || NULL == pmask
+         || _rebuild_count(advfs, w, nw, nids) < 0 ) {
+        goto out;
+    }
+
+    /* The rest of the blocks of the extent tables are referenced once by
+       the table whoever shares it */
+    for ( b = 0; b < ADVFS_BLOCK_NUM; b++ ) {
+        if ( !w[0].exthead[b] ) {
+            continue;
+        }
+        next = ((advfs_extent_block_t *)((uint8_t *)sb
+                                         + b * ADVFS_BLOCK_SIZE))->next;
+        while ( next < ADVFS_BLOCK_NUM && _rebuild_valid(advfs, next) ) {
+            w[0].ref[next]++;
+            next = ((advfs_extent_block_t *)((uint8_t *)sb
+                                             + next * ADVFS_BLOCK_SIZE))->next;
+        }
+    }
+
+    /* The copies of the inode table */
+    for ( s = 1; s <= ADVFS_SNAPSHOT_NUM; s++ ) {
+        if ( !_rebuild_table(advfs, s) ) {
+            continue;
+        }
+        for ( i = 0; i < ADVFS_INODE_TABLE_BLOCKS; i++ ) {
+            if ( _rebuild_valid(advfs, sb->snapshots[s - 1].table[i]) ) {
+                w[0].ref[sb->snapshots[s - 1].table[i]]++;
+            }
+        }
+    }
+
+    /* The pack blocks are referenced by the compressed blocks in them */
+    _rebuild_mark_free(advfs, isfree);
+    for ( b = ADVFS_ZBLOCK_BASE; b < nids; b++ ) {
+        if ( 0 == w[0].ref[b] || isfree[b] ) {
+            continue;
+        }
+        advfs_read_block_mgt(advfs, &mgt, b);
+        if ( mgt.zblock < ADVFS_BLOCK_NUM ) {
+            pref[mgt.zblock]++;
+            pmask[mgt.zblock]
+                |= ((1ULL << ((mgt.zlen + ADVFS_ZSLOT_SIZE - 1)
+                              / ADVFS_ZSLOT_SIZE)) - 1) << mgt.zslot;
+        }
+    }
+
+    if ( advfs->log ) {
+        _rebuild_free_runs(advfs, w[0].ref, pref, isfree);
+    }
+    _rebuild_apply(advfs, w[0].ref, isfree, pref, pmask);
+    if ( _rebuild_tree(advfs, w[0].ref, isfree, nids) < 0 ) {
+        goto out;
+    }
+
+    advfs->rstats.threads = nw;
+    advfs->rstats.inodes = w[0].inodes;
+    advfs->rstats.ns = _now_ns() - t0;
+    ret = 0;
+out:
+    for ( i = 0; i < (uint64_t)nw; i++ ) {
+        free(w[i].ref);
+        free(w[i].exthead);
+    }
+    free(isfree);
+    free(pref);
+    free(pmask);
+
+    return ret;
+}
+
+/*
+ * Rebuild statistics as "key=value" lines
+ */
+int
+advfs_rebuild_stats(advfs_t *advfs, char *buf, size_t size)
+{
+    advfs_rstats_t *st;
+
+    st = &advfs->rstats;
+
+    return snprintf(buf, size,
+                    "rebuild_threads=%llu\n"
+                    "rebuild_inodes=%llu\n"
+                    "rebuild_tree_nodes=%llu\n"
+                    "rebuild_fixed_refs=%llu\n"
+                    "rebuild_leaked_blocks=%llu\n"
+                    "rebuild_ms=%.1f\n",
+                    (unsigned long long)st->threads,
+                    (unsigned long long)st->inodes,
+                    (unsigned long long)st->nodes,
+                    (unsigned long long)st->fixed,
+                    (unsigned long long)st->leaked,
+                    st->ns / 1000000.0);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,218 @@
+/*_
+ * Copyright (c) 2019 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "advfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+/*
+ * Look up the snapshot by name; returns the index, or -1 if not found
+ */
+int
+advfs_snapshot_lookup(advfs_t *advfs, const char *name, size_t len)
+{
+    advfs_snapshot_t *s;
+    int i;
+
+    if ( len > ADVFS_SNAPSHOT_NAME_MAX ) {
+        return -1;
+    }
+    for ( i = 0; i < ADVFS_SNAPSHOT_NUM; i++ ) {
+        s = &advfs->superblock->snapshots[i];
+        if ( 0 != s->table[0] && 0 == strncmp(s->name, name, len)
+             && '\0' == s->name[len] ) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Release the block maps shared with the first n inodes of the copy
+ */
+static void
+_snapshot_unshare(advfs_t *advfs, advfs_inode_t *table, uint64_t n)
+{
+    uint64_t i;
+
+    for ( i = 0; i < n; i++ ) {
+        if ( ADVFS_UNUSED != table[i].attr.type ) {
+            advfs_release_block_map(advfs, &table[i]);
+        }
+    }
+}
+
+/*
+ * Take a snapshot of the whole tree.  The inode table is copied, and each
+ * inode in the copy references the blocks of the live inode through its own
+ * chain of the block map; the live tree then copies a shared block on write.
+ * The references are taken at once, so that the cost is linear in the number
+ * of the blocks in use rather than constant; the per-block reference counts
+ * stay the single source of the sharing for the rest of the file system.
+ */
+int
+advfs_snapshot_create(advfs_t *advfs, const char *name)
+{
+    advfs_superblock_t sb;
+    advfs_inode_t *table;
+    struct timeval tv;
+    uint64_t blocks[ADVFS_INODE_TABLE_BLOCKS];
+    uint64_t need;
+    uint64_t i;
+    size_t len;
+    int slot;
+    int ret;
+
+    len = strlen(name);
+    if ( 0 == len || NULL != index(name, '/') ) {
+        return -EINVAL;
+    }
+    if ( len > ADVFS_SNAPSHOT_NAME_MAX ) {
+        return -ENAMETOOLONG;
+    }
+    if ( advfs_snapshot_lookup(advfs, name, len) >= 0 ) {
+        return -EEXIST;
+    }
+
+    /* Find a free slot */
+    advfs_read_superblock(advfs, &sb);
+    for ( slot = 0; slot < ADVFS_SNAPSHOT_NUM; slot++ ) {
+        if ( 0 == sb.snapshots[slot].table[0] ) {
+            break;
+        }
+    }
+    if ( slot == ADVFS_SNAPSHOT_NUM ) {
+        return -ENOSPC;
+    }
+
+    table = malloc(sizeof(advfs_inode_t) * ADVFS_INODE_NUM);
+    if ( NULL == table ) {
+        return -ENOMEM;
+    }
+    for ( i = 0; i < ADVFS_INODE_NUM; i++ ) {
+        advfs_read_inode(advfs, &table[i], i);
+    }
+
+    /* Check the space for the copy of the inode table and the chains of the
+       block maps not to fail halfway */
+    need = ADVFS_INODE_TABLE_BLOCKS;
+    for ( i = 0; i < ADVFS_INODE_NUM; i++ ) {
+        if ( ADVFS_UNUSED == table[i].attr.type ) {
+            continue;
+        }
+        need += advfs_chain_count(table[i].attr.n_blocks);
+    }
+    if ( sb.n_block_used + need > sb.n_blocks ) {
+        free(table);
+        return -ENOSPC;
+    }
+
+    /* Share the blocks */
+    for ( i = 0; i < ADVFS_INODE_NUM; i++ ) {
+        if ( ADVFS_UNUSED == table[i].attr.type ) {
+            continue;
+        }
+        ret = advfs_share_block_map(advfs, &table[i]);
+        if ( 0 != ret ) {
+            _snapshot_unshare(advfs, table, i);
+            free(table);
+            return -ENOSPC;
+        }
+    }
+
+    /* Write the copy of the inode table */
+    for ( i = 0; i < ADVFS_INODE_TABLE_BLOCKS; i++ ) {
+        blocks[i] = advfs_alloc_meta_block(advfs);
+        if ( 0 == blocks[i] ) {
+            while ( i > 0 ) {
+                advfs_release_block(advfs, blocks[--i]);
+            }
+            _snapshot_unshare(advfs, table, ADVFS_INODE_NUM);
+            free(table);
+            return -ENOSPC;
+        }
+        advfs_write_raw_block(advfs, (uint8_t *)table + ADVFS_BLOCK_SIZE * i,
+                              blocks[i]);
+    }
+    free(table);
+
+    /* Register */
+    gettimeofday(&tv, NULL);
+    advfs_read_superblock(advfs, &sb);
+    memset(sb.snapshots[slot].name, 0, sizeof(sb.snapshots[slot].name));
+    memcpy(sb.snapshots[slot].name, name, len);
+    sb.snapshots[slot].ctime = tv.tv_sec;
+    memcpy(sb.snapshots[slot].table, blocks, sizeof(blocks));
+    advfs_write_superblock(advfs, &sb);
+
+    return 0;
+}
+
+/*
+ * Delete a snapshot, and release the blocks no longer referenced
+ */
+int
+advfs_snapshot_delete(advfs_t *advfs, const char *name)
+{
+    advfs_superblock_t sb;
+    advfs_inode_t inodes[ADVFS_BLOCK_SIZE / sizeof(advfs_inode_t)];
+    uint64_t blocks[ADVFS_INODE_TABLE_BLOCKS];
+    uint64_t i;
+    uint64_t j;
+    int slot;
+
+    slot = advfs_snapshot_lookup(advfs, name, strlen(name));
+    if ( slot < 0 ) {
+        return -ENOENT;
+    }
+
+    /* Unregister first so that the inodes are no longer reachable */
+    advfs_read_superblock(advfs, &sb);
+    memcpy(blocks, sb.snapshots[slot].table, sizeof(blocks));
+    memset(&sb.snapshots[slot], 0, sizeof(advfs_snapshot_t));
+    advfs_write_superblock(advfs, &sb);
+
+    for ( i = 0; i < ADVFS_INODE_TABLE_BLOCKS; i++ ) {
+        advfs_read_raw_block(advfs, inodes, blocks[i]);
+        for ( j = 0; j < ADVFS_BLOCK_SIZE / sizeof(advfs_inode_t); j++ ) {
+            if ( ADVFS_UNUSED != inodes[j].attr.type ) {
+                advfs_release_block_map(advfs, &inodes[j]);
+            }
+        }
+        advfs_release_block(advfs, blocks[i]);
+    }
+
+    return 0;
+}
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */